@@ -0,0 +1,295 @@
+/**
+    @file
+
+    Deadlines and cancellation for long-running operations.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the 
+    OpenSSL project's "OpenSSL" library (or with modified versions of it, 
+    with unchanged license). You may copy and distribute such a system 
+    following the terms of the GNU GPL for this program and the licenses 
+    of the other code concerned. The GNU General Public License gives 
+    permission to release a modified version without this exception; this 
+    exception also makes it possible to release a modified version which 
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_DEADLINE_HPP
+#define SSH_DEADLINE_HPP
+
+#include <ssh/detail/session_state.hpp>
+#include <ssh/ssh_error.hpp> // ssh_error_category
+
+#include <boost/date_time/posix_time/posix_time_types.hpp> // time_duration
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/optional/optional.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/system/error_code.hpp> // errc
+#include <boost/system/system_error.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread_time.hpp> // get_system_time, system_time
+#include <boost/throw_exception.hpp> // BOOST_THROW_EXCEPTION
+
+#include <algorithm> // max
+#include <limits> // numeric_limits
+
+#include <libssh2.h> // libssh2_session_*_timeout, LIBSSH2_ERROR_TIMEOUT
+
+namespace ssh {
+
+namespace detail {
+
+    class cancellation_flag : private boost::noncopyable
+    {
+    public:
+        cancellation_flag() : m_cancelled(false) {}
+
+        void set()
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_cancelled = true;
+        }
+
+        bool is_set() const
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            return m_cancelled;
+        }
+
+    private:
+        mutable boost::mutex m_mutex;
+        bool m_cancelled;
+    };
+
+}
+
+/**
+ * Lets one thread ask operations running in another to give up.
+ *
+ * Copies share the same state so cancelling any copy cancels them all.
+ */
+class cancellation_token
+{
+public:
+    cancellation_token()
+        : m_flag(boost::make_shared<detail::cancellation_flag>()) {}
+
+    void cancel()
+    {
+        m_flag->set();
+    }
+
+    bool cancelled() const
+    {
+        return m_flag->is_set();
+    }
+
+private:
+    boost::shared_ptr<detail::cancellation_flag> m_flag;
+};
+
+/**
+ * Point after which an operation should stop waiting for the server,
+ * optionally combined with a token that can stop it sooner.
+ *
+ * Operations check the deadline between round trips to the server and
+ * stop with a `boost::system::system_error` whose code is
+ * `errc::timed_out` or `errc::operation_canceled`.  If the deadline passes
+ * while the operation is waiting on the server mid-request, the protocol
+ * state of the connection can no longer be trusted, so the session is
+ * marked dead as well; every later operation on it fails immediately.
+ *
+ * A default-constructed deadline never expires.  A deadline replaces the
+ * session's own timeout for the operations it is given to.
+ */
+class deadline
+{
+public:
+
+    /**
+     * Deadline that never expires.
+     */
+    deadline() {}
+
+    explicit deadline(boost::posix_time::time_duration timeout)
+        : m_expiry(boost::get_system_time() + timeout) {}
+
+    explicit deadline(const cancellation_token& token) : m_token(token) {}
+
+    deadline(
+        boost::posix_time::time_duration timeout,
+        const cancellation_token& token)
+        : m_expiry(boost::get_system_time() + timeout), m_token(token) {}
+
+    /**
+     * Can this deadline ever stop an operation?
+     */
+    bool limited() const
+    {
+        return m_expiry || m_token;
+    }
+
+    bool expired() const
+    {
+        return m_expiry && boost::get_system_time() >= *m_expiry;
+    }
+
+    bool cancelled() const
+    {
+        return m_token && m_token->cancelled();
+    }
+
+    /**
+     * Throw if the deadline has passed or the operation was cancelled.
+     */
+    void check() const
+    {
+        if (cancelled())
+        {
+            BOOST_THROW_EXCEPTION(
+                boost::system::system_error(
+                    boost::system::errc::make_error_code(
+                        boost::system::errc::operation_canceled)));
+        }
+        else if (expired())
+        {
+            BOOST_THROW_EXCEPTION(
+                boost::system::system_error(
+                    boost::system::errc::make_error_code(
+                        boost::system::errc::timed_out)));
+        }
+    }
+
+    /// @cond INTERNAL
+    /**
+     * How long the next wait on the server may last before the deadline
+     * must be looked at again, in the milliseconds libssh2 timeouts use.
+     *
+     * Never zero as libssh2 treats that as waiting forever.
+     */
+    long wait_slice_milliseconds() const
+    {
+        // Cancellation can only be noticed between waits so waits must be
+        // short when a token is involved
+        long slice = (m_token) ? 250 : (std::numeric_limits<long>::max)();
+
+        if (m_expiry)
+        {
+            boost::posix_time::time_duration remaining =
+                *m_expiry - boost::get_system_time();
+            if (remaining.total_milliseconds() < slice)
+            {
+                slice = static_cast<long>(remaining.total_milliseconds());
+            }
+        }
+
+        return (std::max)(slice, 1L);
+    }
+    /// @endcond
+
+private:
+    boost::optional<boost::system_time> m_expiry;
+    boost::optional<cancellation_token> m_token;
+};
+
+namespace detail {
+
+    /**
+     * Limits how long blocking libssh2 calls on a locked session may wait,
+     * so that a deadline can be looked at between waits.
+     *
+     * Restores the session's own timeout when destroyed.  Has no effect for
+     * a deadline that is not limited.
+     */
+    class deadline_slice : private boost::noncopyable
+    {
+    public:
+        deadline_slice(LIBSSH2_SESSION* session, const deadline& limit)
+            :
+        m_session(session), m_limited(limit.limited()),
+        m_old_timeout(::libssh2_session_get_timeout(session))
+        {
+            if (m_limited)
+            {
+                ::libssh2_session_set_timeout(
+                    m_session, limit.wait_slice_milliseconds());
+            }
+        }
+
+        ~deadline_slice()
+        {
+            if (m_limited)
+            {
+                ::libssh2_session_set_timeout(m_session, m_old_timeout);
+            }
+        }
+
+    private:
+        LIBSSH2_SESSION* m_session;
+        bool m_limited;
+        long m_old_timeout;
+    };
+
+    /**
+     * Decide whether a blocking call that failed under a `deadline_slice`
+     * only stopped so the deadline could be looked at.
+     *
+     * @returns `true` if the call should be repeated with the same
+     *          arguments, which resumes it where it left off.  `false` if
+     *          the failure is a real error to be reported as usual.
+     * @throws  `boost::system::system_error` if the deadline has passed or
+     *          the operation was cancelled.  The session is marked dead first
+     *          because the abandoned call leaves its protocol state unusable.
+     */
+    inline bool resume_after_wait_slice(
+        const boost::system::error_code& ec, session_state& session,
+        const deadline& limit)
+    {
+        if (!limit.limited() ||
+            ec != boost::system::error_code(
+                LIBSSH2_ERROR_TIMEOUT, ssh_error_category()))
+        {
+            return false;
+        }
+
+        if (limit.expired() || limit.cancelled())
+        {
+            session.mark_dead();
+            limit.check();
+        }
+
+        // The timer may fire fractionally before the deadline so the next
+        // wait must be sized from what is left now, not what was left when
+        // the slice began.  The slice restores the original timeout.
+        ::libssh2_session_set_timeout(
+            session.session_ptr(), limit.wait_slice_milliseconds());
+
+        return true;
+    }
+
+}
+
+} // namespace ssh
+
+#endif
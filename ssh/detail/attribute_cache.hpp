@@ -0,0 +1,248 @@
+/**
+    @file
+
+    Remembering remote file attributes between requests.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the 
+    OpenSSL project's "OpenSSL" library (or with modified versions of it, 
+    with unchanged license). You may copy and distribute such a system 
+    following the terms of the GNU GPL for this program and the licenses 
+    of the other code concerned. The GNU General Public License gives 
+    permission to release a modified version without this exception; this 
+    exception also makes it possible to release a modified version which 
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_DETAIL_ATTRIBUTE_CACHE_HPP
+#define SSH_DETAIL_ATTRIBUTE_CACHE_HPP
+
+#include <ssh/detail/expiring_lru_cache.hpp>
+
+#include <boost/date_time/posix_time/posix_time_types.hpp> // time_duration
+#include <boost/noncopyable.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <cstddef> // size_t
+#include <string>
+#include <utility> // pair
+
+#include <libssh2_sftp.h> // LIBSSH2_SFTP_ATTRIBUTES, LIBSSH2_SFTP_S_*
+
+namespace ssh {
+namespace detail {
+
+/**
+ * What was last learnt from the server about a path: its attributes or why
+ * it could not be statted.
+ */
+struct cached_attributes
+{
+    LIBSSH2_SFTP_ATTRIBUTES attributes;
+
+    /// Set for a path that did not exist.
+    boost::system::error_code missing;
+};
+
+/**
+ * Bounded, expiring record of the attributes of remote paths.
+ *
+ * Entries are kept separately for statting the path itself and for statting
+ * whatever it links to.  Entries expire after a fixed time and, once the
+ * cache is full, the least recently used entry makes way for a new one.
+ *
+ * Changes made through other connections, or to the target of a link, are
+ * only noticed once an entry expires.
+ *
+ * Safe to use from several threads at once.
+ */
+class attribute_cache : private boost::noncopyable
+{
+public:
+
+    attribute_cache(
+        const boost::posix_time::time_duration& time_to_live,
+        std::size_t max_entries)
+        : m_entries(time_to_live, max_entries) {}
+
+    /**
+     * Look up a path.
+     *
+     * A path found missing without following links is missing however it
+     * is statted, so that entry also answers lookups through links.
+     *
+     * @returns `true` and fills in `entry` if the path has an unexpired
+     *          entry.
+     */
+    bool find(
+        const std::string& path, bool follow_links, cached_attributes& entry)
+    {
+        scoped_lock lock(m_mutex);
+
+        if (m_entries.find(key(path, follow_links), entry))
+        {
+            return true;
+        }
+
+        return follow_links && m_entries.find(key(path, false), entry) &&
+            entry.missing;
+    }
+
+    void insert(
+        const std::string& path, bool follow_links,
+        const LIBSSH2_SFTP_ATTRIBUTES& attributes)
+    {
+        cached_attributes entry = cached_attributes();
+        entry.attributes = attributes;
+
+        scoped_lock lock(m_mutex);
+        m_entries.store(key(path, follow_links), entry);
+    }
+
+    /**
+     * Record that statting the path found nothing there.
+     *
+     * Takes a single entry either way; see `find`.
+     */
+    void insert_missing(
+        const std::string& path, bool follow_links,
+        const boost::system::error_code& ec)
+    {
+        cached_attributes entry = cached_attributes();
+        entry.missing = ec;
+
+        scoped_lock lock(m_mutex);
+        m_entries.store(key(path, follow_links), entry);
+
+        // Nothing there means no link to follow either, so an entry from
+        // when something was there would hide this one
+        if (!follow_links)
+        {
+            m_entries.erase(key(path, true));
+        }
+    }
+
+    /**
+     * Record attributes that came from listing the path's directory.
+     *
+     * Servers list the attributes of the entry itself, which are also what
+     * statting it through links finds unless it is a link.
+     */
+    void insert_listed(
+        const std::string& path, const LIBSSH2_SFTP_ATTRIBUTES& attributes)
+    {
+        insert(path, false, attributes);
+
+        if ((attributes.flags & LIBSSH2_SFTP_ATTR_PERMISSIONS) &&
+            (attributes.permissions & LIBSSH2_SFTP_S_IFMT) !=
+                LIBSSH2_SFTP_S_IFLNK)
+        {
+            insert(path, true, attributes);
+        }
+    }
+
+    /**
+     * Drop the entries for the path and everything below it.
+     *
+     * Trailing `/` and `/.` are ignored, so `/a`, `/a/` and `/a/./` all
+     * forget the same entries.
+     */
+    void forget(const std::string& unnormalised_path)
+    {
+        std::string path = directory_prefix(unnormalised_path);
+
+        scoped_lock lock(m_mutex);
+
+        // Everything below the path sorts after it but may be interleaved
+        // with siblings that merely share its prefix, such as `a-b` after
+        // `a` and before `a/b`
+        entry_cache::iterator it = m_entries.lower_bound(key(path, false));
+        while (it != m_entries.end() &&
+            it->first.first.compare(0, path.size(), path) == 0)
+        {
+            const std::string& candidate = it->first.first;
+            if (candidate.size() == path.size() ||
+                candidate[path.size()] == '/' ||
+                (!path.empty() && path[path.size() - 1] == '/'))
+            {
+                it = m_entries.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    void clear()
+    {
+        scoped_lock lock(m_mutex);
+
+        m_entries.clear();
+    }
+
+    std::size_t size() const
+    {
+        scoped_lock lock(m_mutex);
+
+        return m_entries.size();
+    }
+
+private:
+
+    typedef boost::mutex::scoped_lock scoped_lock;
+    typedef std::pair<std::string, bool> key;
+    typedef expiring_lru_cache<key, cached_attributes> entry_cache;
+
+    /**
+     * The path without trailing `/` or `/.`, except that the root stays
+     * `/`.
+     */
+    static std::string directory_prefix(std::string path)
+    {
+        for (;;)
+        {
+            if (path.size() > 1 && path[path.size() - 1] == '/')
+            {
+                path.erase(path.size() - 1);
+            }
+            else if (path.size() > 1 &&
+                path.compare(path.size() - 2, 2, "/.") == 0)
+            {
+                path.erase(path.size() - 1);
+            }
+            else
+            {
+                return path;
+            }
+        }
+    }
+
+    mutable boost::mutex m_mutex;
+    entry_cache m_entries;
+};
+
+}} // namespace ssh::detail
+
+#endif
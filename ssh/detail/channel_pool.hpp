@@ -0,0 +1,109 @@
+/**
+    @file
+
+    SFTP channels kept open between pipelines.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the 
+    OpenSSL project's "OpenSSL" library (or with modified versions of it, 
+    with unchanged license). You may copy and distribute such a system 
+    following the terms of the GNU GPL for this program and the licenses 
+    of the other code concerned. The GNU General Public License gives 
+    permission to release a modified version without this exception; this 
+    exception also makes it possible to release a modified version which 
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_DETAIL_CHANNEL_POOL_HPP
+#define SSH_DETAIL_CHANNEL_POOL_HPP
+
+#include <ssh/detail/sftp_channel_state.hpp>
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <algorithm> // min
+#include <cstddef> // size_t
+#include <vector>
+
+namespace ssh {
+namespace detail {
+
+/**
+ * Spare SFTP channels, so that each batch of pipelined requests need not
+ * pay the round trips of opening its own.
+ *
+ * Each channel is only ever held by one pipeline at a time.  Channels must
+ * only be given back with no request outstanding, which is the case once
+ * a pipeline's `run` has returned normally.
+ *
+ * Safe to use from several threads at once.
+ */
+class channel_pool : private boost::noncopyable
+{
+public:
+    typedef std::vector<boost::shared_ptr<sftp_channel_state> > channel_list;
+
+    explicit channel_pool(std::size_t max_channels)
+        : m_max_channels(max_channels) {}
+
+    /**
+     * Take up to `count` of the spare channels, or none if there are none.
+     */
+    channel_list take(std::size_t count)
+    {
+        scoped_lock lock(m_mutex);
+
+        count = (std::min)(count, m_channels.size());
+        channel_list taken(m_channels.end() - count, m_channels.end());
+        m_channels.resize(m_channels.size() - count);
+        return taken;
+    }
+
+    /**
+     * Keep channels for later, up to the pool's limit; the rest are closed.
+     */
+    void give_back(const channel_list& channels)
+    {
+        scoped_lock lock(m_mutex);
+
+        for (std::size_t i = 0;
+            i < channels.size() && m_channels.size() < m_max_channels; ++i)
+        {
+            m_channels.push_back(channels[i]);
+        }
+    }
+
+private:
+
+    typedef boost::mutex::scoped_lock scoped_lock;
+
+    boost::mutex m_mutex;
+    std::size_t m_max_channels;
+    channel_list m_channels;
+};
+
+}} // namespace ssh::detail
+
+#endif
@@ -0,0 +1,295 @@
+/**
+    @file
+
+    Pipelined summing of the space used below a remote directory.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the 
+    OpenSSL project's "OpenSSL" library (or with modified versions of it, 
+    with unchanged license). You may copy and distribute such a system 
+    following the terms of the GNU GPL for this program and the licenses 
+    of the other code concerned. The GNU General Public License gives 
+    permission to release a modified version without this exception; this 
+    exception also makes it possible to release a modified version which 
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_DETAIL_DISK_USAGE_STATE_HPP
+#define SSH_DETAIL_DISK_USAGE_STATE_HPP
+
+#include <ssh/detail/sftp_channel_state.hpp>
+#include <ssh/detail/sftp_pipeline.hpp>
+
+#include <boost/cstdint.hpp> // uintmax_t
+#include <boost/make_shared.hpp>
+#include <boost/ref.hpp> // ref
+#include <boost/shared_ptr.hpp>
+#include <boost/system/error_code.hpp>
+
+#include <algorithm> // min
+#include <cstddef> // size_t
+#include <string>
+#include <vector>
+
+#include <libssh2_sftp.h>
+
+namespace ssh {
+namespace detail {
+
+/**
+ * Running totals for one directory of the tree being summed.
+ *
+ * Only directories get a node; files are added to their directory's totals
+ * as they are listed and never stored.
+ */
+struct usage_node
+{
+    usage_node(std::size_t parent, const std::string& name)
+        :
+    parent(parent), name(name), bytes(0U), files(0U), directories(0U),
+    complete(true) {}
+
+    /// Index of the parent's node; the root is its own parent.
+    std::size_t parent;
+
+    /// Name in the parent directory or, for the root, its full path.
+    std::string name;
+
+    boost::uintmax_t bytes;
+    boost::uintmax_t files;
+    boost::uintmax_t directories;
+    bool complete;
+};
+
+class usage_state : public pipeline_source
+{
+public:
+    explicit usage_state(const std::string& root)
+        : m_root_error_api(NULL)
+    {
+        m_nodes.push_back(usage_node(0U, root));
+        m_pending.push_back(0U);
+    }
+
+    virtual boost::shared_ptr<pipeline_task> next_task();
+
+    void add_entry(
+        std::size_t directory, const char* name, std::size_t name_length,
+        const LIBSSH2_SFTP_ATTRIBUTES& attributes)
+    {
+        if ((name_length == 1U && name[0] == '.') ||
+            (name_length == 2U && name[0] == '.' && name[1] == '.'))
+        {
+            return;
+        }
+
+        if ((attributes.flags & LIBSSH2_SFTP_ATTR_PERMISSIONS) &&
+            (attributes.permissions & LIBSSH2_SFTP_S_IFMT) ==
+                LIBSSH2_SFTP_S_IFDIR)
+        {
+            m_nodes[directory].directories += 1U;
+            m_nodes.push_back(
+                usage_node(directory, std::string(name, name_length)));
+            m_pending.push_back(m_nodes.size() - 1);
+        }
+        else
+        {
+            m_nodes[directory].files += 1U;
+            if (attributes.flags & LIBSSH2_SFTP_ATTR_SIZE)
+            {
+                m_nodes[directory].bytes += attributes.filesize;
+            }
+        }
+    }
+
+    void add_error(
+        std::size_t directory, const boost::system::error_code& ec,
+        const char* api_function)
+    {
+        m_nodes[directory].complete = false;
+        if (directory == 0U && !m_root_error)
+        {
+            m_root_error = ec;
+            m_root_error_api = api_function;
+        }
+    }
+
+    /**
+     * Roll each directory's totals up into its ancestors'.
+     *
+     * Children are always added after their parent, so one pass from the
+     * back reaches every child before its parent.
+     */
+    void total()
+    {
+        for (std::size_t i = m_nodes.size() - 1; i > 0; --i)
+        {
+            usage_node& child = m_nodes[i];
+            usage_node& parent = m_nodes[child.parent];
+
+            parent.bytes += child.bytes;
+            parent.files += child.files;
+            parent.directories += child.directories;
+            parent.complete = parent.complete && child.complete;
+        }
+    }
+
+    std::string path_of(std::size_t node) const
+    {
+        if (node == 0U)
+        {
+            return m_nodes[0].name;
+        }
+
+        std::string parent = path_of(m_nodes[node].parent);
+        if (!parent.empty() && parent[parent.size() - 1] != '/')
+        {
+            parent += '/';
+        }
+
+        return parent + m_nodes[node].name;
+    }
+
+    const std::vector<usage_node>& nodes() const
+    {
+        return m_nodes;
+    }
+
+    boost::system::error_code root_error() const
+    {
+        return m_root_error;
+    }
+
+    /// Name of the libssh2 call that failed for the root, if one did.
+    const char* root_error_api() const
+    {
+        return m_root_error_api;
+    }
+
+private:
+    std::vector<usage_node> m_nodes;
+
+    /// Used as a stack so the walk is depth-first.
+    std::vector<std::size_t> m_pending;
+
+    boost::system::error_code m_root_error;
+    const char* m_root_error_api;
+};
+
+/**
+ * Lists one directory into its node's totals.
+ */
+class usage_list_task : public pipeline_task
+{
+public:
+    usage_list_task(std::size_t node, usage_state& state)
+        :
+    m_node(node), m_path(state.path_of(node)), m_state(state),
+    m_handle(NULL), m_stage(opening) {}
+
+    virtual bool resume(sftp_channel_state& channel)
+    {
+        boost::system::error_code ec;
+
+        if (m_stage == opening)
+        {
+            m_handle = ::libssh2_sftp_open_ex(
+                channel.sftp_ptr(), m_path.data(),
+                static_cast<unsigned int>(m_path.size()), 0, 0,
+                LIBSSH2_SFTP_OPENDIR);
+            if (!sftp_open_finished(m_handle, channel, ec))
+            {
+                return false;
+            }
+
+            if (ec)
+            {
+                m_state.add_error(m_node, ec, "libssh2_sftp_open_ex");
+                return true;
+            }
+
+            m_stage = reading;
+        }
+
+        while (m_stage == reading)
+        {
+            std::vector<char>& filename = channel.filename_buffer();
+            LIBSSH2_SFTP_ATTRIBUTES attributes = LIBSSH2_SFTP_ATTRIBUTES();
+
+            // The long entry is not asked for as only the attributes count
+            int rc = ::libssh2_sftp_readdir_ex(
+                m_handle, &filename[0], filename.size(), NULL, 0,
+                &attributes);
+            if (!sftp_call_finished(rc, channel, ec))
+            {
+                return false;
+            }
+
+            if (ec)
+            {
+                m_state.add_error(m_node, ec, "libssh2_sftp_readdir_ex");
+                m_stage = closing;
+            }
+            else if (rc == 0) // end of files
+            {
+                m_stage = closing;
+            }
+            else
+            {
+                m_state.add_entry(
+                    m_node, &filename[0],
+                    (std::min)(static_cast<size_t>(rc), filename.size()),
+                    attributes);
+            }
+        }
+
+        // Errors closing are ignored as the listing is already complete
+        int rc = ::libssh2_sftp_close_handle(m_handle);
+        return sftp_call_finished(rc, channel, ec);
+    }
+
+private:
+    enum stage { opening, reading, closing };
+
+    std::size_t m_node;
+    std::string m_path;
+    usage_state& m_state;
+    LIBSSH2_SFTP_HANDLE* m_handle;
+    stage m_stage;
+};
+
+inline boost::shared_ptr<pipeline_task> usage_state::next_task()
+{
+    if (m_pending.empty())
+    {
+        return boost::shared_ptr<pipeline_task>();
+    }
+
+    std::size_t node = m_pending.back();
+    m_pending.pop_back();
+    return boost::make_shared<usage_list_task>(node, boost::ref(*this));
+}
+
+}} // namespace ssh::detail
+
+#endif
@@ -0,0 +1,206 @@
+/**
+    @file
+
+    Bounded map whose entries expire.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the 
+    OpenSSL project's "OpenSSL" library (or with modified versions of it, 
+    with unchanged license). You may copy and distribute such a system 
+    following the terms of the GNU GPL for this program and the licenses 
+    of the other code concerned. The GNU General Public License gives 
+    permission to release a modified version without this exception; this 
+    exception also makes it possible to release a modified version which 
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_DETAIL_EXPIRING_LRU_CACHE_HPP
+#define SSH_DETAIL_EXPIRING_LRU_CACHE_HPP
+
+#include <boost/date_time/posix_time/posix_time_types.hpp> // microsec_clock
+#include <boost/noncopyable.hpp>
+
+#include <cstddef> // size_t
+#include <list>
+#include <map>
+#include <utility> // make_pair
+
+namespace ssh {
+namespace detail {
+
+/**
+ * Map whose entries expire a fixed time after they are stored and which,
+ * once full, forgets the least recently used entry to make way for a new
+ * one.
+ *
+ * Not synchronised: the caches built on it lock around each use, so that
+ * they can combine several operations atomically.
+ */
+template<typename Key, typename Value>
+class expiring_lru_cache : private boost::noncopyable
+{
+private:
+    typedef std::list<Key> recency_list;
+
+    struct entry
+    {
+        Value value;
+        boost::posix_time::ptime expiry;
+        typename recency_list::iterator recency_position;
+    };
+
+    typedef std::map<Key, entry> entry_map;
+
+public:
+
+    typedef typename entry_map::iterator iterator;
+
+    expiring_lru_cache(
+        const boost::posix_time::time_duration& time_to_live,
+        std::size_t max_entries)
+        : m_time_to_live(time_to_live), m_max_entries(max_entries) {}
+
+    /**
+     * Look up a key, counting it as used.
+     *
+     * @returns `true` and fills in `value` if the key has an unexpired
+     *          entry.  An expired entry is dropped.
+     */
+    bool find(const Key& key, Value& value)
+    {
+        iterator it = m_entries.find(key);
+        if (it == m_entries.end())
+        {
+            return false;
+        }
+
+        if (it->second.expiry <= now())
+        {
+            erase(it);
+            return false;
+        }
+
+        m_recency.splice(
+            m_recency.begin(), m_recency, it->second.recency_position);
+
+        value = it->second.value;
+        return true;
+    }
+
+    void store(const Key& key, const Value& value)
+    {
+        if (m_max_entries == 0U)
+        {
+            return;
+        }
+
+        iterator it = m_entries.find(key);
+        if (it == m_entries.end())
+        {
+            if (m_entries.size() >= m_max_entries)
+            {
+                erase(m_entries.find(m_recency.back()));
+            }
+
+            m_recency.push_front(key);
+
+            entry fresh;
+            fresh.recency_position = m_recency.begin();
+            it = m_entries.insert(std::make_pair(key, fresh)).first;
+        }
+        else
+        {
+            m_recency.splice(
+                m_recency.begin(), m_recency, it->second.recency_position);
+        }
+
+        it->second.value = value;
+        it->second.expiry = now() + m_time_to_live;
+    }
+
+    void erase(const Key& key)
+    {
+        iterator it = m_entries.find(key);
+        if (it != m_entries.end())
+        {
+            erase(it);
+        }
+    }
+
+    /**
+     * @returns the entry after the one erased.
+     */
+    iterator erase(iterator it)
+    {
+        iterator next = it;
+        ++next;
+
+        m_recency.erase(it->second.recency_position);
+        m_entries.erase(it);
+        return next;
+    }
+
+    /**
+     * First entry whose key is not less than `key`, for walking a range of
+     * keys in order.
+     */
+    iterator lower_bound(const Key& key)
+    {
+        return m_entries.lower_bound(key);
+    }
+
+    iterator end()
+    {
+        return m_entries.end();
+    }
+
+    void clear()
+    {
+        m_entries.clear();
+        m_recency.clear();
+    }
+
+    std::size_t size() const
+    {
+        return m_entries.size();
+    }
+
+private:
+
+    static boost::posix_time::ptime now()
+    {
+        return boost::posix_time::microsec_clock::universal_time();
+    }
+
+    boost::posix_time::time_duration m_time_to_live;
+    std::size_t m_max_entries;
+
+    entry_map m_entries;
+
+    /// Most recently used first.
+    recency_list m_recency;
+};
+
+}} // namespace ssh::detail
+
+#endif
@@ -121,13 +121,13 @@ public:
         return m_handle;
     }
 
-private:
-
     sftp_channel_state& sftp_ref()
     {
         return m_sftp;
     }
 
+private:
+
     sftp_channel_state& m_sftp;
     LIBSSH2_SFTP_HANDLE* m_handle;
 };
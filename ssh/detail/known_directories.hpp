@@ -0,0 +1,153 @@
+/**
+    @file
+
+    Remembering which remote directories exist.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the 
+    OpenSSL project's "OpenSSL" library (or with modified versions of it, 
+    with unchanged license). You may copy and distribute such a system 
+    following the terms of the GNU GPL for this program and the licenses 
+    of the other code concerned. The GNU General Public License gives 
+    permission to release a modified version without this exception; this 
+    exception also makes it possible to release a modified version which 
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_DETAIL_KNOWN_DIRECTORIES_HPP
+#define SSH_DETAIL_KNOWN_DIRECTORIES_HPP
+
+#include <ssh/detail/expiring_lru_cache.hpp>
+
+#include <boost/date_time/posix_time/posix_time_types.hpp> // time_duration
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <cstddef> // size_t
+#include <string>
+
+namespace ssh {
+namespace detail {
+
+/**
+ * Directories that a filesystem has created or found to exist, so that
+ * creating paths below them need not check for them again.
+ *
+ * Entries expire after a fixed time and, once the set is full, the least
+ * recently used makes way for a new one.  A directory removed through
+ * another connection is only noticed once its entry expires.
+ *
+ * Safe to use from several threads at once.
+ */
+class known_directories : private boost::noncopyable
+{
+public:
+
+    known_directories(
+        const boost::posix_time::time_duration& time_to_live,
+        std::size_t max_entries)
+        : m_directories(time_to_live, max_entries) {}
+
+    bool contains(const std::string& directory)
+    {
+        scoped_lock lock(m_mutex);
+
+        bool known;
+        return m_directories.find(directory, known);
+    }
+
+    void insert(const std::string& directory)
+    {
+        scoped_lock lock(m_mutex);
+
+        m_directories.store(directory, true);
+    }
+
+    /**
+     * Drop the path and everything below it.
+     *
+     * Trailing `/` and `/.` are ignored, so `/a`, `/a/` and `/a/./` all
+     * forget the same entries.
+     */
+    void forget(const std::string& unnormalised_path)
+    {
+        std::string path = directory_prefix(unnormalised_path);
+
+        scoped_lock lock(m_mutex);
+
+        // Entries below the path sort after it but may be interleaved with
+        // siblings that merely share its prefix
+        directory_cache::iterator it = m_directories.lower_bound(path);
+        while (it != m_directories.end() &&
+            it->first.compare(0, path.size(), path) == 0)
+        {
+            const std::string& candidate = it->first;
+            if (candidate.size() == path.size() ||
+                candidate[path.size()] == '/' ||
+                (!path.empty() && path[path.size() - 1] == '/'))
+            {
+                it = m_directories.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+private:
+
+    typedef boost::mutex::scoped_lock scoped_lock;
+    typedef expiring_lru_cache<std::string, bool> directory_cache;
+
+    /**
+     * The path without trailing `/` or `/.`, except that the root stays
+     * `/`.
+     */
+    static std::string directory_prefix(std::string path)
+    {
+        for (;;)
+        {
+            if (path.size() > 1 && path[path.size() - 1] == '/')
+            {
+                path.erase(path.size() - 1);
+            }
+            else if (path.size() > 1 &&
+                path.compare(path.size() - 2, 2, "/.") == 0)
+            {
+                path.erase(path.size() - 1);
+            }
+            else
+            {
+                return path;
+            }
+        }
+    }
+
+    boost::mutex m_mutex;
+    directory_cache m_directories;
+};
+
+}} // namespace ssh::detail
+
+#endif
@@ -0,0 +1,97 @@
+/**
+    @file
+
+    Exception wrapper round raw libssh2 channel functions.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the 
+    OpenSSL project's "OpenSSL" library (or with modified versions of it, 
+    with unchanged license). You may copy and distribute such a system 
+    following the terms of the GNU GPL for this program and the licenses 
+    of the other code concerned. The GNU General Public License gives 
+    permission to release a modified version without this exception; this 
+    exception also makes it possible to release a modified version which 
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_DETAIL_LIBSSH2_CHANNEL_HPP
+#define SSH_DETAIL_LIBSSH2_CHANNEL_HPP
+
+#include <ssh/ssh_error.hpp> // last_error_code, SSH_DETAIL_THROW_API_ERROR_CODE
+
+#include <boost/optional/optional.hpp>
+#include <boost/system/error_code.hpp>
+
+#include <string>
+
+#include <libssh2.h> // LIBSSH2_SESSION, LIBSSH2_CHANNEL, libssh2_channel_*
+
+// See ssh/detail/libssh2/libssh2.hpp for rules governing functions in this
+// namespace
+
+namespace ssh {
+namespace detail {
+namespace libssh2 {
+namespace channel {
+
+/**
+ * Error-fetching wrapper around libssh2_channel_receive_window_adjust2.
+ */
+inline void receive_window_adjust(
+    LIBSSH2_SESSION* session, LIBSSH2_CHANNEL* channel,
+    unsigned long adjustment, bool force, unsigned int* window,
+    boost::system::error_code& ec,
+    boost::optional<std::string&> e_msg=boost::optional<std::string&>())
+{
+    int rc = ::libssh2_channel_receive_window_adjust2(
+        channel, adjustment, (force) ? 1 : 0, window);
+
+    if (rc != 0)
+    {
+        ec = ssh::detail::last_error_code(session, e_msg);
+    }
+}
+
+/**
+ * Exception wrapper around libssh2_channel_receive_window_adjust2.
+ */
+inline void receive_window_adjust(
+    LIBSSH2_SESSION* session, LIBSSH2_CHANNEL* channel,
+    unsigned long adjustment, bool force, unsigned int* window)
+{
+    boost::system::error_code ec;
+    std::string message;
+
+    receive_window_adjust(
+        session, channel, adjustment, force, window, ec, message);
+
+    if (ec)
+    {
+        SSH_DETAIL_THROW_API_ERROR_CODE(
+            ec, message, "libssh2_channel_receive_window_adjust2");
+    }
+}
+
+}}}} // namespace ssh::detail::libssh2::channel
+
+#endif
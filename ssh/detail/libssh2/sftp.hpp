@@ -313,6 +313,41 @@ inline void fstat(
     }
 }
 
+/**
+ * Error-fetching wrapper around libssh2_sftp_statvfs.
+ */
+inline void statvfs(
+    LIBSSH2_SESSION* session, LIBSSH2_SFTP* sftp,
+    const char* path, size_t path_len, LIBSSH2_SFTP_STATVFS* statistics,
+    boost::system::error_code& ec,
+    boost::optional<std::string&> e_msg=boost::optional<std::string&>())
+{
+    int rc = ::libssh2_sftp_statvfs(sftp, path, path_len, statistics);
+    if (rc != 0)
+    {
+        ec = ssh::filesystem::detail::last_sftp_error_code(session, sftp, e_msg);
+    }
+}
+
+/**
+ * Exception wrapper around libssh2_sftp_statvfs.
+ */
+inline void statvfs(
+    LIBSSH2_SESSION* session, LIBSSH2_SFTP* sftp,
+    const char* path, size_t path_len, LIBSSH2_SFTP_STATVFS* statistics)
+{
+    boost::system::error_code ec;
+    std::string message;
+
+    statvfs(session, sftp, path, path_len, statistics, ec, message);
+
+    if (ec)
+    {
+        SSH_DETAIL_THROW_API_ERROR_CODE_WITH_PATH(
+            ec, message, "libssh2_sftp_statvfs", path, path_len);
+    }
+}
+
 /**
  * Error-fetching wrapper around libssh2_sftp_unlink_ex.
  */
@@ -458,6 +493,46 @@ inline void rename(
     }
 }
 
+/**
+ * Error-fetching wrapper around libssh2_sftp_posix_rename_ex.
+ */
+inline void posix_rename(
+    LIBSSH2_SESSION* session, LIBSSH2_SFTP* sftp,
+    const char* source, size_t source_len, const char* destination,
+    size_t destination_len,
+    boost::system::error_code& ec,
+    boost::optional<std::string&> e_msg=boost::optional<std::string&>())
+{
+    int rc = ::libssh2_sftp_posix_rename_ex(
+        sftp, source, source_len, destination, destination_len);
+    if (rc)
+    {
+        ec = ssh::filesystem::detail::last_sftp_error_code(session, sftp, e_msg);
+    }
+}
+
+/**
+ * Exception wrapper around libssh2_sftp_posix_rename_ex.
+ */
+inline void posix_rename(
+    LIBSSH2_SESSION* session, LIBSSH2_SFTP* sftp,
+    const char* source, size_t source_len, const char* destination,
+    size_t destination_len)
+{
+    boost::system::error_code ec;
+    std::string message;
+
+    posix_rename(
+        session, sftp, source, source_len, destination, destination_len, ec,
+        message);
+
+    if (ec)
+    {
+        SSH_DETAIL_THROW_API_ERROR_CODE_WITH_PATH(
+            ec, message, "libssh2_sftp_posix_rename_ex", source, source_len);
+    }
+}
+
 /**
  * Error-fetching wrapper around libssh2_sftp_read.
  */
@@ -536,6 +611,39 @@ inline ssize_t write(
     return count;
 }
 
+/**
+ * Error-fetching wrapper around libssh2_sftp_fsync.
+ */
+inline void fsync(
+    LIBSSH2_SESSION* session, LIBSSH2_SFTP* sftp,
+    LIBSSH2_SFTP_HANDLE* file_handle, boost::system::error_code& ec,
+    boost::optional<std::string&> e_msg=boost::optional<std::string&>())
+{
+    int rc = ::libssh2_sftp_fsync(file_handle);
+    if (rc)
+    {
+        ec = ::ssh::filesystem::detail::last_sftp_error_code(session, sftp, e_msg);
+    }
+}
+
+/**
+ * Exception wrapper around libssh2_sftp_fsync.
+ */
+inline void fsync(
+    LIBSSH2_SESSION* session, LIBSSH2_SFTP* sftp,
+    LIBSSH2_SFTP_HANDLE* file_handle)
+{
+    boost::system::error_code ec;
+    std::string message;
+
+    fsync(session, sftp, file_handle, ec, message);
+
+    if (ec)
+    {
+        SSH_DETAIL_THROW_API_ERROR_CODE(ec, message, "libssh2_sftp_fsync");
+    }
+}
+
 /**
  * Error-fetching wrapper around libssh2_sftp_readdir_ex.
  */
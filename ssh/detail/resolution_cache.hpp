@@ -0,0 +1,123 @@
+/**
+    @file
+
+    Remembering how remote paths resolve between requests.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the 
+    OpenSSL project's "OpenSSL" library (or with modified versions of it, 
+    with unchanged license). You may copy and distribute such a system 
+    following the terms of the GNU GPL for this program and the licenses 
+    of the other code concerned. The GNU General Public License gives 
+    permission to release a modified version without this exception; this 
+    exception also makes it possible to release a modified version which 
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_DETAIL_RESOLUTION_CACHE_HPP
+#define SSH_DETAIL_RESOLUTION_CACHE_HPP
+
+#include <ssh/detail/expiring_lru_cache.hpp>
+
+#include <boost/date_time/posix_time/posix_time_types.hpp> // time_duration
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <cstddef> // size_t
+#include <string>
+#include <utility> // pair
+
+namespace ssh {
+namespace detail {
+
+/**
+ * Bounded, expiring record of what paths canonicalise to and what links
+ * point to.
+ *
+ * Keyed by the path as given and by whether it was canonicalised or read as
+ * a link.  Entries expire after a fixed time and, once the cache is full,
+ * the least recently used entry makes way for a new one.  Only successful
+ * resolutions are remembered.
+ *
+ * Safe to use from several threads at once.
+ */
+class resolution_cache : private boost::noncopyable
+{
+public:
+
+    resolution_cache(
+        const boost::posix_time::time_duration& time_to_live,
+        std::size_t max_entries)
+        : m_entries(time_to_live, max_entries) {}
+
+    /**
+     * Look up a path.
+     *
+     * @param resolve_action
+     *     `LIBSSH2_SFTP_REALPATH` or `LIBSSH2_SFTP_READLINK`.
+     * @returns `true` and fills in `resolved` if the path has an unexpired
+     *          entry.
+     */
+    bool find(
+        const std::string& path, int resolve_action, std::string& resolved)
+    {
+        scoped_lock lock(m_mutex);
+
+        return m_entries.find(key(path, resolve_action), resolved);
+    }
+
+    void insert(
+        const std::string& path, int resolve_action,
+        const std::string& resolved)
+    {
+        scoped_lock lock(m_mutex);
+
+        m_entries.store(key(path, resolve_action), resolved);
+    }
+
+    void clear()
+    {
+        scoped_lock lock(m_mutex);
+
+        m_entries.clear();
+    }
+
+    std::size_t size() const
+    {
+        scoped_lock lock(m_mutex);
+
+        return m_entries.size();
+    }
+
+private:
+
+    typedef boost::mutex::scoped_lock scoped_lock;
+    typedef std::pair<std::string, int> key;
+
+    mutable boost::mutex m_mutex;
+    expiring_lru_cache<key, std::string> m_entries;
+};
+
+}} // namespace ssh::detail
+
+#endif
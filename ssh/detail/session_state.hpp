@@ -38,21 +38,72 @@
 #define SSH_DETAIL_SESSION_STATE_HPP
 
 #include <ssh/detail/libssh2/session.hpp> // init
+#include <ssh/detail/socket.hpp> // shutdown_socket
 
+#include <boost/make_shared.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/optional/optional.hpp>
+#include <boost/ref.hpp> // ref
+#include <boost/shared_ptr.hpp>
 #include <boost/system/error_code.hpp>
 #include <boost/system/system_error.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/throw_exception.hpp> // BOOST_THROW_EXCEPTION
 
+#include <map>
 #include <string>
+#include <vector>
 
 #include <libssh2.h> // LIBSSH2_SESSION
 
 namespace ssh {
 namespace detail {
 
+class session_state;
+
+/**
+ * Non-owning reference to a session that is severed when the session is
+ * destroyed.
+ *
+ * Background services, such as the keepalive service, hold these instead of
+ * referencing the session directly so that the session does not need to
+ * know about them and neither has to outlive the other.  The session is only
+ * guaranteed to stay alive while the link is locked.
+ */
+class session_link : private boost::noncopyable
+{
+public:
+
+    typedef boost::mutex::scoped_lock scoped_lock;
+
+    explicit session_link(session_state& session) : m_session(&session) {}
+
+    scoped_lock aquire_lock()
+    {
+        return scoped_lock(m_mutex);
+    }
+
+    /**
+     * The linked session or `NULL` if it has been destroyed.
+     *
+     * Only call with the link locked.
+     */
+    session_state* session()
+    {
+        return m_session;
+    }
+
+    void sever()
+    {
+        scoped_lock lock(m_mutex);
+        m_session = NULL;
+    }
+
+private:
+    boost::mutex m_mutex;
+    session_state* m_session;
+};
+
 /**
  * RAII object managing session state that must be maintained together.
  *
@@ -78,17 +129,31 @@ class session_state : private boost::noncopyable
 public:
 
     typedef boost::mutex::scoped_lock scoped_lock;
+    typedef boost::mutex::scoped_try_lock scoped_try_lock;
 
     /**
      * Creates a session that is not (and never will be) connected to a host.
      */
-    session_state() : m_session(::ssh::detail::libssh2::session::init()) {}
+    session_state()
+        : m_session(::ssh::detail::libssh2::session::init()), m_socket(-1),
+          m_link(boost::make_shared<session_link>(boost::ref(*this))),
+          m_dead(false) {}
 
     /**
      * Creates a session connected to a host over the given socket.
+     *
+     * @param method_preferences
+     *     Lists of methods, keyed by `LIBSSH2_METHOD_*` type, to offer the
+     *     server in place of libssh2's defaults.  Applied before the
+     *     handshake.
      */
-    session_state(int socket, const std::string& disconnection_message)
-        : m_session(libssh2::session::init())
+    session_state(
+        int socket, const std::string& disconnection_message,
+        const std::map<int, std::string>& method_preferences=
+            std::map<int, std::string>())
+        : m_session(libssh2::session::init()), m_socket(socket),
+          m_link(boost::make_shared<session_link>(boost::ref(*this))),
+          m_dead(false)
     {
         // Session is 'alive' from this point onwards.  All paths must
         // eventually free it.
@@ -96,7 +161,18 @@ public:
         boost::system::error_code ec;
         std::string error_message;
 
-        libssh2::session::startup(m_session, socket, ec, error_message);
+        typedef std::map<int, std::string>::const_iterator pref_iterator;
+        for (pref_iterator it = method_preferences.begin();
+            it != method_preferences.end() && !ec; ++it)
+        {
+            libssh2::session::method_pref(
+                m_session, it->first, it->second.c_str(), ec, error_message);
+        }
+
+        if (!ec)
+        {
+            libssh2::session::startup(m_session, socket, ec, error_message);
+        }
 
         if (ec)
         {
@@ -116,6 +192,10 @@ public:
 
     ~session_state() throw()
     {
+        // Must happen before anything else so that no background service
+        // can start using the session while it is being torn down
+        m_link->sever();
+
         // Ignoring any errors because there's nothing we can do about them
 
         if (m_disconnection_message)
@@ -133,22 +213,98 @@ public:
         return scoped_lock(m_mutex);
     }
 
+    /**
+     * Lock the session only if no other thread is currently using it.
+     */
+    scoped_try_lock try_aquire_lock()
+    {
+        return scoped_try_lock(m_mutex);
+    }
+
     LIBSSH2_SESSION* session_ptr()
     {
         return m_session;
     }
 
+    /**
+     * Socket the session communicates over or -1 if it was never connected.
+     */
+    int socket() const
+    {
+        return m_socket;
+    }
+
+    boost::shared_ptr<session_link> link()
+    {
+        return m_link;
+    }
+
+    /**
+     * Record that the connection has been found dead and stop all traffic on
+     * its socket.
+     *
+     * Shutting the socket down makes any operation blocked on the connection,
+     * and any later operation, fail immediately instead of waiting for the
+     * OS to give up on the connection.
+     *
+     * Does not need the session lock.
+     */
+    void mark_dead()
+    {
+        {
+            scoped_lock lock(m_status_mutex);
+            m_dead = true;
+        }
+
+        if (m_socket != -1)
+        {
+            shutdown_socket(m_socket);
+        }
+    }
+
+    bool dead() const
+    {
+        scoped_lock lock(m_status_mutex);
+        return m_dead;
+    }
+
+    /**
+     * Scratch space for the filename and long entry of a directory entry,
+     * shared by all the session's SFTP channels.
+     *
+     * Only use with the session locked.
+     */
+    std::vector<char>& filename_scratch()
+    {
+        return m_filename_scratch;
+    }
+
+    std::vector<char>& longentry_scratch()
+    {
+        return m_longentry_scratch;
+    }
+
 private:
 
     mutable boost::mutex m_mutex;
     ///< Coordinates multiple-threads using of non-thread-safe LIBSSH2_SESSION.
 
     LIBSSH2_SESSION* m_session;
+    int m_socket;
+
+    boost::shared_ptr<session_link> m_link;
+
+    mutable boost::mutex m_status_mutex;
+    ///< Separate from m_mutex so status is readable while session is busy.
+    bool m_dead;
 
     // Overloading this to hold both the message and flag whether disconnection
     // is necessary.
     boost::optional<std::string> m_disconnection_message;
 
+    std::vector<char> m_filename_scratch;
+    std::vector<char> m_longentry_scratch;
+
 };
 
 }} // namespace ssh::detail
@@ -37,10 +37,23 @@
 #ifndef SSH_DETAIL_SFTP_CHANNEL_STATE_HPP
 #define SSH_DETAIL_SFTP_CHANNEL_STATE_HPP
 
-#include <ssh/detail/libssh2/sftp.hpp> // init
+#include <ssh/detail/libssh2/channel.hpp> // receive_window_adjust
+#include <ssh/detail/libssh2/sftp.hpp> // init, symlink_ex
 #include <ssh/detail/session_state.hpp>
+#include <ssh/sftp_options.hpp>
+#include <ssh/ssh_error.hpp> // SSH_DETAIL_THROW_API_ERROR_CODE_WITH_PATH
 
+#include <boost/cstdint.hpp> // uint64_t
+#include <boost/date_time/posix_time/posix_time_types.hpp> // microsec_clock
 #include <boost/noncopyable.hpp>
+#include <boost/optional/optional.hpp>
+#include <boost/system/error_code.hpp>
+
+#include <algorithm> // max
+#include <cstddef> // size_t
+#include <map>
+#include <string>
+#include <vector>
 
 #include <libssh2_sftp.h> // LIBSSH2_SFTP
 
@@ -78,8 +91,26 @@ public:
      * Creates SFTP channel that closes itself in a thread-safe manner
      * when it goes out of scope.
      */
-    sftp_channel_state(session_state& session)
-        : m_session(session), m_sftp(do_sftp_init(session_ref())) {}
+    sftp_channel_state(
+        session_state& session,
+        const ::ssh::filesystem::sftp_options& options=
+            ::ssh::filesystem::sftp_options())
+        :
+    m_session(session), m_sftp(do_sftp_init(session_ref())),
+    m_window_target(0U)
+    {
+        try
+        {
+            tune_window(options);
+        }
+        catch (...)
+        {
+            // Must shut down here as destructor won't be called
+            session_state::scoped_lock lock = session_ref().aquire_lock();
+            ::libssh2_sftp_shutdown(m_sftp);
+            throw;
+        }
+    }
 
     ~sftp_channel_state() throw()
     {
@@ -103,15 +134,276 @@ public:
         return m_sftp;
     }
 
-private:
-
     session_state& session_ref()
     {
         return m_session;
     }
 
+    /**
+     * Bytes the server may currently send us before waiting for the window
+     * to be adjusted.
+     */
+    unsigned long receive_window()
+    {
+        scoped_lock lock = aquire_lock();
+
+        return ::libssh2_channel_window_read_ex(
+            ::libssh2_sftp_get_channel(m_sftp), NULL, NULL);
+    }
+
+    /**
+     * Whether the server is known to support the named protocol extension
+     * on this channel, or nothing if that is not yet known.
+     *
+     * libssh2 does not pass on the extensions the server advertises, so
+     * extensions are tried optimistically and the answer remembered.  Only
+     * call with the channel locked.
+     */
+    boost::optional<bool> extension_supported(const std::string& name) const
+    {
+        std::map<std::string, bool>::const_iterator it =
+            m_extensions.find(name);
+        if (it == m_extensions.end())
+        {
+            return boost::optional<bool>();
+        }
+        else
+        {
+            return it->second;
+        }
+    }
+
+    /**
+     * Has the server refused the named protocol extension on this channel?
+     *
+     * Only call with the channel locked.
+     */
+    bool extension_refused(const std::string& name) const
+    {
+        return extension_supported(name) == boost::optional<bool>(false);
+    }
+
+    /**
+     * Only call with the channel locked.
+     */
+    void record_extension(const std::string& name, bool supported)
+    {
+        m_extensions[name] = supported;
+    }
+
+    /**
+     * Scratch buffer for paths the server sends back, such as the results
+     * of realpath and readlink.
+     *
+     * Kept for the life of the channel so that those calls need not
+     * allocate.  It starts small: when libssh2 reports
+     * `LIBSSH2_ERROR_BUFFER_TOO_SMALL`, grow it and repeat the call.  Only
+     * use with the channel locked and copy out of it before unlocking.
+     */
+    std::vector<char>& path_buffer()
+    {
+        if (m_path_buffer.empty())
+        {
+            m_path_buffer.resize(1024U);
+        }
+
+        return m_path_buffer;
+    }
+
+    /**
+     * @returns false if the path buffer is already big enough for any
+     *          string the server could send.
+     */
+    bool grow_path_buffer()
+    {
+        if (m_path_buffer.size() >= max_string_length())
+        {
+            return false;
+        }
+
+        m_path_buffer.resize(
+            (std::min)(m_path_buffer.size() * 2U, max_string_length()));
+        return true;
+    }
+
+    /**
+     * Scratch buffers for the filename and long entry of a directory entry.
+     *
+     * When the entry does not fit, libssh2 reports
+     * `LIBSSH2_ERROR_BUFFER_TOO_SMALL` but moves on from the entry anyway,
+     * so the call cannot be repeated with bigger buffers.  Instead, these
+     * are made big enough for any entry the first time they are used.
+     *
+     * That makes them large, so they belong to the session rather than the
+     * channel: the channel lock is the session lock, so only one channel
+     * can be using them at a time and a pipeline over many channels needs
+     * no more than one.  Only use with the channel locked and copy out of
+     * them before unlocking.
+     */
+    std::vector<char>& filename_buffer()
+    {
+        std::vector<char>& buffer = session_ref().filename_scratch();
+        buffer.resize(max_string_length());
+        return buffer;
+    }
+
+    std::vector<char>& longentry_buffer()
+    {
+        std::vector<char>& buffer = session_ref().longentry_scratch();
+        buffer.resize(max_string_length());
+        return buffer;
+    }
+
+    /**
+     * Top the receive window back up to the size the options asked for.
+     *
+     * libssh2 only ever tops the window up to the size the channel was
+     * opened with, which `libssh2_sftp_init` does not let us choose, so an
+     * enlarged window shrinks back as data arrives.  Call after reading
+     * from the channel to keep it enlarged.  To avoid sending an adjustment
+     * for every read, nothing is sent until half the window is used.  Only
+     * call with the channel locked.
+     */
+    void keep_window_open()
+    {
+        if (m_window_target == 0U)
+        {
+            return;
+        }
+
+        LIBSSH2_CHANNEL* channel = ::libssh2_sftp_get_channel(m_sftp);
+
+        unsigned long current = ::libssh2_channel_window_read_ex(
+            channel, NULL, NULL);
+
+        if (current <= m_window_target / 2U)
+        {
+            unsigned int new_window = 0;
+            libssh2::channel::receive_window_adjust(
+                session_ptr(), channel, m_window_target - current, true,
+                &new_window);
+        }
+    }
+
+    /**
+     * Round-trip time measured when the channel opened, if the options
+     * asked for the window to be tuned to it.
+     */
+    boost::optional<boost::posix_time::time_duration> round_trip() const
+    {
+        return m_round_trip;
+    }
+
+private:
+
+    /**
+     * libssh2 rejects SFTP packets bigger than this, so no string it hands
+     * back can be any longer.
+     */
+    static std::size_t max_string_length()
+    {
+        return 256U * 1024U;
+    }
+
+    void tune_window(const ::ssh::filesystem::sftp_options& options)
+    {
+        unsigned long target = options.window_size().get_value_or(0U);
+
+        scoped_lock lock = aquire_lock();
+
+        if (options.link_bandwidth())
+        {
+            m_round_trip = measure_round_trip();
+
+            boost::uint64_t product =
+                *options.link_bandwidth() / 8U *
+                static_cast<boost::uint64_t>(
+                    m_round_trip->total_microseconds()) / 1000000U;
+
+            // SSH windows are 32-bit
+            product = (std::min)(product, boost::uint64_t(0xFFFFFFFFU));
+            target = (std::max)(target, static_cast<unsigned long>(product));
+        }
+
+        m_window_target = target;
+
+        LIBSSH2_CHANNEL* channel = ::libssh2_sftp_get_channel(m_sftp);
+
+        unsigned long current = ::libssh2_channel_window_read_ex(
+            channel, NULL, NULL);
+
+        if (target > current)
+        {
+            unsigned int new_window = 0;
+            libssh2::channel::receive_window_adjust(
+                session_ptr(), channel, target - current, true, &new_window);
+        }
+    }
+
+    /**
+     * Time the quickest of a few cheap requests that the server answers
+     * without touching the disk.
+     *
+     * Only call with the session locked.
+     */
+    boost::posix_time::time_duration measure_round_trip()
+    {
+        boost::optional<boost::posix_time::time_duration> quickest;
+
+        for (int i = 0; i < 3; ++i)
+        {
+            boost::posix_time::time_duration elapsed;
+            boost::system::error_code ec;
+            std::string message;
+            int rc;
+
+            // A home directory too long for the buffer is timed again once
+            // it fits
+            do
+            {
+                std::vector<char>& target = path_buffer();
+                ec.clear();
+
+                boost::posix_time::ptime start =
+                    boost::posix_time::microsec_clock::universal_time();
+
+                rc = libssh2::sftp::symlink_ex(
+                    session_ptr(), m_sftp, ".", 1, &target[0],
+                    static_cast<unsigned int>(target.size()),
+                    LIBSSH2_SFTP_REALPATH, ec, message);
+
+                elapsed =
+                    boost::posix_time::microsec_clock::universal_time() -
+                    start;
+            }
+            while (rc == LIBSSH2_ERROR_BUFFER_TOO_SMALL && grow_path_buffer());
+
+            if (ec)
+            {
+                SSH_DETAIL_THROW_API_ERROR_CODE_WITH_PATH(
+                    ec, message, "libssh2_sftp_symlink_ex", ".", 1);
+            }
+
+            if (!quickest || elapsed < *quickest)
+            {
+                quickest = elapsed;
+            }
+        }
+
+        return *quickest;
+    }
+
     session_state& m_session;
     LIBSSH2_SFTP* m_sftp;
+    boost::optional<boost::posix_time::time_duration> m_round_trip;
+
+    /// Window size asked for by the options, or zero to leave it to libssh2
+    unsigned long m_window_target;
+
+    std::map<std::string, bool> m_extensions;
+
+    /// Scratch space, grown on first use.
+    std::vector<char> m_path_buffer;
 };
 
 }} // namespace ssh::detail
@@ -0,0 +1,398 @@
+/**
+    @file
+
+    Keeping many SFTP requests in flight at once.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the 
+    OpenSSL project's "OpenSSL" library (or with modified versions of it, 
+    with unchanged license). You may copy and distribute such a system 
+    following the terms of the GNU GPL for this program and the licenses 
+    of the other code concerned. The GNU General Public License gives 
+    permission to release a modified version without this exception; this 
+    exception also makes it possible to release a modified version which 
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_DETAIL_SFTP_PIPELINE_HPP
+#define SSH_DETAIL_SFTP_PIPELINE_HPP
+
+#include <ssh/deadline.hpp> // deadline
+#include <ssh/detail/session_state.hpp>
+#include <ssh/detail/sftp_channel_state.hpp>
+#include <ssh/detail/socket.hpp> // wait_for_socket
+#include <ssh/sftp_error.hpp> // last_sftp_error_code
+
+#include <boost/date_time/posix_time/posix_time_types.hpp> // milliseconds
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/ref.hpp> // ref
+#include <boost/shared_ptr.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/system/system_error.hpp>
+
+#include <algorithm> // min
+#include <cstddef> // size_t
+#include <vector>
+
+#include <libssh2.h> // libssh2_session_*blocking*, LIBSSH2_ERROR_EAGAIN
+#include <libssh2_sftp.h> // LIBSSH2_SFTP_HANDLE
+
+namespace ssh {
+namespace detail {
+
+/**
+ * Puts a locked session into non-blocking mode for the guard's lifetime.
+ */
+class nonblocking_guard : private boost::noncopyable
+{
+public:
+    explicit nonblocking_guard(LIBSSH2_SESSION* session)
+        :
+    m_session(session),
+    m_was_blocking(::libssh2_session_get_blocking(session) != 0)
+    {
+        ::libssh2_session_set_blocking(m_session, 0);
+    }
+
+    ~nonblocking_guard()
+    {
+        ::libssh2_session_set_blocking(m_session, (m_was_blocking) ? 1 : 0);
+    }
+
+private:
+    LIBSSH2_SESSION* m_session;
+    bool m_was_blocking;
+};
+
+/**
+ * Interpret the return code of a `libssh2_sftp_*` call made in non-blocking
+ * mode.
+ *
+ * Checks the return code itself rather than the session's last error, which
+ * may be left over from an earlier call.
+ *
+ * @returns `false` if the call is waiting for the server and must be
+ *          repeated, with the same arguments, later.  `true` if it finished,
+ *          in which case `ec` holds any error.
+ */
+inline bool sftp_call_finished(
+    int rc, sftp_channel_state& channel, boost::system::error_code& ec)
+{
+    if (rc == LIBSSH2_ERROR_EAGAIN)
+    {
+        return false;
+    }
+
+    if (rc < 0)
+    {
+        ec = ::ssh::filesystem::detail::last_sftp_error_code(
+            channel.session_ptr(), channel.sftp_ptr());
+    }
+
+    return true;
+}
+
+/**
+ * `sftp_call_finished` for the libssh2 calls that return a handle.
+ *
+ * These only report why they returned `NULL` through the session's last
+ * error.
+ */
+inline bool sftp_open_finished(
+    LIBSSH2_SFTP_HANDLE* handle, sftp_channel_state& channel,
+    boost::system::error_code& ec)
+{
+    if (handle)
+    {
+        return true;
+    }
+
+    if (::libssh2_session_last_errno(channel.session_ptr()) ==
+        LIBSSH2_ERROR_EAGAIN)
+    {
+        return false;
+    }
+
+    ec = ::ssh::filesystem::detail::last_sftp_error_code(
+        channel.session_ptr(), channel.sftp_ptr());
+    return true;
+}
+
+/**
+ * Unit of SFTP work that can be suspended while it waits for the server.
+ */
+class pipeline_task
+{
+public:
+    virtual ~pipeline_task() {}
+
+    /**
+     * Advance the task as far as it can go without waiting.
+     *
+     * Called with the session locked and in non-blocking mode.  Must not
+     * call back into code that might lock the session.
+     *
+     * @returns `true` once the task has finished.  `false` if it is waiting
+     *          for the server, in which case the next call must begin by
+     *          repeating the libssh2 call that returned
+     *          `LIBSSH2_ERROR_EAGAIN`, with the same arguments.
+     */
+    virtual bool resume(sftp_channel_state& channel) = 0;
+};
+
+/**
+ * Supplies an `sftp_pipeline` with tasks, possibly generating more as
+ * earlier ones finish.
+ */
+class pipeline_source
+{
+public:
+    virtual ~pipeline_source() {}
+
+    /**
+     * The next task to start, or `NULL` if there is none ready yet.
+     *
+     * Called with the session locked.
+     */
+    virtual boost::shared_ptr<pipeline_task> next_task() = 0;
+
+    /**
+     * Called after each round of work with the session unlocked, so that
+     * results can be handed to code that may itself use the session.
+     */
+    virtual void between_rounds() {}
+};
+
+/**
+ * Runs many SFTP tasks at once over a single session.
+ *
+ * libssh2 keeps the state of each kind of SFTP request per channel, so a
+ * channel can only have one request of a kind in flight.  The pipeline
+ * therefore opens its own channels and runs one task on each, all from the
+ * calling thread: the session is switched to non-blocking mode and each
+ * task is resumed in turn, so while one task waits for its reply the
+ * others send their requests.
+ *
+ * libssh2 cannot interleave a packet with one it has only partly sent, so
+ * a task whose request is stuck in the socket's send buffer is resumed on
+ * its own until the request is out.  Because of that, stopping between
+ * rounds (an exception from the source or an expired deadline) leaves the
+ * session usable; only the pipeline's own channels, which are discarded,
+ * hold unfinished requests.
+ */
+class sftp_pipeline : private boost::noncopyable
+{
+public:
+
+    /**
+     * Open up to `width` channels.
+     *
+     * Servers limit how many channels one connection may open (OpenSSH
+     * allows ten by default, including any already open) so the pipeline
+     * makes do with as many as the server allows, as long as that is at
+     * least one.
+     */
+    sftp_pipeline(session_state& session, std::size_t width)
+        : m_session(session)
+    {
+        open_channels(width);
+    }
+
+    /**
+     * Start with channels opened earlier, which must have no requests
+     * outstanding, and open more if they number fewer than `width`.
+     */
+    sftp_pipeline(
+        session_state& session,
+        const std::vector<boost::shared_ptr<sftp_channel_state> >& channels,
+        std::size_t width)
+        : m_session(session), m_channels(channels)
+    {
+        open_channels(width);
+    }
+
+    std::size_t width() const
+    {
+        return m_channels.size();
+    }
+
+    /**
+     * The pipeline's channels, to use again once `run` has returned.
+     *
+     * If `run` threw, they may still hold unfinished requests and must be
+     * discarded instead.
+     */
+    const std::vector<boost::shared_ptr<sftp_channel_state> >& channels()
+        const
+    {
+        return m_channels;
+    }
+
+    /**
+     * Run tasks from the source until it has no more and all have
+     * finished.
+     *
+     * @throws `boost::system::system_error` if the deadline passes.
+     */
+    void run(pipeline_source& source, const ::ssh::deadline& limit)
+    {
+        std::vector<boost::shared_ptr<pipeline_task> > slots(
+            m_channels.size());
+
+        bool active = true;
+        while (active)
+        {
+            limit.check();
+
+            {
+                session_state::scoped_lock lock = m_session.aquire_lock();
+                nonblocking_guard guard(m_session.session_ptr());
+
+                // Keep going while tasks are finishing because each finished
+                // task frees a slot for a new one, and because data for a
+                // task resumed early in a pass may be read off the socket by
+                // one resumed later
+                bool progress = true;
+                while (progress)
+                {
+                    progress = false;
+                    active = false;
+
+                    for (std::size_t i = 0; i < slots.size(); ++i)
+                    {
+                        if (!slots[i])
+                        {
+                            slots[i] = source.next_task();
+                            if (!slots[i])
+                            {
+                                continue;
+                            }
+                        }
+
+                        if (resume(*slots[i], *m_channels[i], limit))
+                        {
+                            slots[i].reset();
+                            progress = true;
+                        }
+                        else
+                        {
+                            active = true;
+                        }
+                    }
+                }
+
+                if (active)
+                {
+                    wait_for_server(limit);
+                }
+            }
+
+            source.between_rounds();
+        }
+    }
+
+private:
+
+    void open_channels(std::size_t width)
+    {
+        while (m_channels.size() < (std::max)(width, std::size_t(1)))
+        {
+            try
+            {
+                m_channels.push_back(
+                    boost::make_shared<sftp_channel_state>(
+                        boost::ref(m_session)));
+            }
+            catch (const boost::system::system_error&)
+            {
+                if (m_channels.empty())
+                {
+                    throw;
+                }
+
+                break;
+            }
+        }
+    }
+
+    bool resume(
+        pipeline_task& task, sftp_channel_state& channel,
+        const ::ssh::deadline& limit)
+    {
+        for (;;)
+        {
+            if (task.resume(channel))
+            {
+                return true;
+            }
+
+            if (!(::libssh2_session_block_directions(
+                    m_session.session_ptr()) &
+                    LIBSSH2_SESSION_BLOCK_OUTBOUND))
+            {
+                return false;
+            }
+
+            // The request is only partly sent and libssh2 will refuse to
+            // send anything else until it is finished
+            if (limit.expired() || limit.cancelled())
+            {
+                m_session.mark_dead();
+                limit.check();
+            }
+
+            wait_for_socket(
+                m_session.socket(), LIBSSH2_SESSION_BLOCK_OUTBOUND,
+                boost::posix_time::milliseconds(
+                    limit.wait_slice_milliseconds()));
+        }
+    }
+
+    void wait_for_server(const ::ssh::deadline& limit)
+    {
+        int directions = ::libssh2_session_block_directions(
+            m_session.session_ptr());
+        if (directions == 0)
+        {
+            directions = LIBSSH2_SESSION_BLOCK_INBOUND;
+        }
+
+        // A reply may already have been read off the socket into the queue
+        // of a task that was resumed before it arrived, in which case the
+        // socket will not wake us for it.  Capping the wait bounds how long
+        // that task is held up.
+        long wait = (std::min)(limit.wait_slice_milliseconds(), 10L);
+
+        wait_for_socket(
+            m_session.socket(), directions,
+            boost::posix_time::milliseconds(wait));
+    }
+
+    session_state& m_session;
+    std::vector<boost::shared_ptr<sftp_channel_state> > m_channels;
+};
+
+}} // namespace ssh::detail
+
+#endif
@@ -0,0 +1,171 @@
+/**
+    @file
+
+    Portability shims for the raw sockets sessions run over.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the 
+    OpenSSL project's "OpenSSL" library (or with modified versions of it, 
+    with unchanged license). You may copy and distribute such a system 
+    following the terms of the GNU GPL for this program and the licenses 
+    of the other code concerned. The GNU General Public License gives 
+    permission to release a modified version without this exception; this 
+    exception also makes it possible to release a modified version which 
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_DETAIL_SOCKET_HPP
+#define SSH_DETAIL_SOCKET_HPP
+
+#include <boost/date_time/posix_time/posix_time_types.hpp> // time_duration
+
+#include <boost/system/error_code.hpp> // error_code, system_category
+
+#ifdef _WIN32
+#include <winsock2.h> // shutdown, select, closesocket, SD_BOTH
+#include <ws2tcpip.h> // getaddrinfo
+#else
+#include <errno.h>
+#include <netdb.h> // getaddrinfo
+#include <netinet/in.h> // IPPROTO_TCP
+#include <netinet/tcp.h> // TCP_USER_TIMEOUT, TCP_NODELAY, TCP_QUICKACK
+#include <sys/select.h> // select, fd_set
+#include <sys/socket.h> // shutdown, setsockopt, SHUT_RDWR
+#include <unistd.h> // close
+#endif
+
+#include <libssh2.h> // LIBSSH2_SESSION_BLOCK_INBOUND/OUTBOUND
+
+namespace ssh {
+namespace detail {
+
+/**
+ * Stop all further traffic in both directions on the socket.
+ *
+ * The socket is not closed; it still belongs to whoever created it.  Any
+ * thread blocked on the socket, and any later attempt to use it, fails
+ * immediately.
+ */
+inline void shutdown_socket(int socket)
+{
+#ifdef _WIN32
+    ::shutdown(socket, SD_BOTH);
+#else
+    ::shutdown(socket, SHUT_RDWR);
+#endif
+}
+
+#ifdef _WIN32
+typedef int socket_length;
+#else
+typedef socklen_t socket_length;
+#endif
+
+/**
+ * Error code of the last failed socket call on this thread.
+ */
+inline boost::system::error_code last_socket_error()
+{
+#ifdef _WIN32
+    return boost::system::error_code(
+        ::WSAGetLastError(), boost::system::system_category());
+#else
+    return boost::system::error_code(errno, boost::system::system_category());
+#endif
+}
+
+inline void close_socket(int socket)
+{
+#ifdef _WIN32
+    ::closesocket(socket);
+#else
+    ::close(socket);
+#endif
+}
+
+/**
+ * Ask the OS to abort the connection if sent data stays unacknowledged for
+ * longer than the given number of milliseconds.
+ *
+ * Not all platforms support this.  Where they don't, this does nothing and
+ * the connection is only aborted when the OS's own retransmission limits are
+ * reached.
+ */
+inline void set_unacknowledged_timeout(int socket, unsigned int milliseconds)
+{
+#ifdef TCP_USER_TIMEOUT
+    ::setsockopt(
+        socket, IPPROTO_TCP, TCP_USER_TIMEOUT, &milliseconds,
+        sizeof(milliseconds));
+#else
+    (void)socket;
+    (void)milliseconds;
+#endif
+}
+
+/**
+ * Wait until the socket is ready in the given directions or the timeout
+ * expires.
+ *
+ * @param directions
+ *     Bitmask of `LIBSSH2_SESSION_BLOCK_INBOUND` and
+ *     `LIBSSH2_SESSION_BLOCK_OUTBOUND`, as returned by
+ *     `libssh2_session_block_directions`.
+ *
+ * @returns `false` if the timeout expired before the socket was ready.
+ *          Errors are reported as readiness so that the caller's next
+ *          operation on the socket discovers them.
+ */
+inline bool wait_for_socket(
+    int socket, int directions, boost::posix_time::time_duration timeout)
+{
+    if (timeout.is_negative())
+    {
+        timeout = boost::posix_time::time_duration();
+    }
+
+    timeval tv;
+    tv.tv_sec = static_cast<long>(timeout.total_seconds());
+    tv.tv_usec = static_cast<long>(timeout.total_microseconds() % 1000000);
+
+    fd_set read_set;
+    fd_set write_set;
+    FD_ZERO(&read_set);
+    FD_ZERO(&write_set);
+
+    if (directions & LIBSSH2_SESSION_BLOCK_INBOUND)
+    {
+        FD_SET(socket, &read_set);
+    }
+
+    if (directions & LIBSSH2_SESSION_BLOCK_OUTBOUND)
+    {
+        FD_SET(socket, &write_set);
+    }
+
+    return ::select(socket + 1, &read_set, &write_set, NULL, &tv) != 0;
+}
+
+}} // namespace ssh::detail
+
+#endif
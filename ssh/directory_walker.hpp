@@ -0,0 +1,610 @@
+/**
+    @file
+
+    Walking remote directory trees with many requests in flight.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the 
+    OpenSSL project's "OpenSSL" library (or with modified versions of it, 
+    with unchanged license). You may copy and distribute such a system 
+    following the terms of the GNU GPL for this program and the licenses 
+    of the other code concerned. The GNU General Public License gives 
+    permission to release a modified version without this exception; this 
+    exception also makes it possible to release a modified version which 
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_DIRECTORY_WALKER_HPP
+#define SSH_DIRECTORY_WALKER_HPP
+
+#include <ssh/deadline.hpp>
+#include <ssh/detail/sftp_channel_state.hpp>
+#include <ssh/detail/sftp_pipeline.hpp>
+#include <ssh/filesystem.hpp> // sftp_filesystem, sftp_file, path_error
+#include <ssh/ssh_error.hpp> // SSH_DETAIL_THROW_API_ERROR_CODE_WITH_PATH
+
+#include <boost/detail/scoped_enum_emulation.hpp> // BOOST_SCOPED_ENUM
+#include <boost/filesystem/path.hpp> // path
+#include <boost/function.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/optional/optional.hpp>
+#include <boost/ref.hpp> // ref
+#include <boost/shared_ptr.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/system/system_error.hpp>
+
+#include <algorithm> // min
+#include <cstddef> // size_t
+#include <limits> // numeric_limits
+#include <string>
+#include <utility> // pair
+#include <vector>
+
+#include <libssh2_sftp.h>
+
+namespace ssh {
+namespace filesystem {
+
+/**
+ * What a `recursive_directory_walker` does with symbolic links.
+ */
+BOOST_SCOPED_ENUM_START(symlink_policy)
+{
+    /**
+     * Report links like any other entry but do not descend into them.
+     */
+    report,
+
+    /**
+     * Report links and, if they lead to a directory, descend into it.
+     *
+     * Entries below the link are reported under the link's path.  A link
+     * to a directory that the walk is already inside, whether it got there
+     * through plain directories or through other links, is not followed,
+     * so cycles end.
+     */
+    follow,
+
+    /**
+     * Leave links out altogether.
+     */
+    skip
+};
+BOOST_SCOPED_ENUM_END
+
+namespace detail {
+
+    inline bool is_type(
+        const LIBSSH2_SFTP_ATTRIBUTES& attributes, unsigned long type)
+    {
+        return (attributes.flags & LIBSSH2_SFTP_ATTR_PERMISSIONS) &&
+            (attributes.permissions & LIBSSH2_SFTP_S_IFMT) == type;
+    }
+
+    /**
+     * Is `ancestor` the same as, or a directory containing, `directory`?
+     */
+    inline bool is_same_or_ancestor(
+        const std::string& ancestor, const std::string& directory)
+    {
+        if (ancestor == directory || ancestor == "/")
+        {
+            return true;
+        }
+
+        return directory.size() > ancestor.size() &&
+            directory.compare(0, ancestor.size(), ancestor) == 0 &&
+            directory[ancestor.size()] == '/';
+    }
+
+    /**
+     * `path` with the `root` it is below, and the separator after that,
+     * taken off the front.
+     */
+    inline std::string relative_to(
+        const std::string& root, const std::string& path)
+    {
+        std::size_t skip = root.size();
+        if (!root.empty() && root[root.size() - 1] != '/')
+        {
+            ++skip;
+        }
+
+        return path.substr((std::min)(skip, path.size()));
+    }
+
+    class walk_state;
+
+    /**
+     * Directory waiting to be listed.
+     */
+    struct walk_job
+    {
+        walk_job(
+            const boost::filesystem::path& path,
+            const boost::filesystem::path& canonical, std::size_t depth)
+            : path(path), canonical(canonical), depth(depth) {}
+
+        boost::filesystem::path path;
+
+        /// Only tracked when following links, to detect cycles.
+        boost::filesystem::path canonical;
+
+        /// Canonical paths of the directories holding each link followed
+        /// on the way here, outermost first.  Every directory the walk is
+        /// inside is one of these, `canonical`, or an ancestor of one.
+        std::vector<boost::filesystem::path> followed_from;
+
+        /// Depth of the entries in the directory; 0 for the root.
+        std::size_t depth;
+    };
+
+    class walk_state : public ::ssh::detail::pipeline_source
+    {
+    public:
+        typedef boost::function<void (const sftp_file&, std::size_t)> visitor;
+
+        walk_state(
+            const visitor& visit, std::size_t max_depth,
+            BOOST_SCOPED_ENUM(symlink_policy) links)
+            :
+        m_visit(visit), m_max_depth(max_depth), m_links(links),
+        m_root_error_api(NULL) {}
+
+        void push_directory(const walk_job& job)
+        {
+            m_directories.push_back(job);
+        }
+
+        virtual boost::shared_ptr< ::ssh::detail::pipeline_task> next_task();
+
+        virtual void between_rounds()
+        {
+            // Swapped out first so that an exception from the visitor
+            // cannot cause entries to be delivered twice
+            std::vector<std::pair<sftp_file, std::size_t> > entries;
+            entries.swap(m_entries);
+
+            for (std::size_t i = 0; i < entries.size(); ++i)
+            {
+                m_visit(entries[i].first, entries[i].second);
+            }
+        }
+
+        /**
+         * Take in an entry listed from the directory of the given job.
+         */
+        void add_entry(
+            const walk_job& job, const char* name, std::size_t name_length,
+            const char* long_entry, const LIBSSH2_SFTP_ATTRIBUTES& attributes)
+        {
+            std::string filename(name, name_length);
+            if (filename == "." || filename == "..")
+            {
+                return;
+            }
+
+            bool is_link = is_type(attributes, LIBSSH2_SFTP_S_IFLNK);
+            if (is_link && m_links == symlink_policy::skip)
+            {
+                return;
+            }
+
+            m_entries.push_back(
+                std::make_pair(
+                    sftp_file(job.path / filename, long_entry, attributes),
+                    job.depth));
+
+            if (job.depth >= m_max_depth)
+            {
+                return;
+            }
+
+            walk_job child(
+                job.path / filename,
+                (m_links == symlink_policy::follow) ?
+                    job.canonical / filename : boost::filesystem::path(),
+                job.depth + 1);
+            child.followed_from = job.followed_from;
+
+            if (is_type(attributes, LIBSSH2_SFTP_S_IFDIR))
+            {
+                m_directories.push_back(child);
+            }
+            else if (is_link && m_links == symlink_policy::follow)
+            {
+                // The child's canonical path is that of the directory
+                // containing the link until the link is resolved
+                child.canonical = job.canonical;
+                m_links_to_resolve.push_back(child);
+            }
+        }
+
+        void add_error(
+            const walk_job& job, const boost::system::error_code& ec,
+            const char* api_function)
+        {
+            if (job.depth == 0U && !m_root_error)
+            {
+                m_root_error = ec;
+                m_root_error_api = api_function;
+            }
+
+            m_errors.push_back(path_error(job.path, ec));
+        }
+
+        std::vector<path_error>& errors()
+        {
+            return m_errors;
+        }
+
+        /**
+         * Why the root could not be listed, if it could not.
+         */
+        const boost::system::error_code& root_error() const
+        {
+            return m_root_error;
+        }
+
+        /// Name of the libssh2 call that failed for the root, if one did.
+        const char* root_error_api() const
+        {
+            return m_root_error_api;
+        }
+
+    private:
+        visitor m_visit;
+        std::size_t m_max_depth;
+        BOOST_SCOPED_ENUM(symlink_policy) m_links;
+
+        /// Used as a stack so the walk is depth-first, which bounds how many
+        /// directories wait at once.
+        std::vector<walk_job> m_directories;
+        std::vector<walk_job> m_links_to_resolve;
+
+        std::vector<std::pair<sftp_file, std::size_t> > m_entries;
+        std::vector<path_error> m_errors;
+        boost::system::error_code m_root_error;
+        const char* m_root_error_api;
+    };
+
+    /**
+     * Lists one directory: open, read every entry, close.
+     */
+    class list_directory_task : public ::ssh::detail::pipeline_task
+    {
+    public:
+        list_directory_task(const walk_job& job, walk_state& state)
+            : m_job(job), m_path(job.path.string()), m_state(state),
+              m_handle(NULL), m_stage(opening) {}
+
+        virtual bool resume(::ssh::detail::sftp_channel_state& channel)
+        {
+            boost::system::error_code ec;
+
+            if (m_stage == opening)
+            {
+                m_handle = ::libssh2_sftp_open_ex(
+                    channel.sftp_ptr(), m_path.data(),
+                    static_cast<unsigned int>(m_path.size()), 0, 0,
+                    LIBSSH2_SFTP_OPENDIR);
+                if (!::ssh::detail::sftp_open_finished(m_handle, channel, ec))
+                {
+                    return false;
+                }
+
+                if (ec)
+                {
+                    m_state.add_error(m_job, ec, "libssh2_sftp_open_ex");
+                    return true;
+                }
+
+                m_stage = reading;
+            }
+
+            while (m_stage == reading)
+            {
+                std::vector<char>& filename = channel.filename_buffer();
+                std::vector<char>& longentry = channel.longentry_buffer();
+                LIBSSH2_SFTP_ATTRIBUTES attributes = LIBSSH2_SFTP_ATTRIBUTES();
+
+                int rc = ::libssh2_sftp_readdir_ex(
+                    m_handle, &filename[0], filename.size(), &longentry[0],
+                    longentry.size(), &attributes);
+                if (!::ssh::detail::sftp_call_finished(rc, channel, ec))
+                {
+                    return false;
+                }
+
+                if (ec)
+                {
+                    m_state.add_error(m_job, ec, "libssh2_sftp_readdir_ex");
+                    m_stage = closing;
+                }
+                else if (rc == 0) // end of files
+                {
+                    m_stage = closing;
+                }
+                else
+                {
+                    longentry[longentry.size() - 1] = '\0';
+                    m_state.add_entry(
+                        m_job, &filename[0],
+                        (std::min)(static_cast<size_t>(rc), filename.size()),
+                        &longentry[0], attributes);
+                }
+            }
+
+            // Errors closing are ignored as the listing is already complete
+            int rc = ::libssh2_sftp_close_handle(m_handle);
+            return ::ssh::detail::sftp_call_finished(rc, channel, ec);
+        }
+
+    private:
+        enum stage { opening, reading, closing };
+
+        walk_job m_job;
+        std::string m_path;
+        walk_state& m_state;
+        LIBSSH2_SFTP_HANDLE* m_handle;
+        stage m_stage;
+    };
+
+    /**
+     * Finds where a link leads and, if to a directory that is not one of
+     * the link's own ancestors, queues it for listing.
+     */
+    class resolve_link_task : public ::ssh::detail::pipeline_task
+    {
+    public:
+        resolve_link_task(const walk_job& link, walk_state& state)
+            : m_link(link), m_path(link.path.string()), m_state(state),
+              m_stage(resolving) {}
+
+        virtual bool resume(::ssh::detail::sftp_channel_state& channel)
+        {
+            while (m_stage == resolving)
+            {
+                std::vector<char>& buffer = channel.path_buffer();
+
+                boost::system::error_code ec;
+
+                int rc = ::libssh2_sftp_symlink_ex(
+                    channel.sftp_ptr(), m_path.data(),
+                    static_cast<unsigned int>(m_path.size()), &buffer[0],
+                    static_cast<unsigned int>(buffer.size()),
+                    LIBSSH2_SFTP_REALPATH);
+                if (!::ssh::detail::sftp_call_finished(rc, channel, ec))
+                {
+                    return false;
+                }
+
+                // Asked again with more room, as the target is not known
+                // to be too long until the server sends it
+                if (rc == LIBSSH2_ERROR_BUFFER_TOO_SMALL &&
+                    channel.grow_path_buffer())
+                {
+                    continue;
+                }
+
+                if (ec || rc < 0)
+                {
+                    // Broken links were already reported as entries and are
+                    // nothing to descend into, and nor are links whose
+                    // target is too long to resolve
+                    return true;
+                }
+
+                m_target = std::string(
+                    &buffer[0],
+                    (std::min)(static_cast<size_t>(rc), buffer.size()));
+                m_stage = statting;
+            }
+
+            boost::system::error_code ec;
+            LIBSSH2_SFTP_ATTRIBUTES attributes = LIBSSH2_SFTP_ATTRIBUTES();
+            int rc = ::libssh2_sftp_stat_ex(
+                channel.sftp_ptr(), m_target.data(),
+                static_cast<unsigned int>(m_target.size()), LIBSSH2_SFTP_STAT,
+                &attributes);
+            if (!::ssh::detail::sftp_call_finished(rc, channel, ec))
+            {
+                return false;
+            }
+
+            if (!ec && is_type(attributes, LIBSSH2_SFTP_S_IFDIR) &&
+                !leads_back())
+            {
+                walk_job target(m_link.path, m_target, m_link.depth);
+                target.followed_from = m_link.followed_from;
+                target.followed_from.push_back(m_link.canonical);
+                m_state.push_directory(target);
+            }
+
+            return true;
+        }
+
+    private:
+        enum stage { resolving, statting };
+
+        /**
+         * Is the target a directory the walk is already inside?
+         */
+        bool leads_back() const
+        {
+            if (is_same_or_ancestor(m_target, m_link.canonical.string()))
+            {
+                return true;
+            }
+
+            for (std::size_t i = 0; i < m_link.followed_from.size(); ++i)
+            {
+                if (is_same_or_ancestor(
+                        m_target, m_link.followed_from[i].string()))
+                {
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        walk_job m_link;
+        std::string m_path;
+        walk_state& m_state;
+        std::string m_target;
+        stage m_stage;
+    };
+
+    inline boost::shared_ptr< ::ssh::detail::pipeline_task>
+    walk_state::next_task()
+    {
+        if (!m_links_to_resolve.empty())
+        {
+            walk_job link = m_links_to_resolve.back();
+            m_links_to_resolve.pop_back();
+            return boost::make_shared<resolve_link_task>(
+                link, boost::ref(*this));
+        }
+        else if (!m_directories.empty())
+        {
+            walk_job directory = m_directories.back();
+            m_directories.pop_back();
+            return boost::make_shared<list_directory_task>(
+                directory, boost::ref(*this));
+        }
+        else
+        {
+            return boost::shared_ptr< ::ssh::detail::pipeline_task>();
+        }
+    }
+
+}
+
+/**
+ * Visits every entry below a directory, listing many directories at once.
+ *
+ * Listing a tree one directory at a time costs at least one round trip per
+ * directory.  The walker instead opens several SFTP channels and keeps a
+ * directory being listed on each, taking the next directory from a shared
+ * queue whenever one finishes, so the round trips overlap.
+ *
+ * Entries are passed to the visitor on the calling thread, with the session
+ * unlocked, as they arrive.  Entries from different directories interleave
+ * and `.` and `..` are left out.
+ */
+class recursive_directory_walker
+{
+public:
+
+    /**
+     * Called with each entry and its depth; entries in the root have depth
+     * 0.
+     */
+    typedef boost::function<void (const sftp_file&, std::size_t)> visitor;
+
+    /**
+     * The `sftp_filesystem` must outlive the walker.
+     */
+    explicit recursive_directory_walker(sftp_filesystem& filesystem)
+        :
+    m_filesystem(filesystem), m_width(4),
+    m_max_depth((std::numeric_limits<std::size_t>::max)()),
+    m_links(symlink_policy::report) {}
+
+    /**
+     * Number of channels, and so of directories listed at once.
+     *
+     * The server may allow fewer; the walker uses what it can get.
+     */
+    recursive_directory_walker& set_width(std::size_t channels)
+    {
+        m_width = channels;
+        return *this;
+    }
+
+    /**
+     * Deepest level whose entries are reported; 0 lists only the root.
+     */
+    recursive_directory_walker& set_max_depth(std::size_t depth)
+    {
+        m_max_depth = depth;
+        return *this;
+    }
+
+    recursive_directory_walker& set_symlink_policy(
+        BOOST_SCOPED_ENUM(symlink_policy) links)
+    {
+        m_links = links;
+        return *this;
+    }
+
+    /**
+     * Walk the tree below `root`.
+     *
+     * @returns the directories below the root that could not be listed, and
+     *          why.  The walk carries on past them.
+     * @throws `boost::system::system_error` if the root cannot be listed or
+     *         the deadline passes.  Any exception thrown by the visitor
+     *         stops the walk and is passed on.
+     */
+    std::vector<path_error> walk(
+        const boost::filesystem::path& root, const visitor& visit,
+        const ::ssh::deadline& limit=::ssh::deadline())
+    {
+        detail::walk_state state(visit, m_max_depth, m_links);
+
+        boost::filesystem::path canonical_root;
+        if (m_links == symlink_policy::follow)
+        {
+            canonical_root = m_filesystem.canonical_path(root);
+        }
+
+        state.push_directory(detail::walk_job(root, canonical_root, 0U));
+
+        ::ssh::detail::sftp_pipeline pipeline(
+            m_filesystem.sftp_ref().session_ref(), m_width);
+        pipeline.run(state, limit);
+
+        if (state.root_error())
+        {
+            std::string root_string = root.string();
+            SSH_DETAIL_THROW_API_ERROR_CODE_WITH_PATH(
+                state.root_error(), state.root_error().message(),
+                state.root_error_api(), root_string.data(),
+                root_string.size());
+        }
+
+        return state.errors();
+    }
+
+private:
+    sftp_filesystem& m_filesystem;
+    std::size_t m_width;
+    std::size_t m_max_depth;
+    BOOST_SCOPED_ENUM(symlink_policy) m_links;
+};
+
+}} // namespace ssh::filesystem
+
+#endif
@@ -0,0 +1,121 @@
+/**
+    @file
+
+    Options and results for summing the space used by remote trees.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the 
+    OpenSSL project's "OpenSSL" library (or with modified versions of it, 
+    with unchanged license). You may copy and distribute such a system 
+    following the terms of the GNU GPL for this program and the licenses 
+    of the other code concerned. The GNU General Public License gives 
+    permission to release a modified version without this exception; this 
+    exception also makes it possible to release a modified version which 
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_DISK_USAGE_HPP
+#define SSH_DISK_USAGE_HPP
+
+#include <boost/cstdint.hpp> // uintmax_t
+#include <boost/filesystem/path.hpp> // path
+
+#include <cstddef> // size_t
+
+namespace ssh {
+namespace filesystem {
+
+/**
+ * Space used by a directory and everything below it.
+ *
+ * Sizes are the apparent sizes the server reports for each entry, not the
+ * blocks they occupy on disk.  Symbolic links count as files of their own
+ * size and are not followed.
+ */
+struct directory_usage
+{
+    directory_usage()
+        : bytes(0U), files(0U), directories(0U), complete(true) {}
+
+    boost::filesystem::path path;
+
+    /// Total size of the files below the directory.
+    boost::uintmax_t bytes;
+
+    /// Number of entries below the directory that are not directories.
+    boost::uintmax_t files;
+
+    /// Number of directories below the directory, not counting itself.
+    boost::uintmax_t directories;
+
+    /// False if some directory below could not be listed, in which case
+    /// the totals leave its contents out.
+    bool complete;
+};
+
+/**
+ * How `sftp_filesystem::disk_usage` walks and what it returns.
+ */
+class disk_usage_options
+{
+public:
+
+    disk_usage_options() : m_width(4U), m_top(0U) {}
+
+    /**
+     * Number of channels, and so of directories listed at once.
+     */
+    disk_usage_options& set_width(std::size_t channels)
+    {
+        m_width = channels;
+        return *this;
+    }
+
+    /**
+     * Return only the `count` largest directories; 0, the default, returns
+     * them all.
+     */
+    disk_usage_options& set_top(std::size_t count)
+    {
+        m_top = count;
+        return *this;
+    }
+
+    std::size_t width() const
+    {
+        return m_width;
+    }
+
+    std::size_t top() const
+    {
+        return m_top;
+    }
+
+private:
+    std::size_t m_width;
+    std::size_t m_top;
+};
+
+}} // namespace ssh::filesystem
+
+#endif
@@ -37,28 +37,48 @@
 #ifndef SSH_SFTP_HPP
 #define SSH_SFTP_HPP
 
+#include <ssh/deadline.hpp> // deadline, deadline_slice
+#include <ssh/detail/attribute_cache.hpp>
+#include <ssh/detail/channel_pool.hpp>
+#include <ssh/detail/disk_usage_state.hpp>
+#include <ssh/detail/known_directories.hpp>
+#include <ssh/detail/resolution_cache.hpp>
 #include <ssh/detail/file_handle_state.hpp>
 #include <ssh/detail/sftp_channel_state.hpp>
+#include <ssh/detail/sftp_pipeline.hpp>
 #include <ssh/detail/libssh2/sftp.hpp>
+#include <ssh/disk_usage.hpp>
+#include <ssh/sftp_options.hpp>
 
 #include <boost/cstdint.hpp> // uint64_t, uintmax_t
+#include <boost/date_time/posix_time/posix_time_types.hpp> // time_duration
 #include <boost/exception/info.hpp> // errinfo_api_function
 #include <boost/filesystem/path.hpp> // path
+#include <boost/function.hpp>
 #include <boost/iterator/iterator_facade.hpp> // iterator_facade
+#include <boost/range/begin.hpp>
+#include <boost/range/end.hpp>
+#include <boost/range/iterator_range.hpp>
 #include <boost/optional/optional.hpp>
 #include <boost/make_shared.hpp>
 #include <boost/move/move.hpp> // BOOST_RV_REF, BOOST_MOVABLE_BUT_NOT_COPYABLE
 #include <boost/noncopyable.hpp>
+#include <boost/ref.hpp> // ref, cref
 #include <boost/shared_ptr.hpp>
 #include <boost/system/error_code.hpp> // errc
 #include <boost/system/system_error.hpp>
 #include <boost/throw_exception.hpp> // BOOST_THROW_EXCEPTION
+#include <boost/type_traits/is_convertible.hpp>
+#include <boost/utility/enable_if.hpp> // disable_if
 
-#include <algorithm> // min
+#include <algorithm> // min, max, partial_sort, sort, heap operations
 #include <cassert> // assert
+#include <cstddef> // size_t
+#include <cstring> // memcmp, strlen
 #include <exception> // bad_alloc
-#include <stdexcept> // invalid_argument
+#include <stdexcept> // invalid_argument, logic_error, out_of_range
 #include <string>
+#include <utility> // pair
 #include <vector>
 
 #include <libssh2_sftp.h>
@@ -198,6 +218,8 @@ public:
 private:
     friend class sftp_file;
     friend class sftp_filesystem; // to construct in attributes method
+    friend class directory_entry;
+    friend class directory_iterator; // to filter entries before copying
 
     explicit file_attributes(const LIBSSH2_SFTP_ATTRIBUTES& raw_attributes) :
        m_attributes(raw_attributes) {}
@@ -236,6 +258,190 @@ private:
 
 class sftp_filesystem;
 
+/**
+ * Test applied to each entry of a directory, by name and attributes, before
+ * the entry is made current or cached.
+ *
+ * The name is not NULL-terminated and is only valid during the call.
+ */
+typedef boost::function<
+    bool (const boost::iterator_range<const char*>&, const file_attributes&)>
+    entry_filter;
+
+/**
+ * `entry_filter` accepting names that match a shell wildcard pattern.
+ *
+ * `*` matches any run of characters, `?` any single character and `[...]`
+ * any one of the characters listed, which may include ranges such as `a-z`
+ * and may be negated with a leading `!` or `^`.  A backslash makes the
+ * character after it literal.  Unlike a shell, names starting with `.` are
+ * not treated specially.
+ *
+ * Matching does not allocate.
+ */
+class glob
+{
+public:
+    explicit glob(const std::string& pattern) : m_pattern(pattern) {}
+
+    bool operator()(
+        const boost::iterator_range<const char*>& name,
+        const file_attributes&) const
+    {
+        return matches(name.begin(), name.end());
+    }
+
+    bool matches(const char* first, const char* last) const
+    {
+        const char* pattern = m_pattern.data();
+        const char* pattern_end = pattern + m_pattern.size();
+
+        // Where to resume after the last `*` if what follows it fails
+        const char* star_pattern = NULL;
+        const char* star_name = NULL;
+
+        while (first != last)
+        {
+            if (pattern != pattern_end)
+            {
+                if (*pattern == '*')
+                {
+                    star_pattern = ++pattern;
+                    star_name = first;
+                    continue;
+                }
+
+                const char* next = pattern;
+                if (matches_one(next, pattern_end, *first))
+                {
+                    pattern = next;
+                    ++first;
+                    continue;
+                }
+            }
+
+            if (!star_pattern)
+            {
+                return false;
+            }
+
+            // Let the last `*` swallow one more character and try again
+            pattern = star_pattern;
+            first = ++star_name;
+        }
+
+        while (pattern != pattern_end && *pattern == '*')
+        {
+            ++pattern;
+        }
+
+        return pattern == pattern_end;
+    }
+
+private:
+
+    /**
+     * Does the pattern element at `pattern` match `c`?
+     *
+     * On a match, `pattern` is moved past the element.
+     */
+    static bool matches_one(
+        const char*& pattern, const char* pattern_end, char c)
+    {
+        if (*pattern == '?')
+        {
+            ++pattern;
+            return true;
+        }
+
+        if (*pattern == '[')
+        {
+            const char* end_of_set = pattern + 1;
+            bool in_set = false;
+            if (read_set(end_of_set, pattern_end, c, in_set))
+            {
+                if (in_set)
+                {
+                    pattern = end_of_set;
+                }
+
+                return in_set;
+            }
+
+            // No closing bracket so the bracket is just a character
+        }
+        else if (*pattern == '\\' && pattern + 1 != pattern_end)
+        {
+            if (pattern[1] == c)
+            {
+                pattern += 2;
+                return true;
+            }
+
+            return false;
+        }
+
+        if (*pattern == c)
+        {
+            ++pattern;
+            return true;
+        }
+
+        return false;
+    }
+
+    /**
+     * Read a `[...]` set, starting after the `[`, and check for `c` in it.
+     *
+     * @returns false if the set is not closed; otherwise true with
+     *          `position` moved past the `]`.
+     */
+    static bool read_set(
+        const char*& position, const char* pattern_end, char c, bool& in_set)
+    {
+        const char* p = position;
+        bool negated = false;
+        if (p != pattern_end && (*p == '!' || *p == '^'))
+        {
+            negated = true;
+            ++p;
+        }
+
+        bool found = false;
+        bool first = true;
+        while (p != pattern_end && (*p != ']' || first))
+        {
+            first = false;
+
+            char low = *p++;
+            char high = low;
+            if (p + 1 < pattern_end && *p == '-' && p[1] != ']')
+            {
+                high = p[1];
+                p += 2;
+            }
+
+            unsigned char u = static_cast<unsigned char>(c);
+            if (static_cast<unsigned char>(low) <= u &&
+                u <= static_cast<unsigned char>(high))
+            {
+                found = true;
+            }
+        }
+
+        if (p == pattern_end)
+        {
+            return false;
+        }
+
+        position = p + 1;
+        in_set = (found != negated);
+        return true;
+    }
+
+    std::string m_pattern;
+};
+
 namespace detail {
 
     inline boost::shared_ptr<::ssh::detail::file_handle_state> open_directory(
@@ -291,9 +497,11 @@ public:
 
         directory_iterator operator()(
             ::ssh::detail::sftp_channel_state& channel,
-            const boost::filesystem::path& path)
+            const boost::filesystem::path& path, const ::ssh::deadline& limit,
+            boost::shared_ptr<::ssh::detail::attribute_cache> cache,
+            const entry_filter& filter=entry_filter())
         {
-            return directory_iterator(channel, path);
+            return directory_iterator(channel, path, limit, cache, filter);
         }
 
         directory_iterator operator()()
@@ -307,11 +515,16 @@ private:
 
     directory_iterator(
         ::ssh::detail::sftp_channel_state& sftp_channel,
-        const boost::filesystem::path& path)
+        const boost::filesystem::path& path, const ::ssh::deadline& limit,
+        boost::shared_ptr<::ssh::detail::attribute_cache> cache,
+        const entry_filter& filter)
         :
         m_directory(path),
         m_handle(detail::open_directory(sftp_channel, path)),
-        m_attributes(LIBSSH2_SFTP_ATTRIBUTES())
+        m_attributes(LIBSSH2_SFTP_ATTRIBUTES()),
+        m_deadline(limit),
+        m_attribute_cache(cache),
+        m_filter(filter)
     {
         next_file();
     }
@@ -331,30 +544,81 @@ private:
     }
 
     void next_file()
-    {    
-        // yuk! hardcoded buffer sizes. unfortunately, libssh2 doesn't
-        // give us a choice so we allocate massive buffers here and then
-        // take measures later to reduce the footprint
+    {
+        // Entries the filter rejects are skipped without being returned
+        while (!read_file()) {}
+    }
 
-        std::vector<char> filename_buffer(1024, '\0');
-        std::vector<char> longentry_buffer(1024, '\0');
+    /**
+     * Read the next entry and, if the filter accepts it, make it current.
+     *
+     * @returns false if the entry was rejected.
+     */
+    bool read_file()
+    {    
         LIBSSH2_SFTP_ATTRIBUTES attrs = LIBSSH2_SFTP_ATTRIBUTES();
 
-        int rc;
+        m_deadline.check();
+
+        int rc = 0;
+        boost::system::error_code ec;
+        std::string message;
         {
             ::ssh::detail::file_handle_state::scoped_lock lock =
                 m_handle->aquire_lock();
 
-            rc = ::ssh::detail::libssh2::sftp::readdir_ex(
-                m_handle->session_ptr(), m_handle->sftp_ptr(),
-                m_handle->file_handle(), &filename_buffer[0],
-                filename_buffer.size(), &longentry_buffer[0],
-                longentry_buffer.size(), &attrs);
+            // The channel's buffers are big enough for any entry and are
+            // only ours while the channel is locked
+            std::vector<char>& filename_buffer =
+                m_handle->sftp_ref().filename_buffer();
+            std::vector<char>& longentry_buffer =
+                m_handle->sftp_ref().longentry_buffer();
+
+            ::ssh::detail::deadline_slice slice(
+                m_handle->session_ptr(), m_deadline);
+
+            do
+            {
+                ec.clear();
+                rc = ::ssh::detail::libssh2::sftp::readdir_ex(
+                    m_handle->session_ptr(), m_handle->sftp_ptr(),
+                    m_handle->file_handle(), &filename_buffer[0],
+                    filename_buffer.size(), &longentry_buffer[0],
+                    longentry_buffer.size(), &attrs, ec, message);
+            }
+            while (ec &&
+                ::ssh::detail::resume_after_wait_slice(
+                    ec, m_handle->sftp_ref().session_ref(), m_deadline));
+
+            if (!ec && rc > 0)
+            {
+                // we don't assume that the filename is null-terminated but
+                // rc holds the number of bytes written to the buffer.
+                // Assigning keeps the strings' capacity so, once they have
+                // grown to fit, copying out does not allocate
+                m_next_file_name.assign(
+                    &filename_buffer[0],
+                    (std::min)(
+                        static_cast<size_t>(rc), filename_buffer.size()));
+
+                // the long entry must be usable in an ls -l listing
+                // according to the standard so I'm interpreting this to
+                // mean it can't contain embedded NULLs so we force
+                // NULL-termination and copy only up to it
+                longentry_buffer[longentry_buffer.size() - 1] = '\0';
+                m_next_long_entry.assign(&longentry_buffer[0]);
+            }
 
             // IMPORTANT: must unlock before possible handle reset below
             // which would lock the session again to close the file handle
         }
 
+        if (ec)
+        {
+            SSH_DETAIL_THROW_API_ERROR_CODE(
+                ec, message, "libssh2_sftp_readdir_ex");
+        }
+
         if (rc == 0) // end of files
         {
             m_handle.reset();
@@ -363,25 +627,33 @@ private:
         {
             assert(rc > 0);
 
-            // copy attributes to member one we know we're overwriting the
-            // last-retrieved file's properties
-            m_attributes = attrs;
+            // The filter runs unlocked in case it uses the filesystem
+            if (m_filter &&
+                !m_filter(
+                    boost::iterator_range<const char*>(
+                        m_next_file_name.data(),
+                        m_next_file_name.data() + m_next_file_name.size()),
+                    file_attributes(attrs)))
+            {
+                return false;
+            }
 
-            // we don't assume that the filename is null-terminated but rc
-            // holds the number of bytes written to the buffer so we can shrink
-            // the filename string to that size
-            m_file_name = std::string(
-                &filename_buffer[0],
-                (std::min)(static_cast<size_t>(rc), filename_buffer.size()));
+            // Only now that the entry is accepted does it replace the
+            // last-retrieved file's properties.  Swapping hands the old
+            // strings' capacity on to the next entry
+            m_file_name.swap(m_next_file_name);
+            m_long_entry.swap(m_next_long_entry);
+            m_attributes = attrs;
 
-            // the long entry must be usable in an ls -l listing according to
-            // the standard so I'm interpreting this to mean it can't contain
-            // embedded NULLs so we force NULL-termination and then allocate
-            // the string to be the NULL-terminated size which will likely be
-            // much smaller than the buffer
-            longentry_buffer[longentry_buffer.size() - 1] = '\0';
-            m_long_entry = std::string(&longentry_buffer[0]);
+            if (m_attribute_cache &&
+                m_file_name != "." && m_file_name != "..")
+            {
+                m_attribute_cache->insert_listed(
+                    (m_directory / m_file_name).string(), m_attributes);
+            }
         }
+
+        return true;
     }
 
     sftp_file dereference() const
@@ -404,138 +676,1412 @@ private:
     std::string m_long_entry;
     LIBSSH2_SFTP_ATTRIBUTES m_attributes;
     // @}
+
+    /// @name Entry read but not yet accepted by the filter.
+    // @{
+    std::string m_next_file_name;
+    std::string m_next_long_entry;
+    // @}
+
+    ::ssh::deadline m_deadline;
+
+    /// Null unless the filesystem caches attributes.
+    boost::shared_ptr<::ssh::detail::attribute_cache> m_attribute_cache;
+
+    /// Empty unless only some entries are wanted.
+    entry_filter m_filter;
 };
 
-namespace detail {
+/**
+ * Single entry read by a `directory_reader`.
+ *
+ * Unlike `sftp_file`, holds only the entry's name, not its full path, so
+ * that entries can be refilled in place batch after batch without
+ * allocating.
+ */
+class directory_entry
+{
+public:
+    directory_entry() : m_attributes(LIBSSH2_SFTP_ATTRIBUTES()) {}
 
-    BOOST_SCOPED_ENUM_START(path_status)
-    {
-        non_existent,
-            non_directory,
-            directory
-    };
-    BOOST_SCOPED_ENUM_END;
+    const std::string& name() const { return m_name; }
+    const std::string& long_entry() const { return m_long_entry; }
 
+    file_attributes attributes() const
+    {
+        return file_attributes(m_attributes);
+    }
 
-    inline BOOST_SCOPED_ENUM(path_status) check_status(
-        sftp_filesystem& filesystem, const boost::filesystem::path& path);
+private:
+    friend class directory_reader;
+    friend class sftp_filesystem; // to fill in pages of sorted listings
 
-}
+    std::string m_name;
+    std::string m_long_entry;
+    LIBSSH2_SFTP_ATTRIBUTES m_attributes;
+};
 
-BOOST_SCOPED_ENUM_START(overwrite_behaviour)
+/**
+ * Compact listing of a whole directory.
+ *
+ * Rather than an object per entry, all names are packed into one
+ * contiguous buffer and the attributes most often sorted and filtered on
+ * are kept in one array each, indexed by entry.  A listing of millions of
+ * entries therefore costs a handful of large allocations and scanning one
+ * attribute touches only that attribute's memory.
+ *
+ * Long entries (the `ls -l` style lines) are only stored if they were asked
+ * for when listing.
+ */
+class directory_listing
 {
+public:
+
     /**
-     * Do not overwrite an existing file at the destination.
-     * 
-     * If the file exists function will throw an exception.
+     * View of a name or long entry stored in the listing.
+     *
+     * Valid until the listing is modified or destroyed.  Not
+     * NULL-terminated.
      */
-    prevent_overwrite,
+    typedef boost::iterator_range<const char*> string_view;
+
+    directory_listing() : m_has_long_entries(false)
+    {
+        m_name_offsets.push_back(0U);
+        m_long_entry_offsets.push_back(0U);
+    }
+
+    std::size_t size() const
+    {
+        return m_name_offsets.size() - 1;
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    string_view name(std::size_t index) const
+    {
+        return view(m_names, m_name_offsets, index);
+    }
 
     /**
-     * Overwrite any existing file at the destination.
-     *
-     * The SFTP server may not support overwriting files, in which case this
-     * acts like `prevent_overwrite`.
+     * Long entry of the file or an empty view if long entries were not
+     * requested.
      */
-    allow_overwrite,
+    string_view long_entry(std::size_t index) const
+    {
+        if (!m_has_long_entries)
+        {
+            return string_view();
+        }
+
+        return view(m_long_entries, m_long_entry_offsets, index);
+    }
+
+    bool has_long_entries() const
+    {
+        return m_has_long_entries;
+    }
 
     /**
-     * Overwrite any existing file using *only* atomic methods.  If atomic methods
-     * are not available on the server, the overwrite will not be performed by
-     * other methods and the function will throw an exception.
+     * Which attributes the server sent for each entry, as a mask of
+     * `LIBSSH2_SFTP_ATTR_*` flags.
      *
-     * The SFTP server may not support overwriting files, in which case this
-     * acts like `prevent_overwrite`.
+     * Entries lacking an attribute hold zero in that attribute's array.
      */
-    atomic_overwrite
-};
-BOOST_SCOPED_ENUM_END
-
-class sftp_input_device;
-class sftp_output_device;
-class sftp_io_device;
+    const std::vector<unsigned long>& attribute_flags() const
+    {
+        return m_flags;
+    }
 
-/**
- * Connection to the filesystem on a remote server via an SSH/SFTP connection.
- *
- * Filesystem connections are non-copyable.  The connection is closed when the
- * object is destroyed.
- */
-class sftp_filesystem : private boost::noncopyable
-{
-    BOOST_MOVABLE_BUT_NOT_COPYABLE(sftp_filesystem)
+    const std::vector<boost::uint64_t>& sizes() const
+    {
+        return m_sizes;
+    }
 
-public:
+    const std::vector<unsigned long>& last_modified_times() const
+    {
+        return m_mtimes;
+    }
 
     /**
-     * Move constructor.
+     * File type and permission bits, as in `LIBSSH2_SFTP_ATTRIBUTES`.
      */
-    sftp_filesystem(BOOST_RV_REF(sftp_filesystem) other)
-        : m_sftp(boost::move(other.m_sftp))
-    {}
+    const std::vector<unsigned long>& modes() const
+    {
+        return m_modes;
+    }
 
     /**
-     * Move-assignment.
+     * Make room for the given number of entries and total bytes of names
+     * so that listing does not have to grow the arrays repeatedly.
      */
-    sftp_filesystem& operator=(BOOST_RV_REF(sftp_filesystem) other)
+    void reserve(std::size_t entries, std::size_t name_bytes)
     {
-        m_sftp = boost::move(other.m_sftp);
-        return *this;
+        m_names.reserve(name_bytes);
+        m_name_offsets.reserve(entries + 1);
+        m_flags.reserve(entries);
+        m_sizes.reserve(entries);
+        m_mtimes.reserve(entries);
+        m_modes.reserve(entries);
+    }
+
+private:
+    friend class directory_reader;
+    friend class sftp_filesystem;
+
+    static string_view view(
+        const std::vector<char>& arena,
+        const std::vector<std::size_t>& offsets, std::size_t index)
+    {
+        if (index + 1 >= offsets.size())
+        {
+            BOOST_THROW_EXCEPTION(
+                std::out_of_range("Index beyond end of listing"));
+        }
+
+        if (offsets[index] == offsets[index + 1])
+        {
+            return string_view();
+        }
+
+        return string_view(
+            &arena[0] + offsets[index], &arena[0] + offsets[index + 1]);
+    }
+
+    void push_back(
+        const char* name, std::size_t name_length, const char* long_entry,
+        const LIBSSH2_SFTP_ATTRIBUTES& attributes)
+    {
+        m_names.insert(m_names.end(), name, name + name_length);
+        m_name_offsets.push_back(m_names.size());
+
+        if (m_has_long_entries)
+        {
+            m_long_entries.insert(
+                m_long_entries.end(), long_entry,
+                long_entry + std::strlen(long_entry));
+            m_long_entry_offsets.push_back(m_long_entries.size());
+        }
+
+        m_flags.push_back(attributes.flags);
+        m_sizes.push_back(
+            (attributes.flags & LIBSSH2_SFTP_ATTR_SIZE) ?
+            attributes.filesize : 0U);
+        m_mtimes.push_back(
+            (attributes.flags & LIBSSH2_SFTP_ATTR_ACMODTIME) ?
+            attributes.mtime : 0U);
+        m_modes.push_back(
+            (attributes.flags & LIBSSH2_SFTP_ATTR_PERMISSIONS) ?
+            attributes.permissions : 0U);
     }
 
+    std::vector<char> m_names;
+    std::vector<std::size_t> m_name_offsets;
+
+    bool m_has_long_entries;
+    std::vector<char> m_long_entries;
+    std::vector<std::size_t> m_long_entry_offsets;
+
+    std::vector<unsigned long> m_flags;
+    std::vector<boost::uint64_t> m_sizes;
+    std::vector<unsigned long> m_mtimes;
+    std::vector<unsigned long> m_modes;
+};
+
+/**
+ * Reads the entries of a directory in batches.
+ *
+ * An alternative to `directory_iterator` for very large directories.  Each
+ * batch is read under a single acquisition of the session lock, into
+ * buffers owned by the reader, and written into the caller's entries in
+ * place, so a caller that passes the same vector for every batch does
+ * almost no allocation once the first batch has been read.
+ *
+ * Copies of the reader share its position in the directory.
+ */
+class directory_reader
+{
+public:
+
     /**
-     * Create an iterator over the contents of the given directory.
+     * Entries per batch, matching the names per READDIR response sent by
+     * OpenSSH.
      *
-     * The iterator is copyable but all copies are linked so that incrementing
-     * one will increment all the copies.
-     *
-     * The `sftp_filesystem` (and, transitively, the `session`) must outlive
-     * all non-end copies of the iterator.  It is the caller's responsibility
-     * to ensure this.
+     * libssh2 does not reveal where one response ends so a batch can span
+     * two responses.
      */
-    directory_iterator directory_iterator(const boost::filesystem::path& path)
-    {
-        return ssh::filesystem::directory_iterator::factory_attorney()(
-            sftp_ref(), path);
+    static const std::size_t default_batch_size = 100;
+
+    /// @cond INTERNAL
+    class factory_attorney
+    {
+    private:
+        friend class sftp_filesystem;
+
+        directory_reader operator()(
+            ::ssh::detail::sftp_channel_state& channel,
+            const boost::filesystem::path& path, std::size_t batch_size,
+            const ::ssh::deadline& limit)
+        {
+            return directory_reader(channel, path, batch_size, limit);
+        }
+    };
+    /// @endcond
+
+    /**
+     * Read the next batch of entries, replacing the vector's contents.
+     *
+     * The vector is resized to the number of entries read.  Entries already
+     * in it are overwritten rather than reallocated.
+     *
+     * @returns `false` once the directory has no more entries.
+     */
+    bool readdir_batch(std::vector<directory_entry>& entries)
+    {
+        if (entries.size() < m_batch_size)
+        {
+            entries.resize(m_batch_size);
+        }
+
+        entry_sink sink(entries);
+        std::size_t count = 0;
+        try
+        {
+            count = read_entries(sink, true);
+        }
+        catch (...)
+        {
+            entries.resize(sink.count);
+            throw;
+        }
+
+        entries.resize(count);
+        return count > 0;
+    }
+
+    /**
+     * Append the next batch of entries to a compact listing.
+     *
+     * @returns `false` once the directory has no more entries.
+     */
+    bool readdir_batch(directory_listing& listing)
+    {
+        listing_sink sink(listing);
+        return read_entries(sink, listing.has_long_entries()) > 0;
+    }
+
+private:
+    friend class sftp_filesystem; // to read paged listings through sinks
+
+    directory_reader(
+        ::ssh::detail::sftp_channel_state& sftp_channel,
+        const boost::filesystem::path& path, std::size_t batch_size,
+        const ::ssh::deadline& limit)
+        :
+        m_handle(detail::open_directory(sftp_channel, path)),
+        m_batch_size((std::max)(batch_size, std::size_t(1))),
+        m_deadline(limit)
+    {}
+
+    struct entry_sink
+    {
+        explicit entry_sink(std::vector<directory_entry>& entries)
+            : entries(entries), count(0) {}
+
+        void operator()(
+            const char* name, std::size_t name_length,
+            const char* long_entry, const LIBSSH2_SFTP_ATTRIBUTES& attrs)
+        {
+            directory_entry& entry = entries[count++];
+
+            // Assigning into the existing strings keeps their capacity
+            entry.m_attributes = attrs;
+            entry.m_name.assign(name, name_length);
+            entry.m_long_entry.assign(long_entry);
+        }
+
+        std::vector<directory_entry>& entries;
+        std::size_t count;
+    };
+
+    struct listing_sink
+    {
+        explicit listing_sink(directory_listing& listing) : listing(listing) {}
+
+        void operator()(
+            const char* name, std::size_t name_length,
+            const char* long_entry, const LIBSSH2_SFTP_ATTRIBUTES& attrs)
+        {
+            listing.push_back(name, name_length, long_entry, attrs);
+        }
+
+        directory_listing& listing;
+    };
+
+    /**
+     * Read up to a batch of entries under one lock, passing each to the
+     * sink.
+     *
+     * The sink sees the filename as a pointer and length and the long
+     * entry as a NULL-terminated string, which is empty if it was not
+     * requested.
+     *
+     * @returns number of entries passed to the sink.
+     */
+    template<typename Sink>
+    std::size_t read_entries(Sink& sink, bool with_long_entries)
+    {
+        std::size_t count = 0;
+
+        if (!m_handle)
+        {
+            return count;
+        }
+
+        m_deadline.check();
+
+        int rc = 0;
+        boost::system::error_code ec;
+        std::string message;
+        {
+            ::ssh::detail::file_handle_state::scoped_lock lock =
+                m_handle->aquire_lock();
+
+            ::ssh::detail::deadline_slice slice(
+                m_handle->session_ptr(), m_deadline);
+
+            // The channel's buffers are big enough for any entry; the sink
+            // copies out of them before the channel is unlocked
+            std::vector<char>& filename_buffer =
+                m_handle->sftp_ref().filename_buffer();
+            std::vector<char>& longentry_buffer =
+                m_handle->sftp_ref().longentry_buffer();
+
+            while (count < m_batch_size)
+            {
+                LIBSSH2_SFTP_ATTRIBUTES attrs = LIBSSH2_SFTP_ATTRIBUTES();
+
+                // libssh2 skips copying the long entry when given no
+                // buffer for it
+                longentry_buffer[0] = '\0';
+
+                do
+                {
+                    ec.clear();
+                    rc = ::ssh::detail::libssh2::sftp::readdir_ex(
+                        m_handle->session_ptr(), m_handle->sftp_ptr(),
+                        m_handle->file_handle(), &filename_buffer[0],
+                        filename_buffer.size(),
+                        (with_long_entries) ? &longentry_buffer[0] : NULL,
+                        (with_long_entries) ? longentry_buffer.size() : 0,
+                        &attrs, ec, message);
+                }
+                while (ec &&
+                    ::ssh::detail::resume_after_wait_slice(
+                        ec, m_handle->sftp_ref().session_ref(), m_deadline));
+
+                if (ec || rc == 0)
+                {
+                    break;
+                }
+
+                assert(rc > 0);
+
+                // Same treatment of the buffers as
+                // directory_iterator::read_file
+                longentry_buffer[longentry_buffer.size() - 1] = '\0';
+
+                sink(
+                    &filename_buffer[0],
+                    (std::min)(
+                        static_cast<size_t>(rc), filename_buffer.size()),
+                    &longentry_buffer[0], attrs);
+
+                ++count;
+            }
+
+            // IMPORTANT: must unlock before possible handle reset below
+            // which would lock the session again to close the file handle
+        }
+
+        if (ec)
+        {
+            SSH_DETAIL_THROW_API_ERROR_CODE(
+                ec, message, "libssh2_sftp_readdir_ex");
+        }
+
+        if (rc == 0) // end of files
+        {
+            m_handle.reset();
+        }
+
+        return count;
+    }
+
+    boost::shared_ptr<::ssh::detail::file_handle_state> m_handle;
+    std::size_t m_batch_size;
+    ::ssh::deadline m_deadline;
+};
+
+/**
+ * What a paged listing is sorted by.
+ *
+ * Entries that tie are ordered by name, so every entry has one place in
+ * the order.
+ */
+BOOST_SCOPED_ENUM_START(listing_order)
+{
+    name,
+    last_modified,
+    size
+};
+BOOST_SCOPED_ENUM_END
+
+namespace detail {
+
+    /**
+     * Entry kept while choosing or paging through a sorted listing.
+     */
+    struct page_key
+    {
+        page_key() : attributes(LIBSSH2_SFTP_ATTRIBUTES()) {}
+
+        std::string name;
+        LIBSSH2_SFTP_ATTRIBUTES attributes;
+    };
+
+    /**
+     * Strict weak ordering of entries by a `listing_order`.
+     */
+    class page_order
+    {
+    public:
+        page_order(BOOST_SCOPED_ENUM(listing_order) order, bool descending)
+            : m_order(order), m_descending(descending) {}
+
+        bool operator()(
+            const char* name, std::size_t name_length,
+            const LIBSSH2_SFTP_ATTRIBUTES& attributes,
+            const char* other_name, std::size_t other_name_length,
+            const LIBSSH2_SFTP_ATTRIBUTES& other_attributes) const
+        {
+            int order = compare_keys(attributes, other_attributes);
+            if (order == 0)
+            {
+                order = compare_names(
+                    name, name_length, other_name, other_name_length);
+            }
+
+            return (m_descending) ? order > 0 : order < 0;
+        }
+
+        bool operator()(const page_key& a, const page_key& b) const
+        {
+            return (*this)(
+                a.name.data(), a.name.size(), a.attributes,
+                b.name.data(), b.name.size(), b.attributes);
+        }
+
+    private:
+
+        static int compare_names(
+            const char* a, std::size_t a_length,
+            const char* b, std::size_t b_length)
+        {
+            int order = std::memcmp(a, b, (std::min)(a_length, b_length));
+            if (order != 0)
+            {
+                return order;
+            }
+
+            return (a_length < b_length) ? -1 : (a_length > b_length);
+        }
+
+        int compare_keys(
+            const LIBSSH2_SFTP_ATTRIBUTES& a,
+            const LIBSSH2_SFTP_ATTRIBUTES& b) const
+        {
+            boost::uint64_t a_key = 0U;
+            boost::uint64_t b_key = 0U;
+
+            // Missing attributes sort as zero
+            if (m_order == listing_order::last_modified)
+            {
+                a_key = (a.flags & LIBSSH2_SFTP_ATTR_ACMODTIME) ? a.mtime : 0U;
+                b_key = (b.flags & LIBSSH2_SFTP_ATTR_ACMODTIME) ? b.mtime : 0U;
+            }
+            else if (m_order == listing_order::size)
+            {
+                a_key = (a.flags & LIBSSH2_SFTP_ATTR_SIZE) ? a.filesize : 0U;
+                b_key = (b.flags & LIBSSH2_SFTP_ATTR_SIZE) ? b.filesize : 0U;
+            }
+
+            return (a_key < b_key) ? -1 : (a_key > b_key);
+        }
+
+        BOOST_SCOPED_ENUM(listing_order) m_order;
+        bool m_descending;
+    };
+
+    /**
+     * Whole directory in sorted order, kept so that following pages need
+     * not list it again.
+     *
+     * Names are packed into one buffer; each entry keeps its full
+     * attributes but not its long entry.
+     */
+    class sorted_listing
+    {
+    public:
+        struct entry
+        {
+            std::size_t name_offset;
+            std::size_t name_length;
+            LIBSSH2_SFTP_ATTRIBUTES attributes;
+        };
+
+        explicit sorted_listing(const page_order& order) : m_order(order) {}
+
+        void push_back(
+            const char* name, std::size_t name_length,
+            const LIBSSH2_SFTP_ATTRIBUTES& attributes)
+        {
+            entry new_entry;
+            new_entry.name_offset = m_names.size();
+            new_entry.name_length = name_length;
+            new_entry.attributes = attributes;
+
+            m_names.insert(m_names.end(), name, name + name_length);
+            m_entries.push_back(new_entry);
+        }
+
+        void sort()
+        {
+            std::sort(m_entries.begin(), m_entries.end(), entry_order(*this));
+        }
+
+        /**
+         * Index of the first entry that comes after `key`.
+         */
+        std::size_t position_after(const page_key& key) const
+        {
+            return std::upper_bound(
+                m_entries.begin(), m_entries.end(), key, entry_order(*this)) -
+                m_entries.begin();
+        }
+
+        std::size_t size() const
+        {
+            return m_entries.size();
+        }
+
+        page_key key(std::size_t index) const
+        {
+            const entry& found = m_entries[index];
+
+            page_key result;
+            result.name.assign(
+                name_pointer(found), name_pointer(found) + found.name_length);
+            result.attributes = found.attributes;
+            return result;
+        }
+
+    private:
+
+        const char* name_pointer(const entry& e) const
+        {
+            return (m_names.empty()) ? "" : &m_names[0] + e.name_offset;
+        }
+
+        struct entry_order
+        {
+            explicit entry_order(const sorted_listing& listing)
+                : listing(&listing) {}
+
+            bool operator()(const entry& a, const entry& b) const
+            {
+                return listing->m_order(
+                    listing->name_pointer(a), a.name_length, a.attributes,
+                    listing->name_pointer(b), b.name_length, b.attributes);
+            }
+
+            bool operator()(const page_key& a, const entry& b) const
+            {
+                return listing->m_order(
+                    a.name.data(), a.name.size(), a.attributes,
+                    listing->name_pointer(b), b.name_length, b.attributes);
+            }
+
+            const sorted_listing* listing;
+        };
+
+        page_order m_order;
+        std::vector<char> m_names;
+        std::vector<entry> m_entries;
+    };
+
+    inline bool is_self_or_parent(const char* name, std::size_t name_length)
+    {
+        return (name_length == 1 && name[0] == '.') ||
+            (name_length == 2 && name[0] == '.' && name[1] == '.');
+    }
+
+    /**
+     * `directory_reader` sink keeping the best `page_size` entries seen so
+     * far, in a heap with the entry that would be dropped first at the
+     * front.
+     *
+     * Entries are compared straight out of the reader's buffers, so one
+     * that cannot make the page is never copied.
+     */
+    struct page_sink
+    {
+        page_sink(
+            const page_order& order, std::size_t page_size,
+            std::vector<page_key>& best)
+            : order(order), page_size(page_size), best(best), more(false) {}
+
+        void operator()(
+            const char* name, std::size_t name_length, const char*,
+            const LIBSSH2_SFTP_ATTRIBUTES& attrs)
+        {
+            if (is_self_or_parent(name, name_length))
+            {
+                return;
+            }
+
+            if (best.size() == page_size)
+            {
+                more = true;
+                if (!order(
+                        name, name_length, attrs, best.front().name.data(),
+                        best.front().name.size(), best.front().attributes))
+                {
+                    return;
+                }
+
+                // Reuse the dropped entry's string
+                std::pop_heap(best.begin(), best.end(), order);
+            }
+            else
+            {
+                best.push_back(page_key());
+            }
+
+            best.back().name.assign(name, name_length);
+            best.back().attributes = attrs;
+            std::push_heap(best.begin(), best.end(), order);
+        }
+
+        page_order order;
+        std::size_t page_size;
+        std::vector<page_key>& best;
+
+        /// Some entry did not make the page.
+        bool more;
+    };
+
+    /**
+     * `directory_reader` sink copying entries into a `sorted_listing`.
+     */
+    struct sorted_listing_sink
+    {
+        explicit sorted_listing_sink(sorted_listing& listing)
+            : listing(listing) {}
+
+        void operator()(
+            const char* name, std::size_t name_length, const char*,
+            const LIBSSH2_SFTP_ATTRIBUTES& attrs)
+        {
+            if (!is_self_or_parent(name, name_length))
+            {
+                listing.push_back(name, name_length, attrs);
+            }
+        }
+
+        sorted_listing& listing;
+    };
+
+}
+
+/**
+ * Where the next page of a sorted listing starts.
+ *
+ * Holds the last entry of the page it came from, so a following page
+ * starts after that entry even if entries have since been added or
+ * removed before it.
+ */
+class page_cursor
+{
+private:
+    friend class sftp_filesystem;
+
+    page_cursor(
+        const boost::filesystem::path& directory,
+        BOOST_SCOPED_ENUM(listing_order) order, bool descending,
+        const detail::page_key& last,
+        boost::shared_ptr<const detail::sorted_listing> listing)
+        :
+    m_directory(directory), m_order(order), m_descending(descending),
+    m_last(last), m_listing(listing) {}
+
+    boost::filesystem::path m_directory;
+    BOOST_SCOPED_ENUM(listing_order) m_order;
+    bool m_descending;
+    detail::page_key m_last;
+
+    /// Null until a page after the first is asked for.
+    boost::shared_ptr<const detail::sorted_listing> m_listing;
+};
+
+/**
+ * One page of a sorted listing of a directory.
+ */
+class directory_page
+{
+public:
+
+    /**
+     * Entries of the page, in order, without `.` and `..`.
+     *
+     * Long entries are left empty.
+     */
+    const std::vector<directory_entry>& entries() const
+    {
+        return m_entries;
+    }
+
+    /**
+     * Are there entries after this page?
+     */
+    bool has_more() const
+    {
+        return m_next.is_initialized();
+    }
+
+    /**
+     * Cursor for the page after this one.
+     *
+     * @throws `std::logic_error` if this is the last page.
+     */
+    const page_cursor& next() const
+    {
+        if (!m_next)
+        {
+            BOOST_THROW_EXCEPTION(std::logic_error("No more pages"));
+        }
+
+        return *m_next;
+    }
+
+private:
+    friend class sftp_filesystem;
+
+    std::vector<directory_entry> m_entries;
+    boost::optional<page_cursor> m_next;
+};
+
+namespace detail {
+
+    BOOST_SCOPED_ENUM_START(path_status)
+    {
+        non_existent,
+            non_directory,
+            directory
+    };
+    BOOST_SCOPED_ENUM_END;
+
+
+    inline BOOST_SCOPED_ENUM(path_status) check_status(
+        sftp_filesystem& filesystem, const boost::filesystem::path& path,
+        const ::ssh::deadline& limit=::ssh::deadline());
+
+    class stat_task : public ::ssh::detail::pipeline_task
+    {
+    public:
+        stat_task(
+            const std::string& path, bool follow_links,
+            LIBSSH2_SFTP_ATTRIBUTES& attributes,
+            boost::system::error_code& ec)
+            :
+        m_path(path), m_follow_links(follow_links), m_attributes(attributes),
+        m_ec(ec) {}
+
+        virtual bool resume(::ssh::detail::sftp_channel_state& channel)
+        {
+            int rc = ::libssh2_sftp_stat_ex(
+                channel.sftp_ptr(), m_path.data(),
+                static_cast<unsigned int>(m_path.size()),
+                (m_follow_links) ? LIBSSH2_SFTP_STAT : LIBSSH2_SFTP_LSTAT,
+                &m_attributes);
+
+            return ::ssh::detail::sftp_call_finished(rc, channel, m_ec);
+        }
+
+    private:
+        const std::string& m_path;
+        bool m_follow_links;
+        LIBSSH2_SFTP_ATTRIBUTES& m_attributes;
+        boost::system::error_code& m_ec;
+    };
+
+    /**
+     * Stats the paths at the given indices, filling in the attributes or
+     * error at the same index.
+     */
+    class stat_batch : public ::ssh::detail::pipeline_source
+    {
+    public:
+        stat_batch(
+            const std::vector<std::string>& paths,
+            const std::vector<std::size_t>& indices, bool follow_links,
+            std::vector<LIBSSH2_SFTP_ATTRIBUTES>& attributes,
+            std::vector<boost::system::error_code>& errors)
+            :
+        m_paths(paths), m_indices(indices), m_follow_links(follow_links),
+        m_attributes(attributes), m_errors(errors), m_next(0U) {}
+
+        virtual boost::shared_ptr< ::ssh::detail::pipeline_task> next_task()
+        {
+            if (m_next == m_indices.size())
+            {
+                return boost::shared_ptr< ::ssh::detail::pipeline_task>();
+            }
+
+            std::size_t i = m_indices[m_next++];
+            return boost::make_shared<stat_task>(
+                boost::cref(m_paths[i]), m_follow_links,
+                boost::ref(m_attributes[i]), boost::ref(m_errors[i]));
+        }
+
+    private:
+        const std::vector<std::string>& m_paths;
+        const std::vector<std::size_t>& m_indices;
+        bool m_follow_links;
+        std::vector<LIBSSH2_SFTP_ATTRIBUTES>& m_attributes;
+        std::vector<boost::system::error_code>& m_errors;
+        std::size_t m_next;
+    };
+
+}
+
+/**
+ * Size and free space of a remote filesystem, as Boost.Filesystem's
+ * `space_info`.
+ */
+struct space_info
+{
+    /// Total size of the filesystem in bytes.
+    boost::uintmax_t capacity;
+
+    /// Bytes not in use.
+    boost::uintmax_t free;
+
+    /// Bytes that the user the server runs as may still write; can be less
+    /// than `free` as some space is often reserved for the superuser.
+    boost::uintmax_t available;
+};
+
+/**
+ * OpenSSH protocol extensions that the server supports, so far as they
+ * can be used.
+ *
+ * Only extensions that this library knows how to use are reported.
+ * libssh2 neither passes on the list that the server advertises when the
+ * channel opens nor sends extended requests it does not know, so the
+ * `limits@openssh.com`, `copy-data`, `check-file` and
+ * `hardlink@openssh.com` extensions cannot be reported here.
+ */
+struct server_capabilities
+{
+    /// `posix-rename@openssh.com`: renames that replace the destination.
+    bool posix_rename;
+
+    /// `statvfs@openssh.com`: `sftp_filesystem::space`.
+    bool statvfs;
+
+    /// `fsync@openssh.com`: durable streams and `sync_batch`.
+    bool fsync;
+};
+
+BOOST_SCOPED_ENUM_START(overwrite_behaviour)
+{
+    /**
+     * Do not overwrite an existing file at the destination.
+     * 
+     * If the file exists function will throw an exception.
+     */
+    prevent_overwrite,
+
+    /**
+     * Overwrite any existing file at the destination.
+     *
+     * The SFTP server may not support overwriting files, in which case this
+     * acts like `prevent_overwrite`.
+     */
+    allow_overwrite,
+
+    /**
+     * Overwrite any existing file using *only* atomic methods.  If atomic methods
+     * are not available on the server, the overwrite will not be performed by
+     * other methods and the function will throw an exception.
+     *
+     * The SFTP server may not support overwriting files, in which case this
+     * acts like `prevent_overwrite`.
+     */
+    atomic_overwrite
+};
+BOOST_SCOPED_ENUM_END
+
+/**
+ * A path that an operation on many paths could not process, and why.
+ */
+typedef std::pair<boost::filesystem::path, boost::system::error_code>
+    path_error;
+
+/**
+ * What statting one path of a batch found.
+ *
+ * `first` holds the attributes if the path exists.  `second` holds the
+ * error if statting it failed for any reason other than there being nothing
+ * there.  Neither is set if the path does not exist.
+ */
+typedef std::pair<boost::optional<file_attributes>, boost::system::error_code>
+    attributes_result;
+
+class sftp_input_device;
+class sftp_output_device;
+class sftp_io_device;
+class recursive_directory_walker;
+class tree_remover;
+class tree_mirror;
+class sync_batch;
+
+/**
+ * Connection to the filesystem on a remote server via an SSH/SFTP connection.
+ *
+ * Filesystem connections are non-copyable.  The connection is closed when the
+ * object is destroyed.
+ */
+class sftp_filesystem : private boost::noncopyable
+{
+    BOOST_MOVABLE_BUT_NOT_COPYABLE(sftp_filesystem)
+
+public:
+
+    /**
+     * Move constructor.
+     */
+    sftp_filesystem(BOOST_RV_REF(sftp_filesystem) other)
+        :
+    m_sftp(boost::move(other.m_sftp)),
+    m_attribute_cache(boost::move(other.m_attribute_cache)),
+    m_known_directories(boost::move(other.m_known_directories)),
+    m_resolution_cache(boost::move(other.m_resolution_cache)),
+    m_stat_width(other.m_stat_width),
+    m_stat_channels(boost::move(other.m_stat_channels))
+    {}
+
+    /**
+     * Move-assignment.
+     */
+    sftp_filesystem& operator=(BOOST_RV_REF(sftp_filesystem) other)
+    {
+        m_sftp = boost::move(other.m_sftp);
+        m_attribute_cache = boost::move(other.m_attribute_cache);
+        m_known_directories = boost::move(other.m_known_directories);
+        m_resolution_cache = boost::move(other.m_resolution_cache);
+        m_stat_width = other.m_stat_width;
+        m_stat_channels = boost::move(other.m_stat_channels);
+        return *this;
+    }
+
+    /**
+     * Create an iterator over the contents of the given directory.
+     *
+     * The iterator is copyable but all copies are linked so that incrementing
+     * one will increment all the copies.
+     *
+     * The `sftp_filesystem` (and, transitively, the `session`) must outlive
+     * all non-end copies of the iterator.  It is the caller's responsibility
+     * to ensure this.
+     *
+     * Listing the directory stops with an exception if `limit` passes.
+     */
+    directory_iterator directory_iterator(
+        const boost::filesystem::path& path,
+        const ::ssh::deadline& limit=::ssh::deadline())
+    {
+        return ssh::filesystem::directory_iterator::factory_attorney()(
+            sftp_ref(), path, limit, m_attribute_cache);
+    }
+
+    /**
+     * Iterate over only the entries of a directory that `filter` accepts.
+     *
+     * Each entry's name and long entry are copied out of the channel's
+     * buffers while the session is locked and the filter then sees the
+     * copy, unlocked.  The copies reuse the iterator's strings, so once
+     * they have grown to fit, rejecting an entry does not allocate.  Only
+     * accepted entries are turned into `sftp_file`s and remembered by any
+     * attribute cache.  `glob` filters by name pattern.
+     */
+    ssh::filesystem::directory_iterator directory_iterator(
+        const boost::filesystem::path& path, const entry_filter& filter,
+        const ::ssh::deadline& limit=::ssh::deadline())
+    {
+        return ssh::filesystem::directory_iterator::factory_attorney()(
+            sftp_ref(), path, limit, m_attribute_cache, filter);
+    }
+
+    /**
+     * Create an iterator marking the end of a directory.
+     */
+    ssh::filesystem::directory_iterator directory_iterator()
+    {
+        return ssh::filesystem::directory_iterator::factory_attorney()();
+    }
+
+    /**
+     * Open a directory to read its contents in batches.
+     *
+     * Suited to very large directories.  The same lifetime rules as for
+     * `directory_iterator` apply.
+     *
+     * @see directory_reader
+     */
+    directory_reader read_directory(
+        const boost::filesystem::path& path,
+        std::size_t batch_size=directory_reader::default_batch_size,
+        const ::ssh::deadline& limit=::ssh::deadline())
+    {
+        return directory_reader::factory_attorney()(
+            sftp_ref(), path, batch_size, limit);
+    }
+
+    /**
+     * List a whole directory into a compact `directory_listing`.
+     *
+     * @param with_long_entries
+     *     Whether to keep each entry's long entry.  Leaving them out saves
+     *     memory and copying.
+     */
+    directory_listing list_directory(
+        const boost::filesystem::path& path, bool with_long_entries=false,
+        const ::ssh::deadline& limit=::ssh::deadline())
+    {
+        directory_listing listing;
+        listing.m_has_long_entries = with_long_entries;
+
+        ssh::filesystem::directory_reader reader = read_directory(
+            path, directory_reader::default_batch_size, limit);
+        while (reader.readdir_batch(listing)) {}
+
+        return listing;
+    }
+    
+    /**
+     * First `page_size` entries of a directory in the given order.
+     *
+     * The directory is read through once, keeping only the best
+     * `page_size` entries seen so far, so memory does not grow with the
+     * size of the directory and an entry that cannot make the page is not
+     * copied.  `.` and `..` are left out.
+     *
+     * @throws `std::invalid_argument` if `page_size` is zero.
+     */
+    directory_page list_page(
+        const boost::filesystem::path& path,
+        BOOST_SCOPED_ENUM(listing_order) order, std::size_t page_size,
+        bool descending=false,
+        const ::ssh::deadline& limit=::ssh::deadline())
+    {
+        if (page_size == 0U)
+        {
+            BOOST_THROW_EXCEPTION(
+                std::invalid_argument("Pages must hold at least one entry"));
+        }
+
+        detail::page_order ordering(order, descending);
+
+        std::vector<detail::page_key> best;
+        best.reserve(page_size);
+        detail::page_sink sink(ordering, page_size, best);
+
+        // Long entries are not asked for as pages do not hold them
+        ssh::filesystem::directory_reader reader = read_directory(
+            path, directory_reader::default_batch_size, limit);
+        while (reader.read_entries(sink, false) > 0) {}
+
+        std::sort_heap(best.begin(), best.end(), ordering);
+
+        directory_page page;
+        fill_page(page, best);
+        if (sink.more)
+        {
+            page.m_next = page_cursor(
+                path, order, descending, best.back(),
+                boost::shared_ptr<const detail::sorted_listing>());
+        }
+
+        return page;
     }
 
     /**
-     * Create an iterator marking the end of a directory.
+     * Page of up to `page_size` entries starting where `cursor` points.
+     *
+     * The first time a cursor from the first page is used, the whole
+     * directory is listed into a compact, sorted copy that this page and
+     * all later ones are taken from without asking the server again.  The
+     * later pages therefore do not show changes made after that listing.
+     *
+     * @throws `std::invalid_argument` if `page_size` is zero.
      */
-    ssh::filesystem::directory_iterator directory_iterator()
+    directory_page list_page(
+        const page_cursor& cursor, std::size_t page_size,
+        const ::ssh::deadline& limit=::ssh::deadline())
     {
-        return ssh::filesystem::directory_iterator::factory_attorney()();
+        if (page_size == 0U)
+        {
+            BOOST_THROW_EXCEPTION(
+                std::invalid_argument("Pages must hold at least one entry"));
+        }
+
+        boost::shared_ptr<const detail::sorted_listing> listing =
+            cursor.m_listing;
+        if (!listing)
+        {
+            boost::shared_ptr<detail::sorted_listing> new_listing =
+                boost::make_shared<detail::sorted_listing>(
+                    detail::page_order(cursor.m_order, cursor.m_descending));
+
+            detail::sorted_listing_sink sink(*new_listing);
+            ssh::filesystem::directory_reader reader = read_directory(
+                cursor.m_directory, directory_reader::default_batch_size,
+                limit);
+            while (reader.read_entries(sink, false) > 0) {}
+
+            new_listing->sort();
+            listing = new_listing;
+        }
+
+        std::size_t first = listing->position_after(cursor.m_last);
+        std::size_t last =
+            first + (std::min)(page_size, listing->size() - first);
+
+        std::vector<detail::page_key> keys;
+        keys.reserve(last - first);
+        for (std::size_t i = first; i < last; ++i)
+        {
+            keys.push_back(listing->key(i));
+        }
+
+        directory_page page;
+        fill_page(page, keys);
+        if (last < listing->size())
+        {
+            page.m_next = page_cursor(
+                cursor.m_directory, cursor.m_order, cursor.m_descending,
+                keys.back(), listing);
+        }
+
+        return page;
     }
-    
+
     /**
      * Query a file for its attributes.
      *
      * If @a follow_links is @c true, the file that is queried is the target of
      * any chain of links.  Otherwise, it is the link itself.
      *
+     * If the filesystem caches attributes (see `sftp_options`), a
+     * remembered answer is given without asking the server.
+     *
      * @todo Split into `status` and `symlink_status` to mirror Boost.Filesystem
      *       API.
      */
     file_attributes attributes(
-        const boost::filesystem::path& file, bool follow_links)
+        const boost::filesystem::path& file, bool follow_links,
+        const ::ssh::deadline& limit=::ssh::deadline())
     {
         std::string file_path = file.string();
         LIBSSH2_SFTP_ATTRIBUTES attributes = LIBSSH2_SFTP_ATTRIBUTES();
 
+        ::ssh::detail::cached_attributes cached;
+        if (m_attribute_cache &&
+            m_attribute_cache->find(file_path, follow_links, cached))
+        {
+            if (cached.missing)
+            {
+                SSH_DETAIL_THROW_API_ERROR_CODE_WITH_PATH(
+                    cached.missing, "No such file (cached)",
+                    "libssh2_sftp_stat_ex", file_path.data(),
+                    file_path.size());
+            }
+
+            return file_attributes(cached.attributes);
+        }
+
+        limit.check();
+
+        boost::system::error_code ec;
+        std::string message;
         {
             ::ssh::detail::sftp_channel_state::scoped_lock lock =
                 sftp_ref().aquire_lock();
 
-            ::ssh::detail::libssh2::sftp::stat(
-                sftp_ref().session_ptr(), sftp_ref().sftp_ptr(),
-                file_path.data(), file_path.size(),
-                (follow_links) ? LIBSSH2_SFTP_STAT : LIBSSH2_SFTP_LSTAT,
-                &attributes);
+            ::ssh::detail::deadline_slice slice(
+                sftp_ref().session_ptr(), limit);
+
+            do
+            {
+                ec.clear();
+                ::ssh::detail::libssh2::sftp::stat(
+                    sftp_ref().session_ptr(), sftp_ref().sftp_ptr(),
+                    file_path.data(), file_path.size(),
+                    (follow_links) ? LIBSSH2_SFTP_STAT : LIBSSH2_SFTP_LSTAT,
+                    &attributes, ec, message);
+            }
+            while (ec &&
+                ::ssh::detail::resume_after_wait_slice(
+                    ec, sftp_ref().session_ref(), limit));
+        }
+
+        if (m_attribute_cache)
+        {
+            if (!ec)
+            {
+                m_attribute_cache->insert(
+                    file_path, follow_links, attributes);
+            }
+            else if (ec == boost::system::errc::no_such_file_or_directory)
+            {
+                m_attribute_cache->insert_missing(
+                    file_path, follow_links, ec);
+            }
+        }
+
+        if (ec)
+        {
+            SSH_DETAIL_THROW_API_ERROR_CODE_WITH_PATH(
+                ec, message, "libssh2_sftp_stat_ex", file_path.data(),
+                file_path.size());
         }
 
         return file_attributes(attributes);
     }
 
+    /**
+     * Query many files for their attributes at once.
+     *
+     * Rather than waiting a round trip for each file, the stat requests go
+     * out over several SFTP channels, each sending its next request as soon
+     * as the last is answered.  Worthwhile for more than a handful of
+     * paths.  How many channels is set by `sftp_options::set_stat_width`;
+     * they are kept open for the next call.
+     *
+     * @param paths  Range of `boost::filesystem::path`s, or of anything
+     *               convertible to one.
+     * @returns the result for each path, in the same order.  Missing paths
+     *          and other failures do not stop the rest being queried.
+     * @throws `boost::system::system_error` if no channel can be opened or
+     *         the deadline passes.
+     */
+    template<typename PathRange>
+    typename boost::disable_if<
+        boost::is_convertible<PathRange, boost::filesystem::path>,
+        std::vector<attributes_result> >::type
+    attributes(
+        const PathRange& paths, bool follow_links,
+        const ::ssh::deadline& limit=::ssh::deadline())
+    {
+        std::vector<std::string> path_strings;
+        for (typename boost::range_iterator<const PathRange>::type it =
+                boost::begin(paths);
+            it != boost::end(paths); ++it)
+        {
+            path_strings.push_back(boost::filesystem::path(*it).string());
+        }
+
+        std::vector<attributes_result> results(path_strings.size());
+        std::vector<LIBSSH2_SFTP_ATTRIBUTES> raw_attributes(
+            path_strings.size(), LIBSSH2_SFTP_ATTRIBUTES());
+        std::vector<boost::system::error_code> errors(path_strings.size());
+
+        std::vector<std::size_t> to_query;
+        for (std::size_t i = 0; i < path_strings.size(); ++i)
+        {
+            ::ssh::detail::cached_attributes cached;
+            if (m_attribute_cache &&
+                m_attribute_cache->find(path_strings[i], follow_links, cached))
+            {
+                if (!cached.missing)
+                {
+                    results[i].first = file_attributes(cached.attributes);
+                }
+            }
+            else
+            {
+                to_query.push_back(i);
+            }
+        }
+
+        if (to_query.empty())
+        {
+            return results;
+        }
+
+        limit.check();
+
+        // Opening a channel costs a round trip or two so small batches use
+        // fewer, and channels from earlier batches are used first
+        std::size_t width = (std::min)(to_query.size(), m_stat_width);
+        ::ssh::detail::sftp_pipeline pipeline(
+            sftp_ref().session_ref(), m_stat_channels->take(width), width);
+
+        detail::stat_batch batch(
+            path_strings, to_query, follow_links, raw_attributes, errors);
+        pipeline.run(batch, limit);
+
+        // Only reached if every request was answered, so the channels are
+        // clean
+        m_stat_channels->give_back(pipeline.channels());
+
+        for (std::size_t j = 0; j < to_query.size(); ++j)
+        {
+            std::size_t i = to_query[j];
+            const boost::system::error_code& ec = errors[i];
+
+            if (!ec)
+            {
+                results[i].first = file_attributes(raw_attributes[i]);
+            }
+            else if (ec != boost::system::errc::no_such_file_or_directory)
+            {
+                results[i].second = ec;
+            }
+
+            if (m_attribute_cache)
+            {
+                if (!ec)
+                {
+                    m_attribute_cache->insert(
+                        path_strings[i], follow_links, raw_attributes[i]);
+                }
+                else if (ec == boost::system::errc::no_such_file_or_directory)
+                {
+                    m_attribute_cache->insert_missing(
+                        path_strings[i], follow_links, ec);
+                }
+            }
+        }
+
+        return results;
+    }
+
     boost::filesystem::path resolve_link_target(
         const boost::filesystem::path& link)
     {
@@ -579,6 +2125,11 @@ public:
         ::ssh::detail::libssh2::sftp::symlink(
             sftp_ref().session_ptr(), sftp_ref().sftp_ptr(), link_string.data(),
             link_string.size(), target_string.data(), target_string.size());
+
+        // Which parameter OpenSSH takes as the link is back to front
+        forget_attributes(link);
+        forget_attributes(target);
+        forget_resolved_paths();
     }
 
     /**
@@ -615,6 +2166,12 @@ public:
      * presence of an existing `destination`.  Therefore the APIs do not align
      * completely.
      *
+     * For `atomic_overwrite`, the OpenSSH `posix-rename@openssh.com`
+     * extension is tried first.  It replaces an existing `destination`
+     * atomically, as POSIX `rename` does, in one round trip.  Only if the
+     * server does not support it, which is then remembered, is the
+     * standard SFTP rename used.
+     *
      * @todo Not currently supporting the NATIVE flag as it's not at all clear
      *       what it does.
      */
@@ -652,10 +2209,23 @@ public:
         ::ssh::detail::sftp_channel_state::scoped_lock lock =
             sftp_ref().aquire_lock();
 
+        if (overwrite_hint == overwrite_behaviour::atomic_overwrite &&
+            posix_rename(source_string, destination_string))
+        {
+            forget_attributes(source);
+            forget_attributes(destination);
+            forget_resolved_paths();
+            return;
+        }
+
         ::ssh::detail::libssh2::sftp::rename(
             sftp_ref().session_ptr(), sftp_ref().sftp_ptr(),
             source_string.data(), source_string.size(),
             destination_string.data(), destination_string.size(), flags);
+
+        forget_attributes(source);
+        forget_attributes(destination);
+        forget_resolved_paths();
     }
 
     /**
@@ -716,6 +2286,43 @@ public:
         }
     }
 
+    /**
+     * Remove a file whose type is already known.
+     *
+     * Saves the stat round trip of `remove(target)` by trusting `type_hint`,
+     * typically the attributes the file was listed with, to say whether
+     * `target` is a directory.  If the hint does not include the type, falls
+     * back to statting.  A hint that has gone stale makes the removal fail
+     * with an exception.
+     */
+    bool remove(
+        const boost::filesystem::path& target,
+        const file_attributes& type_hint)
+    {
+        switch (type_hint.type())
+        {
+        case file_attributes::directory:
+            return remove_empty_directory(target);
+
+        case file_attributes::unknown:
+            return remove(target);
+
+        default:
+            return remove_one_file(target);
+        }
+    }
+
+    /**
+     * Remove a file listed by a `directory_iterator`, without statting it
+     * again.
+     *
+     * @see remove(const boost::filesystem::path&, const file_attributes&)
+     */
+    bool remove(const sftp_file& target)
+    {
+        return remove(target.path(), target.attributes());
+    }
+
     /**
      * Remove a file and anything below it in the hierarchy.
      *
@@ -735,87 +2342,439 @@ public:
      *
      * All files below the target must be statted (indirectly via directory listing)
      * by any implementation so this function adds no overhead for those.
+     *
+     * If `limit` passes or is cancelled, the function stops with an exception
+     * leaving whatever it has not yet reached in place.
      */
-    boost::uintmax_t remove_all(const boost::filesystem::path& target)
+    boost::uintmax_t remove_all(
+        const boost::filesystem::path& target,
+        const ::ssh::deadline& limit=::ssh::deadline())
     {
-        switch (detail::check_status(*this, target))
+        switch (detail::check_status(*this, target, limit))
         {
         case detail::path_status::non_existent:
             return 0U;
 
         case detail::path_status::directory:
-            return remove_directory(target);
+            return remove_directory(target, limit);
 
         case detail::path_status::non_directory:
             // This includes 'unknown' file type.  What's the alternative?
-            return remove_one_file(target);
+            return remove_one_file(target, limit);
+
+        default:
+            assert(false);
+            BOOST_THROW_EXCEPTION(std::logic_error("Unknown path status"));
+            return 0U;
+        }
+    }
+
+    /**
+     * Remove a file, whose type is already known, and anything below it.
+     *
+     * Trusts `type_hint` in the same way as the `remove` overload taking
+     * one, saving the stat round trip.
+     */
+    boost::uintmax_t remove_all(
+        const boost::filesystem::path& target,
+        const file_attributes& type_hint,
+        const ::ssh::deadline& limit=::ssh::deadline())
+    {
+        switch (type_hint.type())
+        {
+        case file_attributes::directory:
+            return remove_directory(target, limit);
+
+        case file_attributes::unknown:
+            return remove_all(target, limit);
+
+        default:
+            return (remove_one_file(target, limit)) ? 1U : 0U;
+        }
+    }
+
+    /**
+     * Remove a file listed by a `directory_iterator`, and anything below
+     * it, without statting it again.
+     */
+    boost::uintmax_t remove_all(
+        const sftp_file& target,
+        const ::ssh::deadline& limit=::ssh::deadline())
+    {
+        return remove_all(target.path(), target.attributes(), limit);
+    }
+
+    /**
+     * Make a directory accessible from the given path.
+     *
+     * @returns `true` if a new directory was created at `new_directory`
+     *          `false` if a directory already existed on that path.
+     *
+     * This function mirrors Boost.Filesystem `create_directory` except that
+     * directories are created with 0755 permissions instead of 0777.  0755 is
+     * more secure and the recommended permissions for directories on web server
+     * so seems more appropriate.  It's not clear why Boost.Filesystem chooses
+     * 0777 instead.
+     */
+    bool create_directory(const boost::filesystem::path& new_directory)
+    {
+        std::string new_directory_string = new_directory.string();
+
+        try
+        {
+            ::ssh::detail::sftp_channel_state::scoped_lock lock =
+                sftp_ref().aquire_lock();
+
+            ::ssh::detail::libssh2::sftp::mkdir_ex(
+                sftp_ref().session_ptr(), sftp_ref().sftp_ptr(),
+                new_directory_string.data(),
+                new_directory_string.size(),
+                LIBSSH2_SFTP_S_IRWXU |
+                LIBSSH2_SFTP_S_IRGRP | LIBSSH2_SFTP_S_IXGRP |
+                LIBSSH2_SFTP_S_IROTH | LIBSSH2_SFTP_S_IXOTH);
+
+            forget_attributes(new_directory);
+            remember_directory(new_directory_string);
+            return true;
+        }
+        catch (const boost::system::system_error&)
+        {
+            // Whatever is remembered about the path cannot be trusted to
+            // explain the failure
+            forget_attributes(new_directory);
+
+            // Might just be because it already exists.  Let's check that and if
+            // ignore if that's the case.
+            // Doing this test after avoids an extra trip to the server in the
+            // common case.
+
+            // We don't test the exception's error code because OpenSSH just
+            // returns FX_FAILURE which could have many causes.  The only way
+            // to be sure the directory is already there is to check explicitly.
+
+            switch (detail::check_status(*this, new_directory))
+            {
+            case detail::path_status::non_directory:
+            case detail::path_status::non_existent:
+                throw;
+
+            case detail::path_status::directory:
+                remember_directory(new_directory_string);
+                return false;
+
+            default:
+                assert(false);
+                BOOST_THROW_EXCEPTION(std::logic_error("Unknown path status"));
+                return false;
+            }
+        }
+    }
+
+    /**
+     * Make a directory accessible from the given path, creating any missing
+     * directories above it too.
+     *
+     * @returns `true` if any directory was created and `false` if the
+     *          directory already existed.
+     *
+     * Mirrors Boost.Filesystem `create_directories` with the same
+     * permissions as `create_directory`.
+     *
+     * If attributes are cached (see `sftp_options::cache_attributes`),
+     * directories that this filesystem has created, or found to exist, are
+     * remembered for as long as attributes are, or until it removes or
+     * renames them.  Creating many paths below the same directory then
+     * costs one round trip each in the usual case where only the last
+     * level is missing.  A remembered directory removed by other means is
+     * still reported as existing until its entry expires or
+     * `forget_attributes` is called for it.  Without the cache, every
+     * call asks the server.
+     *
+     * Missing levels are created one after another: a level cannot be
+     * created until the one above it exists.
+     */
+    bool create_directories(
+        const boost::filesystem::path& new_directory,
+        const ::ssh::deadline& limit=::ssh::deadline())
+    {
+        std::string directory_string = new_directory.string();
+        while (directory_string.size() > 1 &&
+            directory_string[directory_string.size() - 1] == '/')
+        {
+            directory_string.erase(directory_string.size() - 1);
+        }
+
+        if (directory_string.empty() || directory_string == "/" ||
+            (m_known_directories &&
+                m_known_directories->contains(directory_string)))
+        {
+            return false;
+        }
+
+        boost::filesystem::path directory(directory_string);
+
+        // Try the common case, that only this level is missing, first
+        boost::system::error_code ec;
+        std::string message;
+        make_directory(directory_string, ec, message, limit);
+        if (!ec)
+        {
+            forget_attributes(directory);
+            remember_directory(directory_string);
+            return true;
+        }
+
+        forget_attributes(directory);
+
+        switch (detail::check_status(*this, directory, limit))
+        {
+        case detail::path_status::directory:
+            remember_directory(directory_string);
+            return false;
+
+        case detail::path_status::non_directory:
+            SSH_DETAIL_THROW_API_ERROR_CODE_WITH_PATH(
+                ec, message, "libssh2_sftp_mkdir_ex", directory_string.data(),
+                directory_string.size());
+
+        default:
+            break;
+        }
+
+        boost::filesystem::path parent = directory.parent_path();
+        if (parent.empty() || parent == directory)
+        {
+            SSH_DETAIL_THROW_API_ERROR_CODE_WITH_PATH(
+                ec, message, "libssh2_sftp_mkdir_ex", directory_string.data(),
+                directory_string.size());
+        }
+
+        // The parent may have been remembered but since removed by other
+        // means
+        if (m_known_directories)
+        {
+            m_known_directories->forget(parent.string());
+        }
+        create_directories(parent, limit);
+
+        make_directory(directory_string, ec, message, limit);
+        forget_attributes(directory);
+        if (ec)
+        {
+            SSH_DETAIL_THROW_API_ERROR_CODE_WITH_PATH(
+                ec, message, "libssh2_sftp_mkdir_ex", directory_string.data(),
+                directory_string.size());
+        }
+
+        remember_directory(directory_string);
+        return true;
+    }
+
+    /**
+     * Size and free space of the filesystem holding `path`.
+     *
+     * Mirrors Boost.Filesystem `space`.  Uses the OpenSSH
+     * `statvfs@openssh.com` extension so fails on servers without it.
+     *
+     * @throws `boost::system::system_error` if the server does not support
+     *         the extension, `path` does not exist or the deadline passes.
+     */
+    space_info space(
+        const boost::filesystem::path& path,
+        const ::ssh::deadline& limit=::ssh::deadline())
+    {
+        limit.check();
+
+        std::string path_string = path.string();
+        LIBSSH2_SFTP_STATVFS statistics = LIBSSH2_SFTP_STATVFS();
+
+        boost::system::error_code ec;
+        std::string message;
+
+        {
+            ::ssh::detail::sftp_channel_state::scoped_lock lock =
+                sftp_ref().aquire_lock();
+
+            ::ssh::detail::deadline_slice slice(
+                sftp_ref().session_ptr(), limit);
+
+            do
+            {
+                ec.clear();
+
+                ::ssh::detail::libssh2::sftp::statvfs(
+                    sftp_ref().session_ptr(), sftp_ref().sftp_ptr(),
+                    path_string.data(), path_string.size(), &statistics, ec,
+                    message);
+            }
+            while (ec &&
+                ::ssh::detail::resume_after_wait_slice(
+                    ec, sftp_ref().session_ref(), limit));
+        }
 
-        default:
-            assert(false);
-            BOOST_THROW_EXCEPTION(std::logic_error("Unknown path status"));
-            return 0U;
+        if (ec)
+        {
+            SSH_DETAIL_THROW_API_ERROR_CODE_WITH_PATH(
+                ec, message, "libssh2_sftp_statvfs", path_string.data(),
+                path_string.size());
         }
+
+        // Block counts are in fragments, as for POSIX statvfs
+        space_info info;
+        info.capacity = statistics.f_blocks * statistics.f_frsize;
+        info.free = statistics.f_bfree * statistics.f_frsize;
+        info.available = statistics.f_bavail * statistics.f_frsize;
+        return info;
     }
 
     /**
-     * Make a directory accessible from the given path.
+     * Which of the protocol extensions that this library uses the server
+     * supports.
      *
-     * @returns `true` if a new directory was created at `new_directory`
-     *          `false` if a directory already existed on that path.
+     * The server's list of extensions is not available through libssh2,
+     * so each extension that has not already been used on this channel is
+     * tried with a request that changes nothing, costing a round trip.
+     * The answers are remembered for the life of the channel, so only the
+     * first query costs anything.
      *
-     * This function mirrors Boost.Filesystem `create_directory` except that
-     * directories are created with 0755 permissions instead of 0777.  0755 is
-     * more secure and the recommended permissions for directories on web server
-     * so seems more appropriate.  It's not clear why Boost.Filesystem chooses
-     * 0777 instead.
+     * @throws `boost::system::system_error` if the connection fails or the
+     *         deadline passes.
      */
-    bool create_directory(const boost::filesystem::path& new_directory)
+    server_capabilities capabilities(
+        const ::ssh::deadline& limit=::ssh::deadline())
     {
-        std::string new_directory_string = new_directory.string();
+        server_capabilities capabilities;
+        capabilities.posix_rename = extension_supported(
+            "posix-rename@openssh.com", &sftp_filesystem::probe_posix_rename,
+            "libssh2_sftp_posix_rename_ex", limit);
+        capabilities.statvfs = extension_supported(
+            "statvfs@openssh.com", &sftp_filesystem::probe_statvfs,
+            "libssh2_sftp_statvfs", limit);
+        capabilities.fsync = extension_supported(
+            "fsync@openssh.com", &sftp_filesystem::probe_fsync,
+            "libssh2_sftp_fsync", limit);
+        return capabilities;
+    }
 
-        try
+    /**
+     * Space used below `root`, directory by directory, largest first.
+     *
+     * Like `du --apparent-size`, each directory's totals include everything
+     * below it, so the root comes first.  The tree is listed over several
+     * channels at once and the totals are taken from the attributes that
+     * come with each listing, so nothing is statted and only directories
+     * are kept in memory while walking.
+     *
+     * @throws `boost::system::system_error` if `root` cannot be listed or
+     *         the deadline passes.  Directories below the root that cannot
+     *         be listed are marked incomplete, as are those above them.
+     */
+    std::vector<directory_usage> disk_usage(
+        const boost::filesystem::path& root,
+        const disk_usage_options& options=disk_usage_options(),
+        const ::ssh::deadline& limit=::ssh::deadline())
+    {
+        ::ssh::detail::usage_state state(root.string());
+
+        ::ssh::detail::sftp_pipeline pipeline(
+            sftp_ref().session_ref(), options.width());
+        pipeline.run(state, limit);
+
+        if (state.root_error())
         {
-            ::ssh::detail::sftp_channel_state::scoped_lock lock =
-                sftp_ref().aquire_lock();
+            std::string root_string = root.string();
+            SSH_DETAIL_THROW_API_ERROR_CODE_WITH_PATH(
+                state.root_error(), state.root_error().message(),
+                state.root_error_api(), root_string.data(),
+                root_string.size());
+        }
 
-            ::ssh::detail::libssh2::sftp::mkdir_ex(
-                sftp_ref().session_ptr(), sftp_ref().sftp_ptr(),
-                new_directory_string.data(),
-                new_directory_string.size(),
-                LIBSSH2_SFTP_S_IRWXU |
-                LIBSSH2_SFTP_S_IRGRP | LIBSSH2_SFTP_S_IXGRP |
-                LIBSSH2_SFTP_S_IROTH | LIBSSH2_SFTP_S_IXOTH);
+        state.total();
 
-            return true;
+        const std::vector< ::ssh::detail::usage_node>& nodes = state.nodes();
+
+        std::vector<std::pair<boost::uintmax_t, std::size_t> > order;
+        order.reserve(nodes.size());
+        for (std::size_t i = 0; i < nodes.size(); ++i)
+        {
+            // Complemented so the largest sort first, ties in walk order
+            order.push_back(std::make_pair(~nodes[i].bytes, i));
         }
-        catch (const boost::system::system_error&)
+
+        std::size_t count = (options.top() == 0U) ?
+            order.size() : (std::min)(options.top(), order.size());
+        std::partial_sort(order.begin(), order.begin() + count, order.end());
+
+        std::vector<directory_usage> usage(count);
+        for (std::size_t i = 0; i < count; ++i)
         {
-            // Might just be because it already exists.  Let's check that and if
-            // ignore if that's the case.
-            // Doing this test after avoids an extra trip to the server in the
-            // common case.
+            const ::ssh::detail::usage_node& node = nodes[order[i].second];
 
-            // We don't test the exception's error code because OpenSSH just
-            // returns FX_FAILURE which could have many causes.  The only way
-            // to be sure the directory is already there is to check explicitly.
+            usage[i].path = state.path_of(order[i].second);
+            usage[i].bytes = node.bytes;
+            usage[i].files = node.files;
+            usage[i].directories = node.directories;
+            usage[i].complete = node.complete;
+        }
 
-            switch (detail::check_status(*this, new_directory))
-            {
-            case detail::path_status::non_directory:
-            case detail::path_status::non_existent:
-                throw;
+        return usage;
+    }
 
-            case detail::path_status::directory:
-                return false;
+    /**
+     * Forget any cached attributes of `path` and of everything below it,
+     * and that they were known to be directories.
+     *
+     * Only needed after changing the remote filesystem by some means other
+     * than this object.
+     */
+    void forget_attributes(const boost::filesystem::path& path)
+    {
+        if (m_attribute_cache)
+        {
+            m_attribute_cache->forget(path.generic_string());
+        }
 
-            default:
-                assert(false);
-                BOOST_THROW_EXCEPTION(std::logic_error("Unknown path status"));
-                return false;
-            }
+        if (m_known_directories)
+        {
+            m_known_directories->forget(path.string());
+        }
+    }
+
+    /**
+     * Forget every remembered result of `canonical_path` and
+     * `resolve_link_target`.
+     *
+     * Only needed after creating, renaming or removing links, or anything
+     * above them, by some means other than this object.
+     */
+    void forget_resolved_paths()
+    {
+        if (m_resolution_cache)
+        {
+            m_resolution_cache->clear();
         }
     }
 
+    /**
+     * Bytes the server may currently send on this channel before it must
+     * wait for the window to be adjusted.
+     *
+     * @see sftp_options
+     */
+    unsigned long receive_window()
+    {
+        return sftp_ref().receive_window();
+    }
+
+    /**
+     * Round-trip time to the server, if it was measured to tune the window
+     * when the channel opened.
+     */
+    boost::optional<boost::posix_time::time_duration> round_trip() const
+    {
+        return m_sftp->round_trip();
+    }
+
     /// @cond INTERNAL
     /**
      * Defines the single permitted factory of `sftp_filesystem` instances.
@@ -827,9 +2786,11 @@ public:
     private:
         friend class ssh::session;
 
-        sftp_filesystem operator()(::ssh::detail::session_state& session_state)
+        sftp_filesystem operator()(
+            ::ssh::detail::session_state& session_state,
+            const sftp_options& options)
         {
-            return sftp_filesystem(session_state);
+            return sftp_filesystem(session_state, options);
         }
     };
     /// @endcond
@@ -838,61 +2799,328 @@ private:
 
     friend class factory_attorney;
 
-    explicit sftp_filesystem(::ssh::detail::session_state& session_state)
-        : m_sftp(new ::ssh::detail::sftp_channel_state(session_state))
-    {}
+    sftp_filesystem(
+        ::ssh::detail::session_state& session_state,
+        const sftp_options& options)
+        :
+    m_sftp(new ::ssh::detail::sftp_channel_state(session_state, options)),
+    m_stat_width(options.stat_width()),
+    m_stat_channels(
+        boost::make_shared<::ssh::detail::channel_pool>(options.stat_width()))
+    {
+        if (options.attribute_lifetime())
+        {
+            m_attribute_cache = boost::make_shared<
+                ::ssh::detail::attribute_cache>(
+                    *options.attribute_lifetime(),
+                    options.attribute_cache_size());
+            m_known_directories = boost::make_shared<
+                ::ssh::detail::known_directories>(
+                    *options.attribute_lifetime(),
+                    options.attribute_cache_size());
+        }
+
+        if (options.resolution_lifetime())
+        {
+            m_resolution_cache = boost::make_shared<
+                ::ssh::detail::resolution_cache>(
+                    *options.resolution_lifetime(),
+                    options.resolution_cache_size());
+        }
+    }
 
     friend class sftp_input_device;
     friend class sftp_output_device;
     friend class sftp_io_device;
+    friend class recursive_directory_walker;
+    friend class tree_remover;
+    friend class tree_mirror;
+    friend class sync_batch;
+
+    bool remove_one_file(
+        const boost::filesystem::path& file,
+        const ::ssh::deadline& limit=::ssh::deadline())
+    {
+        return do_remove(file, false, limit);
+    }
+
+    bool remove_empty_directory(
+        const boost::filesystem::path& file,
+        const ::ssh::deadline& limit=::ssh::deadline())
+    {
+        return do_remove(file, true, limit);
+    }
+
+    boost::uintmax_t remove_directory(
+        const boost::filesystem::path& root, const ::ssh::deadline& limit);
+
+    /**
+     * Rename with the `posix-rename@openssh.com` extension, unless the
+     * server is already known not to support it.
+     *
+     * Only call with the channel locked.
+     *
+     * @returns false if the server does not support the extension.
+     */
+    bool posix_rename(
+        const std::string& source, const std::string& destination)
+    {
+        const char* extension = "posix-rename@openssh.com";
+        if (sftp_ref().extension_refused(extension))
+        {
+            return false;
+        }
+
+        boost::system::error_code ec;
+        std::string message;
+        ::ssh::detail::libssh2::sftp::posix_rename(
+            sftp_ref().session_ptr(), sftp_ref().sftp_ptr(),
+            source.data(), source.size(), destination.data(),
+            destination.size(), ec, message);
+
+        if (ec == boost::system::errc::operation_not_supported)
+        {
+            sftp_ref().record_extension(extension, false);
+            return false;
+        }
+        else if (ec)
+        {
+            SSH_DETAIL_THROW_API_ERROR_CODE_WITH_PATH(
+                ec, message, "libssh2_sftp_posix_rename_ex", source.data(),
+                source.size());
+        }
+
+        sftp_ref().record_extension(extension, true);
+        return true;
+    }
+
+    typedef boost::system::error_code (sftp_filesystem::*extension_probe)(
+        const ::ssh::deadline&);
+
+    /**
+     * Whether the server supports a protocol extension, probing for it if
+     * that is not yet known.
+     *
+     * Each probe sends a request that the server can only answer with
+     * `SSH_FX_OP_UNSUPPORTED` if it does not know the extension.  Every
+     * probe targets the home directory, `.`, through `api_function`.
+     */
+    bool extension_supported(
+        const char* extension, extension_probe probe,
+        const char* api_function, const ::ssh::deadline& limit)
+    {
+        {
+            ::ssh::detail::sftp_channel_state::scoped_lock lock =
+                sftp_ref().aquire_lock();
+
+            boost::optional<bool> known =
+                sftp_ref().extension_supported(extension);
+            if (known)
+            {
+                return *known;
+            }
+        }
+
+        boost::system::error_code ec = (this->*probe)(limit);
+        if (ec && ec.category() != sftp_error_category())
+        {
+            // Failed to reach the server at all, so learnt nothing
+            SSH_DETAIL_THROW_API_ERROR_CODE_WITH_PATH(
+                ec, ec.message(), api_function, ".", 1);
+        }
+
+        bool supported = (ec != boost::system::errc::operation_not_supported);
+
+        ::ssh::detail::sftp_channel_state::scoped_lock lock =
+            sftp_ref().aquire_lock();
+        sftp_ref().record_extension(extension, supported);
+        return supported;
+    }
+
+    /**
+     * Rename the home directory to itself, which changes nothing whether
+     * or not the server allows it.
+     */
+    boost::system::error_code probe_posix_rename(const ::ssh::deadline& limit)
+    {
+        limit.check();
+
+        boost::system::error_code ec;
+
+        ::ssh::detail::sftp_channel_state::scoped_lock lock =
+            sftp_ref().aquire_lock();
+
+        ::ssh::detail::deadline_slice slice(sftp_ref().session_ptr(), limit);
+
+        do
+        {
+            ec.clear();
+            ::ssh::detail::libssh2::sftp::posix_rename(
+                sftp_ref().session_ptr(), sftp_ref().sftp_ptr(), ".", 1, ".",
+                1, ec);
+        }
+        while (ec &&
+            ::ssh::detail::resume_after_wait_slice(
+                ec, sftp_ref().session_ref(), limit));
+
+        return ec;
+    }
+
+    boost::system::error_code probe_statvfs(const ::ssh::deadline& limit)
+    {
+        limit.check();
 
-    bool remove_one_file(const boost::filesystem::path& file)
+        boost::system::error_code ec;
+        LIBSSH2_SFTP_STATVFS statistics = LIBSSH2_SFTP_STATVFS();
+
+        ::ssh::detail::sftp_channel_state::scoped_lock lock =
+            sftp_ref().aquire_lock();
+
+        ::ssh::detail::deadline_slice slice(sftp_ref().session_ptr(), limit);
+
+        do
+        {
+            ec.clear();
+            ::ssh::detail::libssh2::sftp::statvfs(
+                sftp_ref().session_ptr(), sftp_ref().sftp_ptr(), ".", 1,
+                &statistics, ec);
+        }
+        while (ec &&
+            ::ssh::detail::resume_after_wait_slice(
+                ec, sftp_ref().session_ref(), limit));
+
+        return ec;
+    }
+
+    /**
+     * Sync a handle to the home directory.
+     *
+     * OpenSSH refuses to sync directory handles, but as a missing handle
+     * rather than an unknown request.
+     */
+    boost::system::error_code probe_fsync(const ::ssh::deadline& limit)
     {
-        return do_remove(file, false);
+        limit.check();
+
+        boost::shared_ptr< ::ssh::detail::file_handle_state> directory =
+            detail::open_directory(sftp_ref(), ".");
+
+        boost::system::error_code ec;
+
+        ::ssh::detail::file_handle_state::scoped_lock lock =
+            directory->aquire_lock();
+
+        ::ssh::detail::deadline_slice slice(directory->session_ptr(), limit);
+
+        do
+        {
+            ec.clear();
+            ::ssh::detail::libssh2::sftp::fsync(
+                directory->session_ptr(), directory->sftp_ptr(),
+                directory->file_handle(), ec);
+        }
+        while (ec &&
+            ::ssh::detail::resume_after_wait_slice(
+                ec, sftp_ref().session_ref(), limit));
+
+        return ec;
     }
 
-    bool remove_empty_directory(const boost::filesystem::path& file)
+    static void fill_page(
+        directory_page& page, const std::vector<detail::page_key>& keys)
     {
-        return do_remove(file, true);
+        page.m_entries.resize(keys.size());
+        for (std::size_t i = 0; i < keys.size(); ++i)
+        {
+            page.m_entries[i].m_name = keys[i].name;
+            page.m_entries[i].m_attributes = keys[i].attributes;
+        }
     }
 
-    boost::uintmax_t remove_directory(const boost::filesystem::path& root);
+    void make_directory(
+        const std::string& directory, boost::system::error_code& ec,
+        std::string& message, const ::ssh::deadline& limit)
+    {
+        limit.check();
+
+        ::ssh::detail::sftp_channel_state::scoped_lock lock =
+            sftp_ref().aquire_lock();
+
+        ::ssh::detail::deadline_slice slice(sftp_ref().session_ptr(), limit);
+
+        do
+        {
+            ec.clear();
+
+            ::ssh::detail::libssh2::sftp::mkdir_ex(
+                sftp_ref().session_ptr(), sftp_ref().sftp_ptr(),
+                directory.data(), directory.size(),
+                LIBSSH2_SFTP_S_IRWXU |
+                LIBSSH2_SFTP_S_IRGRP | LIBSSH2_SFTP_S_IXGRP |
+                LIBSSH2_SFTP_S_IROTH | LIBSSH2_SFTP_S_IXOTH,
+                ec, message);
+        }
+        while (ec &&
+            ::ssh::detail::resume_after_wait_slice(
+                ec, sftp_ref().session_ref(), limit));
+    }
 
     bool do_remove(
-        const boost::filesystem::path& target, bool is_directory)
+        const boost::filesystem::path& target, bool is_directory,
+        const ::ssh::deadline& limit)
     {
         std::string target_string = target.string();
 
-        try
+        limit.check();
+
+        boost::system::error_code ec;
+        std::string message;
         {
             ::ssh::detail::sftp_channel_state::scoped_lock lock =
                 sftp_ref().aquire_lock();
 
-            if (is_directory)
-            {
-                ::ssh::detail::libssh2::sftp::rmdir_ex(
-                    sftp_ref().session_ptr(), sftp_ref().sftp_ptr(),
-                    target_string.data(), target_string.size());
-            }
-            else
+            ::ssh::detail::deadline_slice slice(
+                sftp_ref().session_ptr(), limit);
+
+            do
             {
-                ::ssh::detail::libssh2::sftp::unlink_ex(
-                    sftp_ref().session_ptr(), sftp_ref().sftp_ptr(),
-                    target_string.data(), target_string.size());
+                ec.clear();
+
+                if (is_directory)
+                {
+                    ::ssh::detail::libssh2::sftp::rmdir_ex(
+                        sftp_ref().session_ptr(), sftp_ref().sftp_ptr(),
+                        target_string.data(), target_string.size(), ec,
+                        message);
+                }
+                else
+                {
+                    ::ssh::detail::libssh2::sftp::unlink_ex(
+                        sftp_ref().session_ptr(), sftp_ref().sftp_ptr(),
+                        target_string.data(), target_string.size(), ec,
+                        message);
+                }
             }
+            while (ec &&
+                ::ssh::detail::resume_after_wait_slice(
+                    ec, sftp_ref().session_ref(), limit));
         }
-        catch (const boost::system::system_error& e)
+
+        forget_attributes(target);
+        forget_resolved_paths();
+
+        if (ec == boost::system::errc::no_such_file_or_directory)
         {
-            if (e.code() == boost::system::errc::no_such_file_or_directory)
-            {
-                // Mirror the Boost.Filesystem API which doesn't treat this
-                // as an error.
-                return false;
-            }
-            else
-            {
-                throw;
-            }
+            // Mirror the Boost.Filesystem API which doesn't treat this
+            // as an error.
+            return false;
+        }
+        else if (ec)
+        {
+            SSH_DETAIL_THROW_API_ERROR_CODE_WITH_PATH(
+                ec, message,
+                (is_directory) ? "libssh2_sftp_rmdir_ex" : "libssh2_sftp_unlink_ex",
+                target_string.data(), target_string.size());
         }
 
         return true;
@@ -904,22 +3132,63 @@ private:
     boost::filesystem::path symlink_resolve(
         const char* path, unsigned int path_len, int resolve_action)
     {
-        // yuk! hardcoded buffer sizes. unfortunately, libssh2 doesn't
-        // give us a choice so we allocate massive buffers here and then
-        // take measures later to reduce the footprint
-
-        std::vector<char> target_path_buffer(1024, '\0');
+        std::string resolved;
+        if (m_resolution_cache &&
+            m_resolution_cache->find(
+                std::string(path, path_len), resolve_action, resolved))
+        {
+            return resolved;
+        }
 
         ::ssh::detail::sftp_channel_state::scoped_lock lock =
             sftp_ref().aquire_lock();
 
-        int len = ::ssh::detail::libssh2::sftp::symlink_ex(
-            sftp_ref().session_ptr(), sftp_ref().sftp_ptr(), path, path_len,
-            &target_path_buffer[0], target_path_buffer.size(),
-            resolve_action);
+        // libssh2 doesn't tell us how long the target is so we resolve
+        // into the channel's scratch buffer, growing it until the target
+        // fits
+        for (;;)
+        {
+            std::vector<char>& buffer = sftp_ref().path_buffer();
+
+            boost::system::error_code ec;
+            std::string message;
 
-        return boost::filesystem::path(
-            &target_path_buffer[0], &target_path_buffer[0] + len);
+            int len = ::ssh::detail::libssh2::sftp::symlink_ex(
+                sftp_ref().session_ptr(), sftp_ref().sftp_ptr(), path,
+                path_len, &buffer[0], static_cast<unsigned int>(buffer.size()),
+                resolve_action, ec, message);
+
+            if (len == LIBSSH2_ERROR_BUFFER_TOO_SMALL)
+            {
+                if (sftp_ref().grow_path_buffer())
+                {
+                    continue;
+                }
+
+                // libssh2 does not necessarily record this error itself
+                ec = boost::system::error_code(
+                    LIBSSH2_ERROR_BUFFER_TOO_SMALL,
+                    ::ssh::ssh_error_category());
+            }
+
+            if (ec)
+            {
+                SSH_DETAIL_THROW_API_ERROR_CODE_WITH_PATH(
+                    ec, message, "libssh2_sftp_symlink_ex", path, path_len);
+            }
+
+            // Remembered while still locked so that a change made
+            // through this object cannot be forgotten before it is
+            // remembered
+            if (m_resolution_cache)
+            {
+                m_resolution_cache->insert(
+                    std::string(path, path_len), resolve_action,
+                    std::string(&buffer[0], &buffer[0] + len));
+            }
+
+            return boost::filesystem::path(&buffer[0], &buffer[0] + len);
+        }
     }
 
     ::ssh::detail::sftp_channel_state& sftp_ref()
@@ -927,6 +3196,14 @@ private:
         return *m_sftp;
     }
 
+    void remember_directory(const std::string& directory)
+    {
+        if (m_known_directories)
+        {
+            m_known_directories->insert(directory);
+        }
+    }
+
     // Using an auto_ptr (eventually unique_ptr) so that the other objects
     // that reference this state continue to reference a valid object even if
     // this sftp_filesystem object is moved.  The moved filesystem will only
@@ -938,6 +3215,21 @@ private:
     // file streams.
     // See http://stackoverflow.com/a/20493410/67013.
     std::auto_ptr<::ssh::detail::sftp_channel_state> m_sftp;
+
+    /// Null unless the options asked for attributes to be cached.  Shared
+    /// with the directory iterators, which fill it in.
+    boost::shared_ptr<::ssh::detail::attribute_cache> m_attribute_cache;
+
+    /// Directories `create_directories` need not create or check again.
+    boost::shared_ptr<::ssh::detail::known_directories> m_known_directories;
+
+    /// Null unless the options asked for path resolutions to be cached.
+    boost::shared_ptr<::ssh::detail::resolution_cache> m_resolution_cache;
+
+    std::size_t m_stat_width;
+
+    /// Kept open between batches of stats.
+    boost::shared_ptr<::ssh::detail::channel_pool> m_stat_channels;
 };
 
 // Only needed for C++03 support with Boost move-emulation because C++11
@@ -952,11 +3244,12 @@ inline void swap(sftp_filesystem& lhs, sftp_filesystem& rhs)
 namespace detail {
 
     inline BOOST_SCOPED_ENUM(path_status) check_status(
-        sftp_filesystem& filesystem, const boost::filesystem::path& path)
+        sftp_filesystem& filesystem, const boost::filesystem::path& path,
+        const ::ssh::deadline& limit)
     {
         try
         {
-            file_attributes attrs = filesystem.attributes(path, false);
+            file_attributes attrs = filesystem.attributes(path, false, limit);
 
             if (attrs.type() == file_attributes::directory)
             {
@@ -1027,11 +3320,12 @@ inline boost::filesystem::path canonical_path(
 
 // Needs directory_iterator implementation so outside sftp_filesystem class body
 inline boost::uintmax_t sftp_filesystem::remove_directory(
-    const boost::filesystem::path& root)
+    const boost::filesystem::path& root, const ::ssh::deadline& limit)
 {
     boost::uintmax_t count = 0U;
 
-    for (ssh::filesystem::directory_iterator directory = directory_iterator(root);
+    for (ssh::filesystem::directory_iterator directory =
+            directory_iterator(root, limit);
         directory != directory_iterator(); ++directory)
     {
         const sftp_file& file = *directory;
@@ -1041,24 +3335,12 @@ inline boost::uintmax_t sftp_filesystem::remove_directory(
             continue;
         }
 
-        if (file.attributes().type() == file_attributes::directory)
-        {
-            count += remove_directory(file.path());
-        }
-        else
-        {
-            if (remove_one_file(file.path()))
-            {
-                ++count;
-            }
-            else
-            {
-                // Something else deleted the file before we could
-            }
-        }
+        // The listing already says what type each entry is so removing it
+        // needs no stat, unless the server left the type out
+        count += remove_all(file, limit);
     }
 
-    if (remove_empty_directory(root))
+    if (remove_empty_directory(root, limit))
     {
         ++count;
     }
@@ -0,0 +1,314 @@
+/**
+    @file
+
+    Keeping idle SSH sessions alive and detecting dead connections.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the 
+    OpenSSL project's "OpenSSL" library (or with modified versions of it, 
+    with unchanged license). You may copy and distribute such a system 
+    following the terms of the GNU GPL for this program and the licenses 
+    of the other code concerned. The GNU General Public License gives 
+    permission to release a modified version without this exception; this 
+    exception also makes it possible to release a modified version which 
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_KEEPALIVE_HPP
+#define SSH_KEEPALIVE_HPP
+
+#include <ssh/detail/libssh2/session.hpp> // keepalive_send
+#include <ssh/detail/session_state.hpp>
+#include <ssh/detail/socket.hpp> // wait_for_socket, set_unacknowledged_timeout
+
+#include <boost/date_time/posix_time/posix_time_types.hpp> // time_duration
+#include <boost/foreach.hpp> // BOOST_FOREACH
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/thread_time.hpp> // get_system_time
+#include <boost/throw_exception.hpp> // BOOST_THROW_EXCEPTION
+#include <boost/weak_ptr.hpp>
+
+#include <stdexcept> // invalid_argument
+#include <vector>
+
+#include <libssh2.h>
+
+namespace ssh {
+
+/**
+ * Keeps idle sessions connected and detects connections that have died.
+ *
+ * A single background thread periodically sends an SSH keepalive message
+ * over every session added to the service.  The traffic stops NAT devices
+ * and firewalls from silently dropping idle connections.
+ *
+ * If a keepalive cannot be sent within the `dead_after` period, or the
+ * connection reports an error, the session is marked dead and its socket is
+ * shut down.  The session's next operation then fails immediately rather
+ * than blocking until TCP gives up on the connection.  Where the OS supports
+ * it, the socket is also told to abort if sent data goes unacknowledged for
+ * longer than `dead_after`, which catches peers that vanish without a trace.
+ *
+ * Sessions that are busy with another operation when their keepalive is due
+ * are skipped; their own traffic keeps the connection open.
+ *
+ * The service and the sessions added to it may be destroyed in any order.
+ */
+class keepalive_service : private boost::noncopyable
+{
+public:
+
+    /**
+     * Start the keepalive thread.
+     *
+     * @param interval
+     *     Time between keepalive messages on each session.
+     * @param dead_after
+     *     How long a keepalive may wait to be sent, or sent data wait to be
+     *     acknowledged, before the connection is declared dead.
+     */
+    explicit keepalive_service(
+        boost::posix_time::time_duration interval=
+            boost::posix_time::seconds(30),
+        boost::posix_time::time_duration dead_after=
+            boost::posix_time::seconds(60))
+        :
+    m_interval(checked_duration(interval)),
+    m_dead_after(checked_duration(dead_after)),
+    m_stopping(false),
+    m_rounds(0),
+    m_thread(&keepalive_service::run, this)
+    {}
+
+    ~keepalive_service()
+    {
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_stopping = true;
+        }
+
+        m_wake.notify_all();
+        m_thread.join();
+    }
+
+    /**
+     * Number of times the service has finished pinging its sessions.
+     *
+     * A round that starts after a session is added sends that session a
+     * keepalive unless it is busy, so waiting for the count to go up by two
+     * waits for at least one keepalive to have been attempted.
+     */
+    unsigned long rounds() const
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        return m_rounds;
+    }
+
+    /// @cond INTERNAL
+    // Called via session::enable_keepalive
+    void add(detail::session_state& session)
+    {
+        {
+            detail::session_state::scoped_lock lock = session.aquire_lock();
+
+            // libssh2 only sends a keepalive if its own interval has elapsed
+            // since the last one.  We decide when to send, so we set its
+            // interval to the minimum possible (libssh2 treats 1 as 2
+            // seconds) and never want a reply because nothing would read it
+            // until the session is next used.
+            ::libssh2_keepalive_config(session.session_ptr(), 0, 1);
+        }
+
+        if (session.socket() != -1)
+        {
+            detail::set_unacknowledged_timeout(
+                session.socket(),
+                static_cast<unsigned int>(m_dead_after.total_milliseconds()));
+        }
+
+        boost::mutex::scoped_lock lock(m_mutex);
+        m_sessions.push_back(session.link());
+    }
+
+    void remove(detail::session_state& session)
+    {
+        boost::shared_ptr<detail::session_link> link = session.link();
+
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        std::vector<boost::weak_ptr<detail::session_link> >::iterator it =
+            m_sessions.begin();
+        while (it != m_sessions.end())
+        {
+            if (it->lock() == link)
+            {
+                it = m_sessions.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+    /// @endcond
+
+private:
+
+    static boost::posix_time::time_duration checked_duration(
+        boost::posix_time::time_duration duration)
+    {
+        if (duration.is_negative() || duration.total_seconds() < 1)
+        {
+            BOOST_THROW_EXCEPTION(
+                std::invalid_argument(
+                    "Keepalive durations must be at least one second"));
+        }
+
+        return duration;
+    }
+
+    void run()
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        while (!m_stopping)
+        {
+            boost::system_time next_round =
+                boost::get_system_time() + m_interval;
+
+            std::vector<boost::shared_ptr<detail::session_link> > links =
+                live_links();
+
+            // Unlocked while pinging so that adding and removing sessions
+            // doesn't have to wait for a slow connection
+            lock.unlock();
+
+            BOOST_FOREACH(boost::shared_ptr<detail::session_link>& link, links)
+            {
+                ping(*link);
+            }
+
+            lock.lock();
+            ++m_rounds;
+
+            while (!m_stopping && boost::get_system_time() < next_round)
+            {
+                m_wake.timed_wait(lock, next_round);
+            }
+        }
+    }
+
+    /**
+     * Drop links to sessions that no longer exist and return the rest.
+     *
+     * Must be called with the service locked.
+     */
+    std::vector<boost::shared_ptr<detail::session_link> > live_links()
+    {
+        std::vector<boost::shared_ptr<detail::session_link> > links;
+
+        std::vector<boost::weak_ptr<detail::session_link> >::iterator it =
+            m_sessions.begin();
+        while (it != m_sessions.end())
+        {
+            boost::shared_ptr<detail::session_link> link = it->lock();
+            if (link)
+            {
+                links.push_back(link);
+                ++it;
+            }
+            else
+            {
+                it = m_sessions.erase(it);
+            }
+        }
+
+        return links;
+    }
+
+    void ping(detail::session_link& link)
+    {
+        detail::session_link::scoped_lock link_lock = link.aquire_lock();
+
+        detail::session_state* session = link.session();
+        if (session == NULL || session->dead())
+        {
+            return;
+        }
+
+        detail::session_state::scoped_try_lock lock =
+            session->try_aquire_lock();
+        if (!lock.owns_lock())
+        {
+            return;
+        }
+
+        // libssh2 silently leaves a keepalive half-sent if the socket can't
+        // take all of it.  The next packet sent by the session would then be
+        // lost, so we only send once the socket is writable, at which point
+        // it has room for far more than a keepalive message.  A socket that
+        // can't accept data for that long belongs to a dead connection.
+
+        if (session->socket() != -1 &&
+            !detail::wait_for_socket(
+                session->socket(), LIBSSH2_SESSION_BLOCK_OUTBOUND,
+                m_dead_after))
+        {
+            session->mark_dead();
+            return;
+        }
+
+        boost::system::error_code ec;
+        int seconds_to_next = 0;
+        detail::libssh2::session::keepalive_send(
+            session->session_ptr(), &seconds_to_next, ec);
+
+        if (ec ||
+            (::libssh2_session_block_directions(session->session_ptr()) &
+             LIBSSH2_SESSION_BLOCK_OUTBOUND))
+        {
+            session->mark_dead();
+        }
+    }
+
+    const boost::posix_time::time_duration m_interval;
+    const boost::posix_time::time_duration m_dead_after;
+
+    mutable boost::mutex m_mutex;
+    boost::condition_variable m_wake;
+    bool m_stopping;
+    unsigned long m_rounds;
+    std::vector<boost::weak_ptr<detail::session_link> > m_sessions;
+
+    // Last so that everything the thread uses is initialised before it starts
+    boost::thread m_thread;
+};
+
+} // namespace ssh
+
+#endif
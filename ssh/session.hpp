@@ -42,9 +42,12 @@
 #include <ssh/detail/libssh2/userauth.hpp> // ssh::detail::libssh2::userauth
 #include <ssh/host_key.hpp>
 #include <ssh/filesystem.hpp> // sftp_filesystem
+#include <ssh/keepalive.hpp> // keepalive_service
+#include <ssh/session_options.hpp> // session_options, negotiated_methods
 
 #include <boost/algorithm/string/classification.hpp> // is_any_of
 #include <boost/algorithm/string/split.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp> // time_duration
 #include <boost/exception_ptr.hpp>
 #include <boost/filesystem/path.hpp> // path, used for key paths
 #include <boost/make_shared.hpp>
@@ -368,6 +371,27 @@ public:
     m_session(new detail::session_state(socket, disconnection_message))
     {}
 
+    /**
+     * Start a new SSH session with a host, offering it methods chosen by
+     * the given options.
+     *
+     * @param socket
+     *     The socket through which to communicate with the listening server.
+     * @param options
+     *     Method preferences to negotiate with.  @see session_options.
+     * @param disconnection_message
+     *     An optional message sent to the server when the session is
+     *     destroyed.
+     */
+    session(
+        int socket, const session_options& options,
+        const std::string& disconnection_message=
+            "libssh2 C++ bindings session destructor") :
+    m_session(
+        new detail::session_state(
+            socket, disconnection_message, options.method_preferences()))
+    {}
+
     /**
      * Move constructor.
      */
@@ -392,6 +416,14 @@ public:
         return ssh::host_key(session_ref());
     }
 
+    /**
+     * Algorithms agreed with the server for this session.
+     */
+    ssh::negotiated_methods negotiated_methods()
+    {
+        return ssh::negotiated_methods(session_ref());
+    }
+
     /**
      * Names of the methods the server claims are available for
      * authentication.
@@ -445,6 +477,66 @@ public:
     }
 
 
+    /**
+     * Has the connection been found dead?
+     *
+     * Only sessions added to a `keepalive_service` are checked in the
+     * background.  Once dead, every operation on the session fails
+     * immediately.
+     */
+    bool alive()
+    {
+        return !session_ref().dead();
+    }
+
+    /**
+     * Keep this session's connection open while idle, and watch for it dying,
+     * using the given service.
+     *
+     * The service and the session may be destroyed in either order.
+     */
+    void enable_keepalive(keepalive_service& service)
+    {
+        service.add(session_ref());
+    }
+
+    /**
+     * Stop sending keepalives over this session.
+     */
+    void disable_keepalive(keepalive_service& service)
+    {
+        service.remove(session_ref());
+    }
+
+    /**
+     * Limit how long any blocking operation on this session waits for the
+     * server.
+     *
+     * An operation that runs out of time fails with a `timed_out` error.
+     * Because it may have been abandoned mid-request, the session should not
+     * be used for anything else afterwards.  For a limit on individual
+     * operations that leaves the session usable where possible, pass them a
+     * `deadline` instead.
+     *
+     * A zero duration, the default, waits forever.
+     */
+    void set_timeout(boost::posix_time::time_duration timeout)
+    {
+        detail::session_state::scoped_lock lock = session_ref().aquire_lock();
+
+        ::libssh2_session_set_timeout(
+            session_ref().session_ptr(),
+            static_cast<long>(timeout.total_milliseconds()));
+    }
+
+    boost::posix_time::time_duration timeout()
+    {
+        detail::session_state::scoped_lock lock = session_ref().aquire_lock();
+
+        return boost::posix_time::milliseconds(
+            ::libssh2_session_get_timeout(session_ref().session_ptr()));
+    }
+
     bool authenticated()
     {
         detail::session_state::scoped_lock lock = session_ref().aquire_lock();
@@ -622,10 +714,15 @@ public:
      *          In other words, that the last moved-to destination of the
      *          session outlives the last moved-to destination of the
      *          filesystem.  If neither is moved, this is naturally the case.
+     *
+     * @param options
+     *     Window tuning for the channel.  @see filesystem::sftp_options.
      */
-    filesystem::sftp_filesystem connect_to_filesystem()
+    filesystem::sftp_filesystem connect_to_filesystem(
+        const filesystem::sftp_options& options=filesystem::sftp_options())
     {
-        return filesystem::sftp_filesystem::factory_attorney()(session_ref());
+        return filesystem::sftp_filesystem::factory_attorney()(
+            session_ref(), options);
     }
 
 private:
@@ -0,0 +1,211 @@
+/**
+    @file
+
+    Choosing and reporting the algorithms an SSH session negotiates.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the 
+    OpenSSL project's "OpenSSL" library (or with modified versions of it, 
+    with unchanged license). You may copy and distribute such a system 
+    following the terms of the GNU GPL for this program and the licenses 
+    of the other code concerned. The GNU General Public License gives 
+    permission to release a modified version without this exception; this 
+    exception also makes it possible to release a modified version which 
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_SESSION_OPTIONS_HPP
+#define SSH_SESSION_OPTIONS_HPP
+
+#include <ssh/detail/session_state.hpp>
+#include <ssh/host_key.hpp> // detail::method
+
+#include <map>
+#include <string>
+
+#include <libssh2.h> // LIBSSH2_METHOD_*
+
+namespace ssh {
+
+/**
+ * Settings applied to a session before it starts negotiating with the server.
+ *
+ * Each preference is a comma-separated list of method names, most preferred
+ * first, that replaces libssh2's default list for that kind of method.
+ * Names libssh2 does not support are dropped; if none are left, creating the
+ * session fails.  Unset preferences keep libssh2's defaults.
+ */
+class session_options
+{
+public:
+
+    /**
+     * Preferences for bulk transfer where encryption, rather than the
+     * network, limits the rate.
+     *
+     * Favours AES in GCM and CTR modes, which use the CPU's AES
+     * instructions where available, and the cheapest strong MACs.
+     * Compression is disabled as it costs more CPU than it saves on a fast
+     * link.  Key exchange and host-key methods are left at their defaults
+     * as they only affect connection setup.
+     */
+    static session_options throughput()
+    {
+        session_options options;
+        options.prefer_ciphers(
+            "aes128-gcm@openssh.com,aes256-gcm@openssh.com,"
+            "aes128-ctr,aes192-ctr,aes256-ctr");
+        options.prefer_macs("hmac-sha2-256,hmac-sha1,hmac-sha2-512");
+        options.prefer_compression("none");
+        return options;
+    }
+
+    session_options& prefer_kex(const std::string& methods)
+    {
+        m_preferences[LIBSSH2_METHOD_KEX] = methods;
+        return *this;
+    }
+
+    session_options& prefer_hostkey(const std::string& methods)
+    {
+        m_preferences[LIBSSH2_METHOD_HOSTKEY] = methods;
+        return *this;
+    }
+
+    /**
+     * Cipher preference for both directions.
+     */
+    session_options& prefer_ciphers(const std::string& methods)
+    {
+        m_preferences[LIBSSH2_METHOD_CRYPT_CS] = methods;
+        m_preferences[LIBSSH2_METHOD_CRYPT_SC] = methods;
+        return *this;
+    }
+
+    /**
+     * MAC preference for both directions.
+     *
+     * Ignored by the server for ciphers, such as AES-GCM, that authenticate
+     * the data themselves.
+     */
+    session_options& prefer_macs(const std::string& methods)
+    {
+        m_preferences[LIBSSH2_METHOD_MAC_CS] = methods;
+        m_preferences[LIBSSH2_METHOD_MAC_SC] = methods;
+        return *this;
+    }
+
+    /**
+     * Compression preference for both directions.
+     */
+    session_options& prefer_compression(const std::string& methods)
+    {
+        m_preferences[LIBSSH2_METHOD_COMP_CS] = methods;
+        m_preferences[LIBSSH2_METHOD_COMP_SC] = methods;
+        return *this;
+    }
+
+    /// @cond INTERNAL
+    const std::map<int, std::string>& method_preferences() const
+    {
+        return m_preferences;
+    }
+    /// @endcond
+
+private:
+    std::map<int, std::string> m_preferences;
+};
+
+/**
+ * Methods the session and the server agreed on during the handshake.
+ *
+ * Empty strings mean the method is not known, for instance because the
+ * session was never connected.
+ */
+class negotiated_methods
+{
+public:
+    explicit negotiated_methods(detail::session_state& session)
+        :
+    // Copied out of the session for the same reason as host_key does
+    m_kex(detail::method(session, LIBSSH2_METHOD_KEX)),
+    m_hostkey(detail::method(session, LIBSSH2_METHOD_HOSTKEY)),
+    m_cipher_client_to_server(
+        detail::method(session, LIBSSH2_METHOD_CRYPT_CS)),
+    m_cipher_server_to_client(
+        detail::method(session, LIBSSH2_METHOD_CRYPT_SC)),
+    m_mac_client_to_server(detail::method(session, LIBSSH2_METHOD_MAC_CS)),
+    m_mac_server_to_client(detail::method(session, LIBSSH2_METHOD_MAC_SC)),
+    m_compression_client_to_server(
+        detail::method(session, LIBSSH2_METHOD_COMP_CS)),
+    m_compression_server_to_client(
+        detail::method(session, LIBSSH2_METHOD_COMP_SC))
+    {}
+
+    std::string kex() const { return m_kex; }
+    std::string hostkey() const { return m_hostkey; }
+
+    std::string cipher_client_to_server() const
+    {
+        return m_cipher_client_to_server;
+    }
+
+    std::string cipher_server_to_client() const
+    {
+        return m_cipher_server_to_client;
+    }
+
+    std::string mac_client_to_server() const
+    {
+        return m_mac_client_to_server;
+    }
+
+    std::string mac_server_to_client() const
+    {
+        return m_mac_server_to_client;
+    }
+
+    std::string compression_client_to_server() const
+    {
+        return m_compression_client_to_server;
+    }
+
+    std::string compression_server_to_client() const
+    {
+        return m_compression_server_to_client;
+    }
+
+private:
+    std::string m_kex;
+    std::string m_hostkey;
+    std::string m_cipher_client_to_server;
+    std::string m_cipher_server_to_client;
+    std::string m_mac_client_to_server;
+    std::string m_mac_server_to_client;
+    std::string m_compression_client_to_server;
+    std::string m_compression_server_to_client;
+};
+
+} // namespace ssh
+
+#endif
@@ -0,0 +1,203 @@
+/**
+    @file
+
+    Settings for SFTP channels.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the 
+    OpenSSL project's "OpenSSL" library (or with modified versions of it, 
+    with unchanged license). You may copy and distribute such a system 
+    following the terms of the GNU GPL for this program and the licenses 
+    of the other code concerned. The GNU General Public License gives 
+    permission to release a modified version without this exception; this 
+    exception also makes it possible to release a modified version which 
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_SFTP_OPTIONS_HPP
+#define SSH_SFTP_OPTIONS_HPP
+
+#include <boost/cstdint.hpp> // uint64_t
+#include <boost/date_time/posix_time/posix_time_types.hpp> // time_duration
+#include <boost/optional/optional.hpp>
+
+#include <cstddef> // size_t
+
+namespace ssh {
+namespace filesystem {
+
+/**
+ * Settings applied to an SFTP channel when it is opened.
+ *
+ * The receive window limits how much data the server may send before
+ * hearing back from us, so downloads over a link whose bandwidth-delay
+ * product exceeds it stall every round trip however many requests are in
+ * flight.
+ *
+ * By default libssh2's window is kept and no attributes or path
+ * resolutions are cached.
+ */
+class sftp_options
+{
+public:
+
+    sftp_options()
+        :
+    m_attribute_cache_size(0U), m_resolution_cache_size(0U),
+    m_stat_width(4U) {}
+
+    /**
+     * Grow the channel's receive window to at least this many bytes.
+     */
+    sftp_options& set_window_size(unsigned long bytes)
+    {
+        m_window_size = bytes;
+        return *this;
+    }
+
+    /**
+     * Measure the round-trip time to the server when the channel opens and
+     * grow the receive window to the bandwidth-delay product of a link with
+     * the given capacity.
+     *
+     * Combined with `set_window_size`, the larger of the two wins.
+     */
+    sftp_options& auto_tune_window(boost::uint64_t bits_per_second)
+    {
+        m_link_bandwidth = bits_per_second;
+        return *this;
+    }
+
+    /**
+     * Remember the attributes the filesystem learns of, for up to
+     * `time_to_live`, instead of asking the server again.
+     *
+     * Attributes are learnt from statting paths, including failing to find
+     * them, and from listing directories with `directory_iterator`.  Paths
+     * changed through the filesystem itself are forgotten straight away;
+     * changes made any other way go unnoticed until the entry expires.
+     * Writing to a file through a stream that is still open does not
+     * update what is remembered about it.
+     *
+     * Directories that `create_directories` creates or finds are
+     * remembered for as long, so it need not ask the server about them
+     * again.
+     *
+     * @param max_entries
+     *     Once this many paths are remembered, the least recently used is
+     *     forgotten to make room.
+     */
+    sftp_options& cache_attributes(
+        const boost::posix_time::time_duration& time_to_live,
+        std::size_t max_entries=10000U)
+    {
+        m_attribute_lifetime = time_to_live;
+        m_attribute_cache_size = max_entries;
+        return *this;
+    }
+
+    /**
+     * Remember what `canonical_path` and `resolve_link_target` return, for
+     * up to `time_to_live`, instead of asking the server again.
+     *
+     * Creating a link, renaming or removing through the filesystem forgets
+     * everything remembered, as a path may resolve through a link anywhere
+     * above it.  Changes made any other way go unnoticed until the entry
+     * expires.
+     *
+     * @param max_entries
+     *     Once this many resolutions are remembered, the least recently
+     *     used is forgotten to make room.
+     */
+    sftp_options& cache_resolved_paths(
+        const boost::posix_time::time_duration& time_to_live,
+        std::size_t max_entries=1000U)
+    {
+        m_resolution_lifetime = time_to_live;
+        m_resolution_cache_size = max_entries;
+        return *this;
+    }
+
+    /**
+     * Number of channels over which `sftp_filesystem::attributes` stats a
+     * range of paths, and so of stats in flight at once.
+     *
+     * The channels stay open between calls, so only the first batch pays
+     * for opening them.  Small batches use fewer.
+     */
+    sftp_options& set_stat_width(std::size_t channels)
+    {
+        m_stat_width = channels;
+        return *this;
+    }
+
+    boost::optional<unsigned long> window_size() const
+    {
+        return m_window_size;
+    }
+
+    boost::optional<boost::uint64_t> link_bandwidth() const
+    {
+        return m_link_bandwidth;
+    }
+
+    boost::optional<boost::posix_time::time_duration>
+    attribute_lifetime() const
+    {
+        return m_attribute_lifetime;
+    }
+
+    std::size_t attribute_cache_size() const
+    {
+        return m_attribute_cache_size;
+    }
+
+    boost::optional<boost::posix_time::time_duration>
+    resolution_lifetime() const
+    {
+        return m_resolution_lifetime;
+    }
+
+    std::size_t resolution_cache_size() const
+    {
+        return m_resolution_cache_size;
+    }
+
+    std::size_t stat_width() const
+    {
+        return m_stat_width;
+    }
+
+private:
+    boost::optional<unsigned long> m_window_size;
+    boost::optional<boost::uint64_t> m_link_bandwidth;
+    boost::optional<boost::posix_time::time_duration> m_attribute_lifetime;
+    std::size_t m_attribute_cache_size;
+    boost::optional<boost::posix_time::time_duration> m_resolution_lifetime;
+    std::size_t m_resolution_cache_size;
+    std::size_t m_stat_width;
+};
+
+}} // namespace ssh::filesystem
+
+#endif
@@ -0,0 +1,389 @@
+/**
+    @file
+
+    Connecting and tuning the sockets SSH sessions run over.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the 
+    OpenSSL project's "OpenSSL" library (or with modified versions of it, 
+    with unchanged license). You may copy and distribute such a system 
+    following the terms of the GNU GPL for this program and the licenses 
+    of the other code concerned. The GNU General Public License gives 
+    permission to release a modified version without this exception; this 
+    exception also makes it possible to release a modified version which 
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_SOCKET_HPP
+#define SSH_SOCKET_HPP
+
+#include <ssh/detail/socket.hpp> // last_socket_error, close_socket
+
+#include <boost/cstdint.hpp> // uint64_t
+#include <boost/date_time/posix_time/posix_time_types.hpp> // time_duration
+#include <boost/lexical_cast.hpp>
+#include <boost/optional/optional.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/system/system_error.hpp>
+#include <boost/throw_exception.hpp> // BOOST_THROW_EXCEPTION
+
+#include <cstring> // memset
+#include <limits> // numeric_limits
+#include <string>
+
+namespace ssh {
+
+/**
+ * TCP settings to apply to a socket before an SSH session runs over it.
+ *
+ * By default only Nagle's algorithm is disabled; everything else is left to
+ * the OS.
+ */
+class socket_options
+{
+public:
+    socket_options() : m_no_delay(true), m_quick_ack(false) {}
+
+    /**
+     * Send small packets immediately rather than waiting to coalesce them
+     * (`TCP_NODELAY`).
+     */
+    socket_options& set_no_delay(bool enabled)
+    {
+        m_no_delay = enabled;
+        return *this;
+    }
+
+    /**
+     * Request kernel send and receive buffers of the given size in bytes
+     * (`SO_SNDBUF` and `SO_RCVBUF`).
+     *
+     * The OS may round or cap the size; see `socket_settings` for what it
+     * actually chose.
+     */
+    socket_options& set_buffer_sizes(int send_bytes, int receive_bytes)
+    {
+        m_send_buffer_size = send_bytes;
+        m_receive_buffer_size = receive_bytes;
+        return *this;
+    }
+
+    /**
+     * Size both buffers to hold a full bandwidth-delay product so that a
+     * single connection can fill the link.
+     *
+     * @param bits_per_second  Capacity of the link.
+     * @param round_trip       Round-trip time of the link.
+     */
+    socket_options& size_buffers_for_link(
+        boost::uint64_t bits_per_second,
+        boost::posix_time::time_duration round_trip)
+    {
+        boost::uint64_t bytes =
+            bits_per_second / 8U *
+            static_cast<boost::uint64_t>(round_trip.total_microseconds()) /
+            1000000U;
+
+        int size = (bytes > static_cast<boost::uint64_t>(
+                (std::numeric_limits<int>::max)())) ?
+            (std::numeric_limits<int>::max)() : static_cast<int>(bytes);
+
+        return set_buffer_sizes(size, size);
+    }
+
+    /**
+     * Acknowledge received data immediately rather than delaying ACKs
+     * (`TCP_QUICKACK`).
+     *
+     * Only Linux supports this and it only lasts until the kernel next
+     * decides to delay; elsewhere it is ignored.
+     */
+    socket_options& set_quick_ack(bool enabled)
+    {
+        m_quick_ack = enabled;
+        return *this;
+    }
+
+    /**
+     * Name of the congestion-control algorithm to use, e.g. "bbr"
+     * (`TCP_CONGESTION`).
+     *
+     * Only Linux supports this; elsewhere it is ignored.  The algorithm must
+     * be available to unprivileged processes.
+     */
+    socket_options& set_congestion_control(const std::string& algorithm)
+    {
+        m_congestion_control = algorithm;
+        return *this;
+    }
+
+    bool no_delay() const { return m_no_delay; }
+    boost::optional<int> send_buffer_size() const { return m_send_buffer_size; }
+
+    boost::optional<int> receive_buffer_size() const
+    {
+        return m_receive_buffer_size;
+    }
+
+    bool quick_ack() const { return m_quick_ack; }
+
+    boost::optional<std::string> congestion_control() const
+    {
+        return m_congestion_control;
+    }
+
+private:
+    bool m_no_delay;
+    boost::optional<int> m_send_buffer_size;
+    boost::optional<int> m_receive_buffer_size;
+    bool m_quick_ack;
+    boost::optional<std::string> m_congestion_control;
+};
+
+namespace detail {
+
+    template<typename T>
+    inline void set_socket_option(
+        int socket, int level, int option, const T& value)
+    {
+        if (::setsockopt(
+            socket, level, option, reinterpret_cast<const char*>(&value),
+            sizeof(value)) != 0)
+        {
+            BOOST_THROW_EXCEPTION(
+                boost::system::system_error(
+                    last_socket_error(), "setsockopt"));
+        }
+    }
+
+    template<typename T>
+    inline T get_socket_option(int socket, int level, int option)
+    {
+        T value = T();
+        socket_length length = sizeof(value);
+        if (::getsockopt(
+            socket, level, option, reinterpret_cast<char*>(&value),
+            &length) != 0)
+        {
+            BOOST_THROW_EXCEPTION(
+                boost::system::system_error(
+                    last_socket_error(), "getsockopt"));
+        }
+
+        return value;
+    }
+
+}
+
+/**
+ * TCP settings in effect on a socket, as reported by the OS.
+ *
+ * These can differ from those requested.  For instance, Linux reports double
+ * the buffer size asked for, to account for its bookkeeping, and caps it at
+ * `net.core.wmem_max`/`rmem_max`.  Settings the platform does not support
+ * are empty.
+ */
+class socket_settings
+{
+public:
+    explicit socket_settings(int socket)
+        :
+    m_no_delay(
+        detail::get_socket_option<int>(socket, IPPROTO_TCP, TCP_NODELAY) != 0),
+    m_send_buffer_size(
+        detail::get_socket_option<int>(socket, SOL_SOCKET, SO_SNDBUF)),
+    m_receive_buffer_size(
+        detail::get_socket_option<int>(socket, SOL_SOCKET, SO_RCVBUF))
+    {
+#ifdef TCP_QUICKACK
+        m_quick_ack = detail::get_socket_option<int>(
+            socket, IPPROTO_TCP, TCP_QUICKACK) != 0;
+#endif
+
+#ifdef TCP_CONGESTION
+        char name[64];
+        std::memset(name, 0, sizeof(name));
+        detail::socket_length length = sizeof(name) - 1;
+        if (::getsockopt(
+            socket, IPPROTO_TCP, TCP_CONGESTION, name, &length) == 0)
+        {
+            m_congestion_control = std::string(name);
+        }
+#endif
+    }
+
+    bool no_delay() const { return m_no_delay; }
+    int send_buffer_size() const { return m_send_buffer_size; }
+    int receive_buffer_size() const { return m_receive_buffer_size; }
+    boost::optional<bool> quick_ack() const { return m_quick_ack; }
+
+    boost::optional<std::string> congestion_control() const
+    {
+        return m_congestion_control;
+    }
+
+private:
+    bool m_no_delay;
+    int m_send_buffer_size;
+    int m_receive_buffer_size;
+    boost::optional<bool> m_quick_ack;
+    boost::optional<std::string> m_congestion_control;
+};
+
+/**
+ * Apply the options to an existing socket.
+ *
+ * Buffer sizes should be set before the socket connects, as that is when
+ * the TCP window scale is agreed; `connect_socket` does this.
+ *
+ * @returns the settings now in effect.
+ * @throws `boost::system::system_error` if the OS rejects an option.
+ */
+inline socket_settings tune_socket(int socket, const socket_options& options)
+{
+    detail::set_socket_option<int>(
+        socket, IPPROTO_TCP, TCP_NODELAY, (options.no_delay()) ? 1 : 0);
+
+    if (options.send_buffer_size())
+    {
+        detail::set_socket_option<int>(
+            socket, SOL_SOCKET, SO_SNDBUF, *options.send_buffer_size());
+    }
+
+    if (options.receive_buffer_size())
+    {
+        detail::set_socket_option<int>(
+            socket, SOL_SOCKET, SO_RCVBUF, *options.receive_buffer_size());
+    }
+
+#ifdef TCP_QUICKACK
+    if (options.quick_ack())
+    {
+        detail::set_socket_option<int>(socket, IPPROTO_TCP, TCP_QUICKACK, 1);
+    }
+#endif
+
+#ifdef TCP_CONGESTION
+    if (options.congestion_control())
+    {
+        const std::string& algorithm = *options.congestion_control();
+        if (::setsockopt(
+            socket, IPPROTO_TCP, TCP_CONGESTION, algorithm.data(),
+            static_cast<detail::socket_length>(algorithm.size())) != 0)
+        {
+            BOOST_THROW_EXCEPTION(
+                boost::system::system_error(
+                    detail::last_socket_error(),
+                    "setsockopt(TCP_CONGESTION, " + algorithm + ")"));
+        }
+    }
+#endif
+
+    return socket_settings(socket);
+}
+
+/**
+ * Open a TCP connection to a host, tuned with the given options, ready to
+ * pass to a `session`.
+ *
+ * Each address the host resolves to is tried in turn.
+ *
+ * @returns the connected socket.  The caller owns it and must close it, for
+ *          instance with `close_socket`, after destroying any session using
+ *          it.
+ * @throws `boost::system::system_error` if the host cannot be resolved or
+ *         no address accepts the connection.
+ */
+inline int connect_socket(
+    const std::string& host, unsigned short port,
+    const socket_options& options=socket_options())
+{
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+
+    addrinfo* addresses = NULL;
+    int rc = ::getaddrinfo(
+        host.c_str(), boost::lexical_cast<std::string>(port).c_str(), &hints,
+        &addresses);
+    if (rc != 0)
+    {
+        BOOST_THROW_EXCEPTION(
+            boost::system::system_error(
+                boost::system::errc::make_error_code(
+                    boost::system::errc::host_unreachable),
+                "getaddrinfo: " + std::string(::gai_strerror(rc))));
+    }
+
+    boost::system::error_code ec;
+    for (addrinfo* address = addresses; address; address = address->ai_next)
+    {
+        int socket = static_cast<int>(::socket(
+            address->ai_family, address->ai_socktype, address->ai_protocol));
+        if (socket < 0)
+        {
+            ec = detail::last_socket_error();
+            continue;
+        }
+
+        try
+        {
+            tune_socket(socket, options);
+        }
+        catch (...)
+        {
+            detail::close_socket(socket);
+            ::freeaddrinfo(addresses);
+            throw;
+        }
+
+        if (::connect(
+            socket, address->ai_addr,
+            static_cast<detail::socket_length>(address->ai_addrlen)) == 0)
+        {
+            ::freeaddrinfo(addresses);
+            return socket;
+        }
+
+        ec = detail::last_socket_error();
+        detail::close_socket(socket);
+    }
+
+    ::freeaddrinfo(addresses);
+
+    BOOST_THROW_EXCEPTION(boost::system::system_error(ec, "connect"));
+}
+
+/**
+ * Close a socket opened by `connect_socket`.
+ */
+inline void close_socket(int socket)
+{
+    detail::close_socket(socket);
+}
+
+} // namespace ssh
+
+#endif
@@ -37,6 +37,7 @@
 #ifndef SSH_STREAM_HPP
 #define SSH_STREAM_HPP
 
+#include <ssh/deadline.hpp> // deadline, deadline_slice
 #include <ssh/detail/file_handle_state.hpp>
 #include <ssh/detail/session_state.hpp>
 #include <ssh/detail/libssh2/sftp.hpp>
@@ -396,7 +397,8 @@ namespace detail {
     inline std::streamsize read(
         ::ssh::detail::file_handle_state& handle,
         const boost::filesystem::path& open_path,
-        char* buffer, std::streamsize buffer_size)
+        char* buffer, std::streamsize buffer_size,
+        const ::ssh::deadline& limit)
     {
         try
         {
@@ -406,16 +408,50 @@ namespace detail {
             // http://bit.ly/1ixEagu and http://bit.ly/1ejYm2T).
             // Therefore we loop until all the given buffer has been filled
             // or we reach EOF.
+            //
+            // The deadline is checked before every request to the server so
+            // that a slow trickle of data cannot keep us looping forever.
 
             ssize_t count = 0;
             do
             {
-                ::ssh::detail::file_handle_state::scoped_lock lock =
-                    handle.aquire_lock();
+                limit.check();
+
+                boost::system::error_code ec;
+                std::string message;
+                ssize_t rc = 0;
+
+                {
+                    ::ssh::detail::file_handle_state::scoped_lock lock =
+                        handle.aquire_lock();
+
+                    ::ssh::detail::deadline_slice slice(
+                        handle.session_ptr(), limit);
+
+                    do
+                    {
+                        ec.clear();
+                        rc = ::ssh::detail::libssh2::sftp::read(
+                            handle.session_ptr(), handle.sftp_ptr(),
+                            handle.file_handle(), buffer + count,
+                            buffer_size - count, ec, message);
+                    }
+                    while (ec &&
+                        ::ssh::detail::resume_after_wait_slice(
+                            ec, handle.sftp_ref().session_ref(), limit));
+
+                    if (!ec)
+                    {
+                        handle.sftp_ref().keep_window_open();
+                    }
+                }
+
+                if (ec)
+                {
+                    SSH_DETAIL_THROW_API_ERROR_CODE(
+                        ec, message, "libssh2_sftp_read");
+                }
 
-                ssize_t rc = ::ssh::detail::libssh2::sftp::read(
-                    handle.session_ptr(), handle.sftp_ptr(),
-                    handle.file_handle(), buffer + count, buffer_size - count);
                 if (rc == 0)
                     break; // EOF
 
@@ -435,7 +471,8 @@ namespace detail {
     inline std::streamsize write(
         ::ssh::detail::file_handle_state& handle,
         const boost::filesystem::path& open_path,
-        const char* data, std::streamsize data_size)
+        const char* data, std::streamsize data_size,
+        const ::ssh::deadline& limit)
     {
         try
         {
@@ -450,12 +487,39 @@ namespace detail {
             ssize_t count = 0;
             do
             {
-                ::ssh::detail::file_handle_state::scoped_lock lock =
-                    handle.aquire_lock();
+                limit.check();
 
-                count += ::ssh::detail::libssh2::sftp::write(
-                    handle.session_ptr(), handle.sftp_ptr(),
-                    handle.file_handle(), data + count, data_size - count);
+                boost::system::error_code ec;
+                std::string message;
+                ssize_t rc = 0;
+
+                {
+                    ::ssh::detail::file_handle_state::scoped_lock lock =
+                        handle.aquire_lock();
+
+                    ::ssh::detail::deadline_slice slice(
+                        handle.session_ptr(), limit);
+
+                    do
+                    {
+                        ec.clear();
+                        rc = ::ssh::detail::libssh2::sftp::write(
+                            handle.session_ptr(), handle.sftp_ptr(),
+                            handle.file_handle(), data + count,
+                            data_size - count, ec, message);
+                    }
+                    while (ec &&
+                        ::ssh::detail::resume_after_wait_slice(
+                            ec, handle.sftp_ref().session_ref(), limit));
+                }
+
+                if (ec)
+                {
+                    SSH_DETAIL_THROW_API_ERROR_CODE(
+                        ec, message, "libssh2_sftp_write");
+                }
+
+                count += rc;
             }
             while (count < data_size);
 
@@ -470,6 +534,54 @@ namespace detail {
         }
     }
 
+    /**
+     * Ask the server to commit what has been written to the file to stable
+     * storage, using the `fsync@openssh.com` extension.
+     */
+    inline void fsync(
+        ::ssh::detail::file_handle_state& handle,
+        const boost::filesystem::path& open_path,
+        const ::ssh::deadline& limit)
+    {
+        try
+        {
+            limit.check();
+
+            boost::system::error_code ec;
+            std::string message;
+
+            {
+                ::ssh::detail::file_handle_state::scoped_lock lock =
+                    handle.aquire_lock();
+
+                ::ssh::detail::deadline_slice slice(
+                    handle.session_ptr(), limit);
+
+                do
+                {
+                    ec.clear();
+                    ::ssh::detail::libssh2::sftp::fsync(
+                        handle.session_ptr(), handle.sftp_ptr(),
+                        handle.file_handle(), ec, message);
+                }
+                while (ec &&
+                    ::ssh::detail::resume_after_wait_slice(
+                        ec, handle.sftp_ref().session_ref(), limit));
+            }
+
+            if (ec)
+            {
+                SSH_DETAIL_THROW_API_ERROR_CODE(
+                    ec, message, "libssh2_sftp_fsync");
+            }
+        }
+        catch (boost::exception& e)
+        {
+            e << boost::errinfo_file_name(open_path.string());
+            throw;
+        }
+    }
+
     const std::streamsize DEFAULT_BUFFER_SIZE = 1024 * 32;
 
     struct input_device_category :
@@ -478,10 +590,14 @@ namespace detail {
 
     struct output_device_category :
         boost::iostreams::output_seekable,
+        boost::iostreams::flushable_tag,
+        boost::iostreams::closable_tag,
         boost::iostreams::optimally_buffered_tag {};
 
     struct io_device_category :
         boost::iostreams::seekable,
+        boost::iostreams::flushable_tag,
+        boost::iostreams::closable_tag,
         boost::iostreams::optimally_buffered_tag {};
 
     /**
@@ -575,6 +691,18 @@ public:
              detail::translate_flags(opening_mode)))
     {}
 
+    /**
+     * Limit how long subsequent reads wait for the server.
+     *
+     * Access via the stream's `->` operator.  If the deadline passes while
+     * waiting on the server, the whole session is marked dead (see
+     * `ssh::deadline`).
+     */
+    void set_deadline(const ::ssh::deadline& limit)
+    {
+        m_deadline = limit;
+    }
+
     std::streamsize optimal_buffer_size() const
     {
         return detail::DEFAULT_BUFFER_SIZE;
@@ -582,7 +710,8 @@ public:
 
     std::streamsize read(char* buffer, std::streamsize buffer_size)
     {
-        return detail::read(*m_handle, m_open_path, buffer, buffer_size);
+        return detail::read(
+            *m_handle, m_open_path, buffer, buffer_size, m_deadline);
     }
 
     boost::iostreams::stream_offset seek(
@@ -594,6 +723,7 @@ public:
 private:
     boost::filesystem::path m_open_path;
     boost::shared_ptr<ssh::detail::file_handle_state> m_handle;
+    ::ssh::deadline m_deadline;
 };
 
 /**
@@ -618,8 +748,13 @@ public:
         :
     m_open_path(open_path),
     m_handle(
-        detail::open_output_file(channel.sftp_ref(), m_open_path, opening_mode))
-    {}
+        detail::open_output_file(
+            channel.sftp_ref(), m_open_path, opening_mode)),
+    m_durable(false), m_unsynced(false)
+    {
+        // Opening may have created or truncated the file
+        channel.forget_attributes(m_open_path);
+    }
 
     sftp_output_device(
         sftp_filesystem& channel, const boost::filesystem::path& open_path, 
@@ -629,8 +764,60 @@ public:
     m_handle(
         detail::open_output_file(
             channel.sftp_ref(), m_open_path,
-            detail::translate_flags(opening_mode)))
-    {}
+            detail::translate_flags(opening_mode))),
+    m_durable(false), m_unsynced(false)
+    {
+        channel.forget_attributes(m_open_path);
+    }
+
+    /**
+     * Limit how long subsequent writes wait for the server.
+     *
+     * Access via the stream's `->` operator.  If the deadline passes while
+     * waiting on the server, the whole session is marked dead (see
+     * `ssh::deadline`).
+     */
+    void set_deadline(const ::ssh::deadline& limit)
+    {
+        m_deadline = limit;
+    }
+
+    /**
+     * Make flushing and closing the stream wait until the server has
+     * committed everything written so far to stable storage.
+     *
+     * Access via the stream's `->` operator.  Each flush that follows a
+     * write then costs a round trip and a disk sync on the server; closing
+     * only syncs again if something was written since the last flush.
+     * Uses the `fsync@openssh.com` extension, so fails on a server without
+     * it.  The stream cannot pass on errors from flushing, so a failed sync
+     * only sets its badbit: call `commit` to find out why.  To commit many
+     * files, closing them normally and committing them together with
+     * `sync_batch` is quicker.
+     */
+    void set_durable(bool durable)
+    {
+        m_durable = durable;
+    }
+
+    /**
+     * Commit everything written through the device so far to stable
+     * storage now.
+     *
+     * Access via the stream's `->` operator, after flushing the stream so
+     * that its buffer has reached the server.  Works whether or not the
+     * stream is durable.
+     *
+     * @throws `boost::system::system_error` with
+     *         `errc::operation_not_supported` if the server does not have
+     *         the `fsync@openssh.com` extension, or if the sync fails or the
+     *         deadline passes.
+     */
+    void commit()
+    {
+        detail::fsync(*m_handle, m_open_path, m_deadline);
+        m_unsynced = false;
+    }
 
     std::streamsize optimal_buffer_size() const
     {
@@ -639,7 +826,37 @@ public:
 
     std::streamsize write(const char* data, std::streamsize data_size)
     {
-        return detail::write(*m_handle, m_open_path, data, data_size);
+        m_unsynced = true;
+        return detail::write(
+            *m_handle, m_open_path, data, data_size, m_deadline);
+    }
+
+    /**
+     * Called by the stream once its buffer has been written out.
+     */
+    bool flush()
+    {
+        if (m_durable && m_unsynced)
+        {
+            commit();
+        }
+
+        return true;
+    }
+
+    /**
+     * Called by the stream as it is closed.
+     *
+     * A buffered stream flushes first, so has normally synced already; an
+     * unbuffered one does not.  The handle itself is closed when the last
+     * copy of the device goes.
+     */
+    void close()
+    {
+        if (m_durable && m_unsynced)
+        {
+            commit();
+        }
     }
 
     boost::iostreams::stream_offset seek(
@@ -651,6 +868,11 @@ public:
 private:
     boost::filesystem::path m_open_path;
     boost::shared_ptr<::ssh::detail::file_handle_state> m_handle;
+    ::ssh::deadline m_deadline;
+    bool m_durable;
+
+    /// Whether anything has been written since the last sync.
+    bool m_unsynced;
 };
 
 
@@ -676,8 +898,11 @@ public:
         openmode::value opening_mode=openmode::in | openmode::out)
         :
     m_open_path(open_path),
-    m_handle(detail::open_file(channel.sftp_ref(), m_open_path, opening_mode))
-    {}
+    m_handle(detail::open_file(channel.sftp_ref(), m_open_path, opening_mode)),
+    m_durable(false), m_unsynced(false)
+    {
+        channel.forget_attributes(m_open_path);
+    }
 
     sftp_io_device(
         sftp_filesystem& channel, const boost::filesystem::path& open_path, 
@@ -687,8 +912,60 @@ public:
     m_handle(
         detail::open_file(
             channel.sftp_ref(), m_open_path,
-            detail::translate_flags(opening_mode)))
-    {}
+            detail::translate_flags(opening_mode))),
+    m_durable(false), m_unsynced(false)
+    {
+        channel.forget_attributes(m_open_path);
+    }
+
+    /**
+     * Limit how long subsequent reads and writes wait for the server.
+     *
+     * Access via the stream's `->` operator.  If the deadline passes while
+     * waiting on the server, the whole session is marked dead (see
+     * `ssh::deadline`).
+     */
+    void set_deadline(const ::ssh::deadline& limit)
+    {
+        m_deadline = limit;
+    }
+
+    /**
+     * Make flushing and closing the stream wait until the server has
+     * committed everything written so far to stable storage.
+     *
+     * Access via the stream's `->` operator.  Each flush that follows a
+     * write then costs a round trip and a disk sync on the server; closing
+     * only syncs again if something was written since the last flush.
+     * Uses the `fsync@openssh.com` extension, so fails on a server without
+     * it.  The stream cannot pass on errors from flushing, so a failed sync
+     * only sets its badbit: call `commit` to find out why.  To commit many
+     * files, closing them normally and committing them together with
+     * `sync_batch` is quicker.
+     */
+    void set_durable(bool durable)
+    {
+        m_durable = durable;
+    }
+
+    /**
+     * Commit everything written through the device so far to stable
+     * storage now.
+     *
+     * Access via the stream's `->` operator, after flushing the stream so
+     * that its buffer has reached the server.  Works whether or not the
+     * stream is durable.
+     *
+     * @throws `boost::system::system_error` with
+     *         `errc::operation_not_supported` if the server does not have
+     *         the `fsync@openssh.com` extension, or if the sync fails or the
+     *         deadline passes.
+     */
+    void commit()
+    {
+        detail::fsync(*m_handle, m_open_path, m_deadline);
+        m_unsynced = false;
+    }
 
     std::streamsize optimal_buffer_size() const
     {
@@ -697,12 +974,43 @@ public:
 
     std::streamsize read(char* buffer, std::streamsize buffer_size)
     {
-        return detail::read(*m_handle, m_open_path, buffer, buffer_size);
+        return detail::read(
+            *m_handle, m_open_path, buffer, buffer_size, m_deadline);
     }
 
     std::streamsize write(const char* data, std::streamsize data_size)
     {
-        return detail::write(*m_handle, m_open_path, data, data_size);
+        m_unsynced = true;
+        return detail::write(
+            *m_handle, m_open_path, data, data_size, m_deadline);
+    }
+
+    /**
+     * Called by the stream once its buffer has been written out.
+     */
+    bool flush()
+    {
+        if (m_durable && m_unsynced)
+        {
+            commit();
+        }
+
+        return true;
+    }
+
+    /**
+     * Called by the stream as it is closed.
+     *
+     * A buffered stream flushes first, so has normally synced already; an
+     * unbuffered one does not.  The handle itself is closed when the last
+     * copy of the device goes.
+     */
+    void close()
+    {
+        if (m_durable && m_unsynced)
+        {
+            commit();
+        }
     }
 
     boost::iostreams::stream_offset seek(
@@ -714,6 +1022,11 @@ public:
 private:
     boost::filesystem::path m_open_path;
     boost::shared_ptr<::ssh::detail::file_handle_state> m_handle;
+    ::ssh::deadline m_deadline;
+    bool m_durable;
+
+    /// Whether anything has been written since the last sync.
+    bool m_unsynced;
 };
 
 /**
@@ -0,0 +1,286 @@
+/**
+    @file
+
+    Committing batches of remote files to stable storage together.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the 
+    OpenSSL project's "OpenSSL" library (or with modified versions of it, 
+    with unchanged license). You may copy and distribute such a system 
+    following the terms of the GNU GPL for this program and the licenses 
+    of the other code concerned. The GNU General Public License gives 
+    permission to release a modified version without this exception; this 
+    exception also makes it possible to release a modified version which 
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_SYNC_BATCH_HPP
+#define SSH_SYNC_BATCH_HPP
+
+#include <ssh/deadline.hpp>
+#include <ssh/detail/sftp_channel_state.hpp>
+#include <ssh/detail/sftp_pipeline.hpp>
+#include <ssh/filesystem.hpp> // sftp_filesystem, path_error
+
+#include <boost/filesystem/path.hpp> // path
+#include <boost/make_shared.hpp>
+#include <boost/ref.hpp> // ref
+#include <boost/shared_ptr.hpp>
+#include <boost/system/error_code.hpp>
+
+#include <algorithm> // sort, unique
+#include <cstddef> // size_t
+#include <string>
+#include <vector>
+
+#include <libssh2_sftp.h>
+
+namespace ssh {
+namespace filesystem {
+
+namespace detail {
+
+    class sync_state : public ::ssh::detail::pipeline_source
+    {
+    public:
+
+        explicit sync_state(const std::vector<boost::filesystem::path>& files)
+            : m_files(files), m_next(0U), m_count(0U) {}
+
+        virtual boost::shared_ptr< ::ssh::detail::pipeline_task> next_task();
+
+        void file_synced(
+            const boost::filesystem::path& file,
+            const boost::system::error_code& ec)
+        {
+            if (ec)
+            {
+                m_errors.push_back(path_error(file, ec));
+            }
+            else
+            {
+                ++m_count;
+            }
+        }
+
+        std::size_t count() const
+        {
+            return m_count;
+        }
+
+        std::vector<path_error>& errors()
+        {
+            return m_errors;
+        }
+
+    private:
+        const std::vector<boost::filesystem::path>& m_files;
+        std::size_t m_next;
+        std::size_t m_count;
+        std::vector<path_error> m_errors;
+    };
+
+    /**
+     * Opens a file only to have the server sync it to disk.
+     *
+     * A sync covers everything written to the file through any handle, so
+     * the handle is opened read-only.
+     */
+    class sync_task : public ::ssh::detail::pipeline_task
+    {
+    public:
+        sync_task(const boost::filesystem::path& file, sync_state& state)
+            :
+        m_file(file), m_path(file.string()), m_state(state), m_handle(NULL),
+        m_stage(opening) {}
+
+        virtual bool resume(::ssh::detail::sftp_channel_state& channel)
+        {
+            boost::system::error_code ec;
+
+            if (m_stage == opening)
+            {
+                m_handle = ::libssh2_sftp_open_ex(
+                    channel.sftp_ptr(), m_path.data(),
+                    static_cast<unsigned int>(m_path.size()),
+                    LIBSSH2_FXF_READ, 0, LIBSSH2_SFTP_OPENFILE);
+                if (!::ssh::detail::sftp_open_finished(m_handle, channel, ec))
+                {
+                    return false;
+                }
+
+                if (ec)
+                {
+                    m_state.file_synced(m_file, ec);
+                    return true;
+                }
+
+                m_stage = syncing;
+            }
+
+            if (m_stage == syncing)
+            {
+                int rc = ::libssh2_sftp_fsync(m_handle);
+                if (!::ssh::detail::sftp_call_finished(rc, channel, ec))
+                {
+                    return false;
+                }
+
+                m_error = ec;
+                m_stage = closing;
+            }
+
+            // Errors closing a handle that wrote nothing do not matter
+            int rc = ::libssh2_sftp_close_handle(m_handle);
+            if (!::ssh::detail::sftp_call_finished(rc, channel, ec))
+            {
+                return false;
+            }
+
+            m_state.file_synced(m_file, m_error);
+            return true;
+        }
+
+    private:
+        enum stage { opening, syncing, closing };
+
+        boost::filesystem::path m_file;
+        std::string m_path;
+        sync_state& m_state;
+        LIBSSH2_SFTP_HANDLE* m_handle;
+        stage m_stage;
+        boost::system::error_code m_error;
+    };
+
+    inline boost::shared_ptr< ::ssh::detail::pipeline_task>
+    sync_state::next_task()
+    {
+        if (m_next < m_files.size())
+        {
+            return boost::make_shared<sync_task>(
+                m_files[m_next++], boost::ref(*this));
+        }
+        else
+        {
+            return boost::shared_ptr< ::ssh::detail::pipeline_task>();
+        }
+    }
+
+}
+
+/**
+ * Commits the files written by a job to stable storage together once the
+ * job is done.
+ *
+ * Making each stream durable (`sftp_output_device::set_durable`) costs a
+ * round trip and a disk sync per file while the file is being written.
+ * A batch instead collects the files as they are written and, at the end,
+ * asks the server to sync them all with several requests in flight at
+ * once, so the syncs overlap on the server rather than queueing behind
+ * one another.  Uses the `fsync@openssh.com` extension.
+ */
+class sync_batch
+{
+public:
+
+    /**
+     * The `sftp_filesystem` must outlive the batch.
+     */
+    explicit sync_batch(sftp_filesystem& filesystem)
+        : m_filesystem(filesystem), m_width(4) {}
+
+    /**
+     * Number of channels, and so of syncs in flight at once.
+     *
+     * The server may allow fewer; the batch uses what it can get.
+     */
+    sync_batch& set_width(std::size_t channels)
+    {
+        m_width = channels;
+        return *this;
+    }
+
+    /**
+     * Include a file in the next commit.
+     *
+     * Adding the same file more than once syncs it once.
+     */
+    void add(const boost::filesystem::path& file)
+    {
+        m_files.push_back(file);
+    }
+
+    /**
+     * Number of files waiting to be committed, including any repeats.
+     */
+    std::size_t size() const
+    {
+        return m_files.size();
+    }
+
+    /**
+     * Have the server commit every file added since the last commit to
+     * stable storage.
+     *
+     * The batch is emptied whether or not every file could be committed.
+     *
+     * @param errors
+     *     Receives the files that could not be committed, and why.  A
+     *     server without the extension fails every file with
+     *     `errc::operation_not_supported`.
+     * @returns the number of files committed.
+     * @throws `boost::system::system_error` if the deadline passes.  The
+     *         batch is then left as it was so that the commit can be
+     *         retried.
+     */
+    std::size_t commit(
+        std::vector<path_error>& errors,
+        const ::ssh::deadline& limit=::ssh::deadline())
+    {
+        std::sort(m_files.begin(), m_files.end());
+        m_files.erase(
+            std::unique(m_files.begin(), m_files.end()), m_files.end());
+
+        detail::sync_state state(m_files);
+
+        ::ssh::detail::sftp_pipeline pipeline(
+            m_filesystem.sftp_ref().session_ref(), m_width);
+        pipeline.run(state, limit);
+
+        m_files.clear();
+
+        errors.insert(
+            errors.end(), state.errors().begin(), state.errors().end());
+
+        return state.count();
+    }
+
+private:
+    sftp_filesystem& m_filesystem;
+    std::size_t m_width;
+    std::vector<boost::filesystem::path> m_files;
+};
+
+}} // namespace ssh::filesystem
+
+#endif
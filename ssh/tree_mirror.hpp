@@ -0,0 +1,1318 @@
+/**
+    @file
+
+    Mirroring local directory trees onto the remote filesystem.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the 
+    OpenSSL project's "OpenSSL" library (or with modified versions of it, 
+    with unchanged license). You may copy and distribute such a system 
+    following the terms of the GNU GPL for this program and the licenses 
+    of the other code concerned. The GNU General Public License gives 
+    permission to release a modified version without this exception; this 
+    exception also makes it possible to release a modified version which 
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_TREE_MIRROR_HPP
+#define SSH_TREE_MIRROR_HPP
+
+#include <ssh/deadline.hpp>
+#include <ssh/detail/sftp_channel_state.hpp>
+#include <ssh/detail/sftp_pipeline.hpp>
+#include <ssh/directory_walker.hpp> // recursive_directory_walker, relative_to
+#include <ssh/filesystem.hpp> // sftp_filesystem, path_error, space_info
+#include <ssh/stream.hpp> // ifstream
+
+#include <boost/cstdint.hpp> // uintmax_t
+#include <boost/detail/scoped_enum_emulation.hpp> // BOOST_SCOPED_ENUM
+#include <boost/filesystem/fstream.hpp> // ifstream
+#include <boost/filesystem/operations.hpp> // recursive_directory_iterator
+#include <boost/filesystem/path.hpp> // path
+#include <boost/make_shared.hpp>
+#include <boost/optional/optional.hpp>
+#include <boost/ref.hpp> // ref
+#include <boost/shared_ptr.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/system/system_error.hpp>
+#include <boost/throw_exception.hpp> // BOOST_THROW_EXCEPTION
+
+#include <algorithm> // equal, min
+#include <cstddef> // size_t
+#include <ctime> // time_t
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <libssh2_sftp.h>
+
+namespace ssh {
+namespace filesystem {
+
+/**
+ * What mirroring did, or in a dry run would do, to one path.
+ */
+BOOST_SCOPED_ENUM_START(mirror_action)
+{
+    create_directory,
+    upload,
+    update, ///< Changed blocks rewritten in the existing remote file
+    remove,
+    unchanged
+};
+BOOST_SCOPED_ENUM_END
+
+/**
+ * Outcome of mirroring one path.
+ */
+struct mirror_entry
+{
+    mirror_entry(
+        const boost::filesystem::path& path,
+        BOOST_SCOPED_ENUM(mirror_action) action, boost::uintmax_t bytes=0U)
+        : path(path), action(action), bytes(bytes) {}
+
+    /// Relative to the roots of the mirror.
+    boost::filesystem::path path;
+
+    BOOST_SCOPED_ENUM(mirror_action) action;
+
+    /// Bytes uploaded or, in a dry run, the most that would be.
+    boost::uintmax_t bytes;
+
+    /// Set if the action failed.
+    boost::system::error_code error;
+};
+
+/**
+ * Everything a `tree_mirror` did, path by path.
+ */
+class mirror_report
+{
+public:
+
+    const std::vector<mirror_entry>& entries() const
+    {
+        return m_entries;
+    }
+
+    /**
+     * Remote directories that could not be listed, and why.
+     *
+     * Their contents are treated as missing, so are uploaded again.
+     */
+    const std::vector<path_error>& listing_errors() const
+    {
+        return m_listing_errors;
+    }
+
+    /**
+     * Number of paths given the action, whether or not it succeeded.
+     */
+    std::size_t count(BOOST_SCOPED_ENUM(mirror_action) action) const
+    {
+        std::size_t total = 0U;
+        for (std::size_t i = 0; i < m_entries.size(); ++i)
+        {
+            if (m_entries[i].action == action)
+            {
+                ++total;
+            }
+        }
+
+        return total;
+    }
+
+    boost::uintmax_t bytes_uploaded() const
+    {
+        boost::uintmax_t total = 0U;
+        for (std::size_t i = 0; i < m_entries.size(); ++i)
+        {
+            total += m_entries[i].bytes;
+        }
+
+        return total;
+    }
+
+    std::size_t failures() const
+    {
+        std::size_t total = 0U;
+        for (std::size_t i = 0; i < m_entries.size(); ++i)
+        {
+            if (m_entries[i].error)
+            {
+                ++total;
+            }
+        }
+
+        return total;
+    }
+
+private:
+    friend class tree_mirror;
+
+    std::vector<mirror_entry> m_entries;
+    std::vector<path_error> m_listing_errors;
+};
+
+namespace detail {
+
+    /**
+     * Is one of the directories containing the relative `path` in
+     * `directories`?
+     */
+    inline bool is_below_any(
+        const std::set<std::string>& directories, const std::string& path)
+    {
+        for (std::string::size_type end = path.rfind('/');
+            end != std::string::npos && end > 0;
+            end = path.rfind('/', end - 1))
+        {
+            if (directories.find(path.substr(0, end)) != directories.end())
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * Visitor collecting the attributes of a remote tree by relative path.
+     */
+    class remote_index
+    {
+    public:
+        typedef std::map<std::string, file_attributes> index_type;
+
+        remote_index(const std::string& root, index_type& index)
+            : m_root(root), m_index(&index) {}
+
+        void operator()(const sftp_file& file, std::size_t)
+        {
+            m_index->insert(
+                std::make_pair(
+                    relative_to(m_root, file.path().string()),
+                    file.attributes()));
+        }
+
+    private:
+        std::string m_root;
+        index_type* m_index;
+    };
+
+    /**
+     * Drop everything below the relative `path` from the index.
+     */
+    inline void forget_below(
+        remote_index::index_type& index, const std::string& path)
+    {
+        std::string prefix = path + "/";
+        remote_index::index_type::iterator it = index.lower_bound(prefix);
+        while (it != index.end() && it->first.compare(
+            0, prefix.size(), prefix) == 0)
+        {
+            index.erase(it++);
+        }
+    }
+
+    /**
+     * Clearing a remote path of the wrong type out of the way and, for a
+     * directory, creating it.
+     *
+     * Held back until the whole tree has been compared, so that nothing
+     * changes if the uploads turn out not to fit.
+     */
+    struct preparation
+    {
+        preparation(
+            std::size_t entry, const boost::filesystem::path& remote,
+            const boost::optional<file_attributes>& existing,
+            bool is_directory)
+            :
+        entry(entry), remote(remote), existing(existing),
+        is_directory(is_directory) {}
+
+        /// Index of the entry in the report.
+        std::size_t entry;
+
+        boost::filesystem::path remote;
+        boost::optional<file_attributes> existing;
+        bool is_directory;
+    };
+
+    struct upload_job
+    {
+        upload_job(
+            const boost::filesystem::path& local,
+            const boost::filesystem::path& remote,
+            std::time_t last_modified, unsigned long permissions,
+            mirror_entry& entry)
+            :
+        local(local), remote(remote), last_modified(last_modified),
+        permissions(permissions), entry(&entry) {}
+
+        boost::filesystem::path local;
+        boost::filesystem::path remote;
+        std::time_t last_modified;
+
+        /// Permission bits of the local file, as SFTP mode bits.
+        unsigned long permissions;
+
+        mirror_entry* entry;
+
+        bool in_place() const
+        {
+            return entry->action == mirror_action::update;
+        }
+    };
+
+    /**
+     * Uploads one file to a temporary name beside its destination, then
+     * renames it into place so that readers never see it half written.
+     */
+    class upload_task : public ::ssh::detail::pipeline_task
+    {
+    public:
+        explicit upload_task(const upload_job& job)
+            :
+        m_job(job), m_remote(job.remote.string()),
+        m_temporary(
+            (job.remote.parent_path() /
+                ("." + job.remote.filename().string() + ".partial"))
+            .string()),
+        m_handle(NULL), m_buffer(32U * 1024U), m_offset(0U), m_pending(0U),
+        m_stage(opening) {}
+
+        virtual bool resume(::ssh::detail::sftp_channel_state& channel)
+        {
+            boost::system::error_code ec;
+            LIBSSH2_SFTP* sftp = channel.sftp_ptr();
+
+            if (m_stage == opening)
+            {
+                if (!m_local.is_open())
+                {
+                    m_local.open(m_job.local, std::ios_base::binary);
+                    if (!m_local)
+                    {
+                        m_job.entry->error =
+                            boost::system::errc::make_error_code(
+                                boost::system::errc::io_error);
+                        return true;
+                    }
+                }
+
+                m_handle = ::libssh2_sftp_open_ex(
+                    sftp, m_temporary.data(),
+                    static_cast<unsigned int>(m_temporary.size()),
+                    LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT | LIBSSH2_FXF_TRUNC,
+                    LIBSSH2_SFTP_S_IRUSR | LIBSSH2_SFTP_S_IWUSR,
+                    LIBSSH2_SFTP_OPENFILE);
+                if (!::ssh::detail::sftp_open_finished(m_handle, channel, ec))
+                {
+                    return false;
+                }
+
+                if (ec)
+                {
+                    m_job.entry->error = ec;
+                    return true;
+                }
+
+                m_stage = writing;
+            }
+
+            while (m_stage == writing)
+            {
+                if (m_pending == 0U)
+                {
+                    m_local.read(&m_buffer[0], m_buffer.size());
+                    m_offset = 0U;
+                    m_pending = static_cast<std::size_t>(m_local.gcount());
+
+                    if (m_pending == 0U)
+                    {
+                        if (m_local.bad())
+                        {
+                            m_job.entry->error =
+                                boost::system::errc::make_error_code(
+                                    boost::system::errc::io_error);
+                            m_stage = abandoning;
+                        }
+                        else
+                        {
+                            m_stage = stamping;
+                        }
+
+                        break;
+                    }
+                }
+
+                // Must be repeated with the same data after
+                // LIBSSH2_ERROR_EAGAIN
+                ssize_t rc = ::libssh2_sftp_write(
+                    m_handle, &m_buffer[m_offset], m_pending);
+                if (!::ssh::detail::sftp_call_finished(
+                        static_cast<int>(rc), channel, ec))
+                {
+                    return false;
+                }
+
+                if (ec)
+                {
+                    m_job.entry->error = ec;
+                    m_stage = abandoning;
+                }
+                else
+                {
+                    m_offset += static_cast<std::size_t>(rc);
+                    m_pending -= static_cast<std::size_t>(rc);
+                    m_job.entry->bytes += static_cast<std::size_t>(rc);
+                }
+            }
+
+            if (m_stage == stamping)
+            {
+                // Permissions are set here rather than when opening so that
+                // the server's umask does not mask them and a read-only
+                // file can still be written first
+                LIBSSH2_SFTP_ATTRIBUTES attributes = LIBSSH2_SFTP_ATTRIBUTES();
+                attributes.flags =
+                    LIBSSH2_SFTP_ATTR_ACMODTIME | LIBSSH2_SFTP_ATTR_PERMISSIONS;
+                attributes.atime = static_cast<unsigned long>(
+                    m_job.last_modified);
+                attributes.mtime = attributes.atime;
+                attributes.permissions = m_job.permissions;
+
+                int rc = ::libssh2_sftp_fsetstat(m_handle, &attributes);
+                if (!::ssh::detail::sftp_call_finished(rc, channel, ec))
+                {
+                    return false;
+                }
+
+                // A server that will not set the time or mode still gets
+                // the file; it will just be sent again next time
+                ec.clear();
+                m_stage = closing;
+            }
+
+            if (m_stage == closing || m_stage == abandoning)
+            {
+                int rc = ::libssh2_sftp_close_handle(m_handle);
+                if (!::ssh::detail::sftp_call_finished(rc, channel, ec))
+                {
+                    return false;
+                }
+
+                if (m_stage == closing && ec)
+                {
+                    m_job.entry->error = ec;
+                }
+
+                if (m_stage == abandoning || ec)
+                {
+                    m_stage = discarding;
+                }
+                else if (channel.extension_refused(posix_rename_extension()))
+                {
+                    m_stage = renaming;
+                }
+                else
+                {
+                    m_stage = posix_renaming;
+                }
+            }
+
+            if (m_stage == posix_renaming)
+            {
+                // Replaces an existing file atomically in one round trip
+                int rc = ::libssh2_sftp_posix_rename_ex(
+                    sftp, m_temporary.data(), m_temporary.size(),
+                    m_remote.data(), m_remote.size());
+                if (!::ssh::detail::sftp_call_finished(rc, channel, ec))
+                {
+                    return false;
+                }
+
+                if (!ec)
+                {
+                    channel.record_extension(posix_rename_extension(), true);
+                    return true;
+                }
+                else if (ec == boost::system::errc::operation_not_supported)
+                {
+                    channel.record_extension(posix_rename_extension(), false);
+                    ec.clear();
+                    m_stage = renaming;
+                }
+                else
+                {
+                    m_job.entry->error = ec;
+                    m_stage = discarding;
+                }
+            }
+
+            if (m_stage == renaming || m_stage == renaming_again)
+            {
+                int rc = ::libssh2_sftp_rename_ex(
+                    sftp, m_temporary.data(),
+                    static_cast<unsigned int>(m_temporary.size()),
+                    m_remote.data(), static_cast<unsigned int>(m_remote.size()),
+                    LIBSSH2_SFTP_RENAME_OVERWRITE | LIBSSH2_SFTP_RENAME_ATOMIC);
+                if (!::ssh::detail::sftp_call_finished(rc, channel, ec))
+                {
+                    return false;
+                }
+
+                if (!ec)
+                {
+                    return true;
+                }
+                else if (m_stage == renaming)
+                {
+                    // SFTP version 3 servers, such as OpenSSH, refuse to
+                    // rename over an existing file so the old one has to go
+                    // first
+                    m_stage = replacing;
+                }
+                else
+                {
+                    m_job.entry->error = ec;
+                    m_stage = discarding;
+                }
+            }
+
+            if (m_stage == replacing)
+            {
+                int rc = ::libssh2_sftp_unlink_ex(
+                    sftp, m_remote.data(),
+                    static_cast<unsigned int>(m_remote.size()));
+                if (!::ssh::detail::sftp_call_finished(rc, channel, ec))
+                {
+                    return false;
+                }
+
+                // Any error that matters shows up when renaming again
+                m_stage = renaming_again;
+                return resume(channel);
+            }
+
+            // Leave nothing half-written behind
+            int rc = ::libssh2_sftp_unlink_ex(
+                sftp, m_temporary.data(),
+                static_cast<unsigned int>(m_temporary.size()));
+            return ::ssh::detail::sftp_call_finished(rc, channel, ec);
+        }
+
+    private:
+        enum stage
+        {
+            opening, writing, stamping, closing, abandoning, posix_renaming,
+            renaming, replacing, renaming_again, discarding
+        };
+
+        static const char* posix_rename_extension()
+        {
+            return "posix-rename@openssh.com";
+        }
+
+        upload_job m_job;
+        std::string m_remote;
+        std::string m_temporary;
+        boost::filesystem::ifstream m_local;
+        LIBSSH2_SFTP_HANDLE* m_handle;
+        std::vector<char> m_buffer;
+        std::size_t m_offset;
+        std::size_t m_pending;
+        stage m_stage;
+    };
+
+    /**
+     * Brings an existing remote file up to date by rewriting only the
+     * blocks that differ from the local file.
+     *
+     * The remote file is streamed down over one handle, each block compared
+     * with the local block at the same offset, and any that differ written
+     * back over a second handle so that the read-ahead on the first is
+     * never disturbed.  Finally the file is cut, or extended, to the local
+     * size.
+     *
+     * Unlike `upload_task` this changes the file in place so a reader can
+     * see a mix of old and new blocks while it runs.
+     */
+    class delta_task : public ::ssh::detail::pipeline_task
+    {
+    public:
+
+        static const std::size_t block_size = 64U * 1024U;
+
+        explicit delta_task(const upload_job& job)
+            :
+        m_job(job), m_remote(job.remote.string()), m_reader(NULL),
+        m_writer(NULL), m_local_block(block_size), m_remote_block(block_size),
+        m_offset(0U), m_length(0U), m_filled(0U), m_written(0U),
+        m_remote_ended(false), m_stage(opening_reader) {}
+
+        virtual bool resume(::ssh::detail::sftp_channel_state& channel)
+        {
+            boost::system::error_code ec;
+
+            if (m_stage == opening_reader || m_stage == opening_writer)
+            {
+                if (!m_local.is_open())
+                {
+                    m_local.open(m_job.local, std::ios_base::binary);
+                    if (!m_local)
+                    {
+                        m_job.entry->error =
+                            boost::system::errc::make_error_code(
+                                boost::system::errc::io_error);
+                        return true;
+                    }
+                }
+
+                LIBSSH2_SFTP_HANDLE*& handle =
+                    (m_stage == opening_reader) ? m_reader : m_writer;
+                handle = ::libssh2_sftp_open_ex(
+                    channel.sftp_ptr(), m_remote.data(),
+                    static_cast<unsigned int>(m_remote.size()),
+                    (m_stage == opening_reader) ?
+                        LIBSSH2_FXF_READ : LIBSSH2_FXF_WRITE,
+                    0, LIBSSH2_SFTP_OPENFILE);
+                if (!::ssh::detail::sftp_open_finished(handle, channel, ec))
+                {
+                    return false;
+                }
+
+                if (ec)
+                {
+                    m_job.entry->error = ec;
+                    m_stage = closing_writer;
+                }
+                else
+                {
+                    m_stage = (m_stage == opening_reader) ?
+                        opening_writer : comparing;
+                }
+            }
+
+            while (m_stage == comparing || m_stage == writing)
+            {
+                if (m_stage == comparing)
+                {
+                    if (!compare_next_block(channel, ec))
+                    {
+                        return false;
+                    }
+                }
+                else
+                {
+                    // Must be repeated with the same data after
+                    // LIBSSH2_ERROR_EAGAIN
+                    ssize_t rc = ::libssh2_sftp_write(
+                        m_writer, &m_local_block[m_written],
+                        m_length - m_written);
+                    if (!::ssh::detail::sftp_call_finished(
+                            static_cast<int>(rc), channel, ec))
+                    {
+                        return false;
+                    }
+
+                    if (!ec)
+                    {
+                        m_written += static_cast<std::size_t>(rc);
+                        m_job.entry->bytes += static_cast<std::size_t>(rc);
+                        if (m_written == m_length)
+                        {
+                            next_block();
+                        }
+                    }
+                }
+
+                if (ec)
+                {
+                    m_job.entry->error = ec;
+                    m_stage = closing_writer;
+                }
+            }
+
+            if (m_stage == resizing)
+            {
+                LIBSSH2_SFTP_ATTRIBUTES attributes = LIBSSH2_SFTP_ATTRIBUTES();
+                attributes.flags =
+                    LIBSSH2_SFTP_ATTR_SIZE | LIBSSH2_SFTP_ATTR_ACMODTIME |
+                    LIBSSH2_SFTP_ATTR_PERMISSIONS;
+                attributes.filesize = m_offset;
+                attributes.atime = static_cast<unsigned long>(
+                    m_job.last_modified);
+                attributes.mtime = attributes.atime;
+                attributes.permissions = m_job.permissions;
+
+                int rc = ::libssh2_sftp_fsetstat(m_writer, &attributes);
+                if (!::ssh::detail::sftp_call_finished(rc, channel, ec))
+                {
+                    return false;
+                }
+
+                if (ec)
+                {
+                    // Without the new size the file is still wrong
+                    m_job.entry->error = ec;
+                }
+
+                m_stage = closing_writer;
+            }
+
+            if (m_stage == closing_writer)
+            {
+                if (m_writer)
+                {
+                    int rc = ::libssh2_sftp_close_handle(m_writer);
+                    if (!::ssh::detail::sftp_call_finished(rc, channel, ec))
+                    {
+                        return false;
+                    }
+
+                    if (ec && !m_job.entry->error)
+                    {
+                        m_job.entry->error = ec;
+                    }
+                }
+
+                m_stage = closing_reader;
+            }
+
+            if (m_reader)
+            {
+                int rc = ::libssh2_sftp_close_handle(m_reader);
+                return ::ssh::detail::sftp_call_finished(rc, channel, ec);
+            }
+
+            return true;
+        }
+
+    private:
+        enum stage
+        {
+            opening_reader, opening_writer, comparing, writing, resizing,
+            closing_writer, closing_reader
+        };
+
+        /**
+         * Fill the remote block to match the local one and decide whether
+         * it has to be written.
+         *
+         * @returns false if the server has not yet sent enough.
+         */
+        bool compare_next_block(
+            ::ssh::detail::sftp_channel_state& channel,
+            boost::system::error_code& ec)
+        {
+            if (m_length == 0U)
+            {
+                m_local.read(&m_local_block[0], m_local_block.size());
+                m_length = static_cast<std::size_t>(m_local.gcount());
+                if (m_length == 0U)
+                {
+                    if (m_local.bad())
+                    {
+                        ec = boost::system::errc::make_error_code(
+                            boost::system::errc::io_error);
+                    }
+                    else
+                    {
+                        m_stage = resizing;
+                    }
+
+                    return true;
+                }
+            }
+
+            while (!m_remote_ended && m_filled < m_length)
+            {
+                // Must be repeated with the same buffer after
+                // LIBSSH2_ERROR_EAGAIN
+                ssize_t rc = ::libssh2_sftp_read(
+                    m_reader, &m_remote_block[m_filled], m_length - m_filled);
+                if (!::ssh::detail::sftp_call_finished(
+                        static_cast<int>(rc), channel, ec))
+                {
+                    return false;
+                }
+
+                if (ec)
+                {
+                    return true;
+                }
+
+                if (rc == 0)
+                {
+                    m_remote_ended = true;
+                }
+
+                m_filled += static_cast<std::size_t>(rc);
+            }
+
+            if (m_filled == m_length &&
+                std::equal(
+                    m_local_block.begin(), m_local_block.begin() + m_length,
+                    m_remote_block.begin()))
+            {
+                next_block();
+            }
+            else
+            {
+                ::libssh2_sftp_seek64(m_writer, m_offset);
+                m_stage = writing;
+            }
+
+            return true;
+        }
+
+        void next_block()
+        {
+            m_offset += m_length;
+            m_length = 0U;
+            m_filled = 0U;
+            m_written = 0U;
+            m_stage = comparing;
+        }
+
+        upload_job m_job;
+        std::string m_remote;
+        boost::filesystem::ifstream m_local;
+        LIBSSH2_SFTP_HANDLE* m_reader;
+        LIBSSH2_SFTP_HANDLE* m_writer;
+        std::vector<char> m_local_block;
+        std::vector<char> m_remote_block;
+        boost::uint64_t m_offset; ///< Of the current block
+        std::size_t m_length; ///< Of the current local block
+        std::size_t m_filled; ///< Bytes of the remote block read so far
+        std::size_t m_written; ///< Bytes of the local block written so far
+        bool m_remote_ended;
+        stage m_stage;
+    };
+
+    class upload_source : public ::ssh::detail::pipeline_source
+    {
+    public:
+        explicit upload_source(const std::vector<upload_job>& jobs)
+            : m_jobs(jobs), m_next(0U) {}
+
+        virtual boost::shared_ptr< ::ssh::detail::pipeline_task> next_task()
+        {
+            if (m_next == m_jobs.size())
+            {
+                return boost::shared_ptr< ::ssh::detail::pipeline_task>();
+            }
+
+            const upload_job& job = m_jobs[m_next++];
+            if (job.in_place())
+            {
+                return boost::make_shared<delta_task>(job);
+            }
+            else
+            {
+                return boost::make_shared<upload_task>(job);
+            }
+        }
+
+    private:
+        const std::vector<upload_job>& m_jobs;
+        std::size_t m_next;
+    };
+
+    /**
+     * Does the remote file hold exactly what the local one does?
+     */
+    inline bool same_contents(
+        sftp_filesystem& filesystem, const boost::filesystem::path& local,
+        const boost::filesystem::path& remote)
+    {
+        boost::filesystem::ifstream local_stream(local, std::ios_base::binary);
+        ::ssh::filesystem::ifstream remote_stream(filesystem, remote);
+
+        std::vector<char> local_block(32U * 1024U);
+        std::vector<char> remote_block(local_block.size());
+        for (;;)
+        {
+            local_stream.read(&local_block[0], local_block.size());
+            remote_stream.read(&remote_block[0], remote_block.size());
+
+            if (local_stream.gcount() != remote_stream.gcount() ||
+                !std::equal(
+                    local_block.begin(),
+                    local_block.begin() + local_stream.gcount(),
+                    remote_block.begin()))
+            {
+                return false;
+            }
+
+            if (local_stream.gcount() == 0)
+            {
+                return true;
+            }
+        }
+    }
+
+}
+
+/**
+ * Makes a remote directory tree match a local one, sending only what
+ * differs.
+ *
+ * A file is sent if the remote copy is missing or differs in size or
+ * modification time; optionally, files that match on both are compared
+ * byte by byte as well.  Uploads run several at a time, each over its own
+ * SFTP channel, and each is written under a temporary name and renamed
+ * into place once complete, so that nothing reading the remote tree sees a
+ * partial file.  The remote copy is given the local file's modification
+ * time so the next run recognises it as unchanged.
+ *
+ * Large files that already exist remotely can instead be updated in place,
+ * sending only the blocks that changed; see `set_delta_threshold`.
+ *
+ * Where a path is a directory on one side and not on the other, the remote
+ * one is replaced.  Local entries other than files and directories,
+ * including symbolic links, are ignored.
+ */
+class tree_mirror
+{
+public:
+
+    /**
+     * The `sftp_filesystem` must outlive the mirror.
+     */
+    explicit tree_mirror(sftp_filesystem& filesystem)
+        :
+    m_filesystem(filesystem), m_width(4), m_dry_run(false),
+    m_delete_extraneous(false), m_compare_contents(false),
+    m_delta_threshold(0U), m_check_space(true) {}
+
+    /**
+     * Number of channels, and so of uploads and remote directory listings
+     * in flight at once.
+     */
+    tree_mirror& set_width(std::size_t channels)
+    {
+        m_width = channels;
+        return *this;
+    }
+
+    /**
+     * Work out and report what would be done, without changing anything.
+     */
+    tree_mirror& set_dry_run(bool dry_run)
+    {
+        m_dry_run = dry_run;
+        return *this;
+    }
+
+    /**
+     * Remove remote paths that have no local counterpart.
+     */
+    tree_mirror& set_delete_extraneous(bool delete_extraneous)
+    {
+        m_delete_extraneous = delete_extraneous;
+        return *this;
+    }
+
+    /**
+     * Compare the contents of files whose size and modification time
+     * match, in case the times cannot be trusted.
+     *
+     * Reads every such remote file in full so is much slower.
+     */
+    tree_mirror& set_compare_contents(bool compare_contents)
+    {
+        m_compare_contents = compare_contents;
+        return *this;
+    }
+
+    /**
+     * Update remote files of at least `bytes` in place, writing only the
+     * blocks that differ from the local file.
+     *
+     * The remote file is read in full to find the changes, so this pays
+     * off when sending is much slower than receiving, or when a large file
+     * changes only a little.  Updated files are not published atomically.
+     * Remote files their owner cannot write are always sent whole.  Zero,
+     * the default, always sends whole files.
+     */
+    tree_mirror& set_delta_threshold(boost::uintmax_t bytes)
+    {
+        m_delta_threshold = bytes;
+        return *this;
+    }
+
+    /**
+     * Refuse to start uploading if the remote filesystem reports too
+     * little space for the whole files to be sent.
+     *
+     * On by default.  Servers without the `statvfs@openssh.com` extension
+     * are not checked.  Nothing below the remote root is changed until the
+     * check has passed.  Each file is written beside its old copy before
+     * replacing it, so the space needed is the full size of every file
+     * sent whole; in-place updates are not counted.
+     */
+    tree_mirror& set_check_space(bool check_space)
+    {
+        m_check_space = check_space;
+        return *this;
+    }
+
+    /**
+     * Make the tree at `remote_root` match the one at `local_root`.
+     *
+     * Failures for individual paths are recorded in the report and do not
+     * stop the rest of the tree being mirrored.
+     *
+     * Files are given the read, write and execute bits of their local
+     * copies, whatever the server's umask.  Directories are created with
+     * the server's defaults.  Local symbolic links are skipped.  Whatever
+     * is at their paths in the remote tree, and below them, is left alone
+     * even when extraneous paths are being removed.
+     *
+     * @throws `boost::system::system_error` if either root cannot be
+     *         listed, the remote root cannot be created, there is not
+     *         enough remote space for the uploads or the deadline passes.
+     */
+    mirror_report mirror(
+        const boost::filesystem::path& local_root,
+        const boost::filesystem::path& remote_root,
+        const ::ssh::deadline& limit=::ssh::deadline())
+    {
+        mirror_report report;
+
+        detail::remote_index::index_type remote;
+        std::string remote_root_string = remote_root.string();
+        if (exists(m_filesystem, remote_root))
+        {
+            report.m_listing_errors = recursive_directory_walker(m_filesystem)
+                .set_width(m_width)
+                .walk(
+                    remote_root,
+                    detail::remote_index(remote_root_string, remote), limit);
+        }
+        else if (!m_dry_run)
+        {
+            m_filesystem.create_directories(remote_root, limit);
+        }
+
+        std::vector<std::pair<boost::filesystem::path, std::time_t> > files;
+        std::vector<unsigned long> file_permissions;
+        std::vector<std::size_t> file_entries;
+        std::vector<detail::preparation> preparations;
+        boost::uintmax_t space_needed = 0U;
+
+        // Remote directories whose contents go with them, so must not be
+        // removed again on their own
+        std::set<std::string> removed_directories;
+
+        std::string local_root_string = local_root.generic_string();
+        for (boost::filesystem::recursive_directory_iterator it(local_root);
+            it != boost::filesystem::recursive_directory_iterator(); ++it)
+        {
+            limit.check();
+
+            std::string relative = detail::relative_to(
+                local_root_string, it->path().generic_string());
+            boost::filesystem::path remote_path = remote_root / relative;
+
+            boost::optional<file_attributes> remote_attributes;
+            detail::remote_index::index_type::iterator match =
+                remote.find(relative);
+            if (match != remote.end())
+            {
+                remote_attributes = match->second;
+                remote.erase(match);
+            }
+
+            // Links would be followed by `status` but not descended into
+            // by the iterator, so a linked directory would look empty
+            boost::filesystem::file_status status = it->symlink_status();
+            if (boost::filesystem::is_symlink(status))
+            {
+                detail::forget_below(remote, relative);
+                continue;
+            }
+
+            if (boost::filesystem::is_directory(status))
+            {
+                if (remote_attributes &&
+                    remote_attributes->type() == file_attributes::directory)
+                {
+                    continue;
+                }
+
+                report.m_entries.push_back(
+                    mirror_entry(relative, mirror_action::create_directory));
+                preparations.push_back(
+                    detail::preparation(
+                        report.m_entries.size() - 1, remote_path,
+                        remote_attributes, true));
+            }
+            else if (boost::filesystem::is_regular_file(status))
+            {
+                boost::uintmax_t size = boost::filesystem::file_size(
+                    it->path());
+                std::time_t modified = boost::filesystem::last_write_time(
+                    it->path());
+
+                if (remote_attributes &&
+                    is_up_to_date(
+                        *remote_attributes, size, modified, it->path(),
+                        remote_path))
+                {
+                    report.m_entries.push_back(
+                        mirror_entry(relative, mirror_action::unchanged));
+                    continue;
+                }
+
+                report.m_entries.push_back(
+                    mirror_entry(
+                        relative,
+                        (is_delta_candidate(remote_attributes, size)) ?
+                            mirror_action::update : mirror_action::upload));
+                if (m_dry_run)
+                {
+                    report.m_entries.back().bytes = size;
+                }
+
+                if (remote_attributes &&
+                    remote_attributes->type() == file_attributes::directory)
+                {
+                    preparations.push_back(
+                        detail::preparation(
+                            report.m_entries.size() - 1, remote_path,
+                            remote_attributes, false));
+                    removed_directories.insert(relative);
+                }
+
+                if (report.m_entries.back().action == mirror_action::upload)
+                {
+                    space_needed += size;
+                }
+
+                files.push_back(std::make_pair(it->path(), modified));
+                file_permissions.push_back(
+                    static_cast<unsigned long>(
+                        status.permissions() &
+                        boost::filesystem::all_all));
+                file_entries.push_back(report.m_entries.size() - 1);
+            }
+        }
+
+        if (!m_dry_run)
+        {
+            if (m_check_space && !files.empty())
+            {
+                check_space(remote_root, space_needed, limit);
+            }
+
+            for (std::size_t i = 0; i < preparations.size(); ++i)
+            {
+                apply(report.m_entries[preparations[i].entry],
+                    preparations[i], limit);
+            }
+        }
+
+        if (!m_dry_run && !files.empty())
+        {
+            // Entries are only pointed at once the report stops growing
+            std::vector<detail::upload_job> jobs;
+            for (std::size_t i = 0; i < files.size(); ++i)
+            {
+                mirror_entry& entry = report.m_entries[file_entries[i]];
+                if (!entry.error)
+                {
+                    jobs.push_back(
+                        detail::upload_job(
+                            files[i].first, remote_root / entry.path,
+                            files[i].second, file_permissions[i], entry));
+                }
+            }
+
+            ::ssh::detail::sftp_pipeline pipeline(
+                m_filesystem.sftp_ref().session_ref(),
+                (std::min)(m_width, jobs.size()));
+            detail::upload_source source(jobs);
+            try
+            {
+                pipeline.run(source, limit);
+            }
+            catch (...)
+            {
+                m_filesystem.forget_attributes(remote_root);
+                m_filesystem.forget_resolved_paths();
+                throw;
+            }
+
+            // Renaming into place can replace links
+            m_filesystem.forget_attributes(remote_root);
+            m_filesystem.forget_resolved_paths();
+        }
+
+        if (m_delete_extraneous)
+        {
+            remove_extraneous(
+                remote, removed_directories, remote_root, report, limit);
+        }
+
+        return report;
+    }
+
+private:
+
+    void check_space(
+        const boost::filesystem::path& remote_root, boost::uintmax_t needed,
+        const ::ssh::deadline& limit)
+    {
+        // Without the extension the server cannot say
+        if (!m_filesystem.capabilities(limit).statvfs)
+        {
+            return;
+        }
+
+        space_info info = m_filesystem.space(remote_root, limit);
+        if (info.available < needed)
+        {
+            BOOST_THROW_EXCEPTION(
+                boost::system::system_error(
+                    boost::system::errc::make_error_code(
+                        boost::system::errc::no_space_on_device),
+                    remote_root.string()));
+        }
+    }
+
+    bool is_delta_candidate(
+        const boost::optional<file_attributes>& remote, boost::uintmax_t size)
+        const
+    {
+        // Files are uploaded with their local permissions, so a read-only
+        // local file leaves a remote copy that cannot be opened for writing
+        // and has to be replaced instead
+        return m_delta_threshold != 0U && size >= m_delta_threshold &&
+            remote && remote->type() == file_attributes::normal_file &&
+            remote->permissions() &&
+            (*remote->permissions() & LIBSSH2_SFTP_S_IWUSR);
+    }
+
+    bool is_up_to_date(
+        const file_attributes& remote, boost::uintmax_t size,
+        std::time_t modified, const boost::filesystem::path& local_path,
+        const boost::filesystem::path& remote_path)
+    {
+        if (remote.type() != file_attributes::normal_file ||
+            remote.size() != boost::optional<boost::uint64_t>(size) ||
+            remote.last_modified() !=
+                boost::optional<unsigned long>(modified))
+        {
+            return false;
+        }
+
+        return !m_compare_contents ||
+            detail::same_contents(m_filesystem, local_path, remote_path);
+    }
+
+    /**
+     * Carry out a preparation, recording any failure against its entry.
+     */
+    void apply(
+        mirror_entry& entry, const detail::preparation& preparation,
+        const ::ssh::deadline& limit)
+    {
+        try
+        {
+            if (preparation.existing)
+            {
+                m_filesystem.remove_all(
+                    preparation.remote, *preparation.existing, limit);
+            }
+
+            if (preparation.is_directory)
+            {
+                m_filesystem.create_directory(preparation.remote);
+            }
+        }
+        catch (const boost::system::system_error& e)
+        {
+            entry.error = e.code();
+        }
+    }
+
+    void remove_extraneous(
+        const detail::remote_index::index_type& remote,
+        std::set<std::string>& removed_directories,
+        const boost::filesystem::path& remote_root, mirror_report& report,
+        const ::ssh::deadline& limit)
+    {
+        // Sorting does not keep a directory's contents together, as `a.d`
+        // sorts between `a` and `a/x`, so each entry checks its ancestors
+        for (detail::remote_index::index_type::const_iterator it =
+                remote.begin();
+            it != remote.end(); ++it)
+        {
+            if (detail::is_below_any(removed_directories, it->first))
+            {
+                continue;
+            }
+
+            report.m_entries.push_back(
+                mirror_entry(it->first, mirror_action::remove));
+            if (it->second.type() == file_attributes::directory)
+            {
+                removed_directories.insert(it->first);
+            }
+
+            if (m_dry_run)
+            {
+                continue;
+            }
+
+            try
+            {
+                m_filesystem.remove_all(
+                    remote_root / it->first, it->second, limit);
+            }
+            catch (const boost::system::system_error& e)
+            {
+                report.m_entries.back().error = e.code();
+            }
+        }
+    }
+
+    sftp_filesystem& m_filesystem;
+    std::size_t m_width;
+    bool m_dry_run;
+    bool m_delete_extraneous;
+    bool m_compare_contents;
+    boost::uintmax_t m_delta_threshold;
+    bool m_check_space;
+};
+
+}} // namespace ssh::filesystem
+
+#endif
@@ -0,0 +1,596 @@
+/**
+    @file
+
+    Removing remote directory trees with many requests in flight.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the 
+    OpenSSL project's "OpenSSL" library (or with modified versions of it, 
+    with unchanged license). You may copy and distribute such a system 
+    following the terms of the GNU GPL for this program and the licenses 
+    of the other code concerned. The GNU General Public License gives 
+    permission to release a modified version without this exception; this 
+    exception also makes it possible to release a modified version which 
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_TREE_REMOVER_HPP
+#define SSH_TREE_REMOVER_HPP
+
+#include <ssh/deadline.hpp>
+#include <ssh/detail/sftp_channel_state.hpp>
+#include <ssh/detail/sftp_pipeline.hpp>
+#include <ssh/directory_walker.hpp> // is_type
+#include <ssh/filesystem.hpp> // sftp_filesystem, path_error, check_status
+#include <ssh/ssh_error.hpp> // SSH_DETAIL_THROW_API_ERROR_CODE_WITH_PATH
+
+#include <boost/cstdint.hpp> // uintmax_t
+#include <boost/filesystem/path.hpp> // path
+#include <boost/make_shared.hpp>
+#include <boost/ref.hpp> // ref
+#include <boost/shared_ptr.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/system/system_error.hpp>
+#include <boost/throw_exception.hpp> // BOOST_THROW_EXCEPTION
+
+#include <algorithm> // min
+#include <cassert> // assert
+#include <cstddef> // size_t
+#include <stdexcept> // logic_error
+#include <string>
+#include <utility> // pair
+#include <vector>
+
+#include <libssh2_sftp.h>
+
+namespace ssh {
+namespace filesystem {
+
+namespace detail {
+
+    /**
+     * Directory that is being emptied so that it can be removed.
+     */
+    struct removal_node
+    {
+        removal_node(
+            const boost::filesystem::path& path,
+            boost::shared_ptr<removal_node> parent)
+            :
+        path(path), parent(parent), outstanding(0U), listed(false),
+        failed(false) {}
+
+        boost::filesystem::path path;
+
+        /// Null for the root.
+        boost::shared_ptr<removal_node> parent;
+
+        /// Entries found in the directory that are not yet removed.
+        std::size_t outstanding;
+
+        bool listed;
+
+        /// Something below the directory could not be removed, so neither
+        /// can the directory.
+        bool failed;
+    };
+
+    class removal_state : public ::ssh::detail::pipeline_source
+    {
+    public:
+
+        typedef std::pair<
+            boost::filesystem::path, boost::shared_ptr<removal_node> >
+            file_job;
+
+        removal_state() : m_count(0U), m_root_error_api(NULL) {}
+
+        void push_directory(boost::shared_ptr<removal_node> directory)
+        {
+            m_directories.push_back(directory);
+        }
+
+        virtual boost::shared_ptr< ::ssh::detail::pipeline_task> next_task();
+
+        /**
+         * Take in an entry listed from the directory.
+         */
+        void add_entry(
+            boost::shared_ptr<removal_node> directory, const char* name,
+            std::size_t name_length, const LIBSSH2_SFTP_ATTRIBUTES& attributes)
+        {
+            std::string filename(name, name_length);
+            if (filename == "." || filename == "..")
+            {
+                return;
+            }
+
+            ++directory->outstanding;
+
+            // Links are unlinked like files, never followed
+            if (is_type(attributes, LIBSSH2_SFTP_S_IFDIR))
+            {
+                m_directories.push_back(
+                    boost::make_shared<removal_node>(
+                        directory->path / filename, directory));
+            }
+            else
+            {
+                m_files.push_back(
+                    file_job(directory->path / filename, directory));
+            }
+        }
+
+        void finish_listing(
+            boost::shared_ptr<removal_node> directory,
+            const boost::system::error_code& ec, const char* api_function)
+        {
+            // A directory that vanished while we listed it has nothing
+            // left to remove; removing it will quietly find it gone too
+            if (ec && ec != boost::system::errc::no_such_file_or_directory)
+            {
+                if (!directory->parent)
+                {
+                    m_root_error = ec;
+                    m_root_error_api = api_function;
+                }
+
+                m_errors.push_back(path_error(directory->path, ec));
+                directory->failed = true;
+            }
+
+            directory->listed = true;
+            settle(directory);
+        }
+
+        void file_removed(
+            const file_job& file, const boost::system::error_code& ec)
+        {
+            finish_child(file.second, record_removal(file.first, ec));
+        }
+
+        void directory_removed(
+            boost::shared_ptr<removal_node> directory,
+            const boost::system::error_code& ec)
+        {
+            bool removed = record_removal(directory->path, ec);
+
+            if (directory->parent)
+            {
+                finish_child(directory->parent, removed);
+            }
+        }
+
+        boost::uintmax_t count() const
+        {
+            return m_count;
+        }
+
+        std::vector<path_error>& errors()
+        {
+            return m_errors;
+        }
+
+        /**
+         * Why the root could not be listed, if it could not.
+         */
+        const boost::system::error_code& root_error() const
+        {
+            return m_root_error;
+        }
+
+        /// Name of the libssh2 call that failed for the root, if one did.
+        const char* root_error_api() const
+        {
+            return m_root_error_api;
+        }
+
+    private:
+
+        /// Once this many files are waiting to be removed, they take
+        /// priority over listing more directories, which bounds how many
+        /// paths are held in memory at once.
+        static const std::size_t file_backlog = 256U;
+
+        /**
+         * @returns whether the path is gone.
+         */
+        bool record_removal(
+            const boost::filesystem::path& path,
+            const boost::system::error_code& ec)
+        {
+            if (!ec)
+            {
+                ++m_count;
+            }
+            else if (ec == boost::system::errc::no_such_file_or_directory)
+            {
+                // Something else removed it before we could
+            }
+            else
+            {
+                m_errors.push_back(path_error(path, ec));
+                return false;
+            }
+
+            return true;
+        }
+
+        void finish_child(
+            boost::shared_ptr<removal_node> directory, bool removed)
+        {
+            assert(directory->outstanding > 0U);
+
+            --directory->outstanding;
+            if (!removed)
+            {
+                directory->failed = true;
+            }
+
+            settle(directory);
+        }
+
+        /**
+         * Queue a directory for removal once it is known to be empty.
+         */
+        void settle(boost::shared_ptr<removal_node> directory)
+        {
+            if (!directory->listed || directory->outstanding > 0U)
+            {
+                return;
+            }
+
+            if (!directory->failed)
+            {
+                m_empty_directories.push_back(directory);
+            }
+            else if (directory->parent)
+            {
+                // The error below is already recorded; the directories
+                // containing it are not reported as well
+                finish_child(directory->parent, false);
+            }
+        }
+
+        /// Used as a stack so directories are emptied depth-first, which
+        /// bounds how many wait at once.
+        std::vector<boost::shared_ptr<removal_node> > m_directories;
+        std::vector<file_job> m_files;
+        std::vector<boost::shared_ptr<removal_node> > m_empty_directories;
+
+        boost::uintmax_t m_count;
+        std::vector<path_error> m_errors;
+        boost::system::error_code m_root_error;
+        const char* m_root_error_api;
+    };
+
+    /**
+     * Lists a directory, queueing everything in it for removal.
+     */
+    class list_for_removal_task : public ::ssh::detail::pipeline_task
+    {
+    public:
+        list_for_removal_task(
+            boost::shared_ptr<removal_node> directory, removal_state& state)
+            :
+        m_directory(directory), m_path(directory->path.string()),
+        m_state(state), m_handle(NULL), m_stage(opening),
+        m_error_api(NULL) {}
+
+        virtual bool resume(::ssh::detail::sftp_channel_state& channel)
+        {
+            boost::system::error_code ec;
+
+            if (m_stage == opening)
+            {
+                m_handle = ::libssh2_sftp_open_ex(
+                    channel.sftp_ptr(), m_path.data(),
+                    static_cast<unsigned int>(m_path.size()), 0, 0,
+                    LIBSSH2_SFTP_OPENDIR);
+                if (!::ssh::detail::sftp_open_finished(m_handle, channel, ec))
+                {
+                    return false;
+                }
+
+                if (ec)
+                {
+                    m_state.finish_listing(
+                        m_directory, ec, "libssh2_sftp_open_ex");
+                    return true;
+                }
+
+                m_stage = reading;
+            }
+
+            while (m_stage == reading)
+            {
+                std::vector<char>& filename = channel.filename_buffer();
+                LIBSSH2_SFTP_ATTRIBUTES attributes = LIBSSH2_SFTP_ATTRIBUTES();
+
+                // The long entry is not asked for as only the type counts
+                int rc = ::libssh2_sftp_readdir_ex(
+                    m_handle, &filename[0], filename.size(), NULL, 0,
+                    &attributes);
+                if (!::ssh::detail::sftp_call_finished(rc, channel, ec))
+                {
+                    return false;
+                }
+
+                if (ec)
+                {
+                    m_error = ec;
+                    m_error_api = "libssh2_sftp_readdir_ex";
+                    m_stage = closing;
+                }
+                else if (rc == 0) // end of files
+                {
+                    m_stage = closing;
+                }
+                else
+                {
+                    m_state.add_entry(
+                        m_directory, &filename[0],
+                        (std::min)(static_cast<size_t>(rc), filename.size()),
+                        attributes);
+                }
+            }
+
+            // Errors closing are ignored as the listing is already complete
+            int rc = ::libssh2_sftp_close_handle(m_handle);
+            if (!::ssh::detail::sftp_call_finished(rc, channel, ec))
+            {
+                return false;
+            }
+
+            m_state.finish_listing(m_directory, m_error, m_error_api);
+            return true;
+        }
+
+    private:
+        enum stage { opening, reading, closing };
+
+        boost::shared_ptr<removal_node> m_directory;
+        std::string m_path;
+        removal_state& m_state;
+        LIBSSH2_SFTP_HANDLE* m_handle;
+        stage m_stage;
+        boost::system::error_code m_error;
+        const char* m_error_api;
+    };
+
+    class unlink_task : public ::ssh::detail::pipeline_task
+    {
+    public:
+        unlink_task(
+            const removal_state::file_job& file, removal_state& state)
+            : m_file(file), m_path(file.first.string()), m_state(state) {}
+
+        virtual bool resume(::ssh::detail::sftp_channel_state& channel)
+        {
+            boost::system::error_code ec;
+
+            int rc = ::libssh2_sftp_unlink_ex(
+                channel.sftp_ptr(), m_path.data(),
+                static_cast<unsigned int>(m_path.size()));
+            if (!::ssh::detail::sftp_call_finished(rc, channel, ec))
+            {
+                return false;
+            }
+
+            m_state.file_removed(m_file, ec);
+            return true;
+        }
+
+    private:
+        removal_state::file_job m_file;
+        std::string m_path;
+        removal_state& m_state;
+    };
+
+    class rmdir_task : public ::ssh::detail::pipeline_task
+    {
+    public:
+        rmdir_task(
+            boost::shared_ptr<removal_node> directory, removal_state& state)
+            :
+        m_directory(directory), m_path(directory->path.string()),
+        m_state(state) {}
+
+        virtual bool resume(::ssh::detail::sftp_channel_state& channel)
+        {
+            boost::system::error_code ec;
+
+            int rc = ::libssh2_sftp_rmdir_ex(
+                channel.sftp_ptr(), m_path.data(),
+                static_cast<unsigned int>(m_path.size()));
+            if (!::ssh::detail::sftp_call_finished(rc, channel, ec))
+            {
+                return false;
+            }
+
+            m_state.directory_removed(m_directory, ec);
+            return true;
+        }
+
+    private:
+        boost::shared_ptr<removal_node> m_directory;
+        std::string m_path;
+        removal_state& m_state;
+    };
+
+    inline boost::shared_ptr< ::ssh::detail::pipeline_task>
+    removal_state::next_task()
+    {
+        if (!m_empty_directories.empty())
+        {
+            boost::shared_ptr<removal_node> directory =
+                m_empty_directories.back();
+            m_empty_directories.pop_back();
+            return boost::make_shared<rmdir_task>(
+                directory, boost::ref(*this));
+        }
+        else if (!m_files.empty() &&
+            (m_directories.empty() || m_files.size() >= file_backlog))
+        {
+            file_job file = m_files.back();
+            m_files.pop_back();
+            return boost::make_shared<unlink_task>(file, boost::ref(*this));
+        }
+        else if (!m_directories.empty())
+        {
+            boost::shared_ptr<removal_node> directory = m_directories.back();
+            m_directories.pop_back();
+            return boost::make_shared<list_for_removal_task>(
+                directory, boost::ref(*this));
+        }
+        else
+        {
+            return boost::shared_ptr< ::ssh::detail::pipeline_task>();
+        }
+    }
+
+}
+
+/**
+ * Removes directory trees with many removals in flight at once.
+ *
+ * `sftp_filesystem::remove_all` removes one entry at a time, waiting a
+ * round trip for each.  The remover instead opens several SFTP channels
+ * and keeps a request going on each: listing a directory, unlinking a file
+ * or removing a directory that has been emptied.  Sibling directories are
+ * listed and emptied at the same time while the tree as a whole is
+ * still taken apart depth-first.
+ *
+ * Unlike `sftp_filesystem::remove_all`, failing to remove part of the tree
+ * does not stop the rest being removed.  The directories containing the
+ * failed path are left in place.
+ */
+class tree_remover
+{
+public:
+
+    /**
+     * The `sftp_filesystem` must outlive the remover.
+     */
+    explicit tree_remover(sftp_filesystem& filesystem)
+        : m_filesystem(filesystem), m_width(4) {}
+
+    /**
+     * Number of channels, and so of requests in flight at once.
+     *
+     * The server may allow fewer; the remover uses what it can get.
+     */
+    tree_remover& set_width(std::size_t channels)
+    {
+        m_width = channels;
+        return *this;
+    }
+
+    /**
+     * Remove a file and anything below it in the hierarchy.
+     *
+     * As with `sftp_filesystem::remove_all`, a symlink is removed rather
+     * than what it leads to.
+     *
+     * @param errors
+     *     Receives the paths below `target` that could not be removed, and
+     *     why.
+     * @returns the number of files removed.
+     * @throws `boost::system::system_error` if `target` cannot be statted,
+     *         or listed if it is a directory, or if the deadline passes.  On
+     *         a deadline, whatever has not yet been reached is left in
+     *         place.
+     */
+    boost::uintmax_t remove_all(
+        const boost::filesystem::path& target,
+        std::vector<path_error>& errors,
+        const ::ssh::deadline& limit=::ssh::deadline())
+    {
+        switch (detail::check_status(m_filesystem, target, limit))
+        {
+        case detail::path_status::non_existent:
+            return 0U;
+
+        case detail::path_status::directory:
+            return remove_directory(target, errors, limit);
+
+        case detail::path_status::non_directory:
+            // This includes 'unknown' file type.  What's the alternative?
+            return (m_filesystem.remove_one_file(target, limit)) ? 1U : 0U;
+
+        default:
+            assert(false);
+            BOOST_THROW_EXCEPTION(std::logic_error("Unknown path status"));
+            return 0U;
+        }
+    }
+
+private:
+
+    boost::uintmax_t remove_directory(
+        const boost::filesystem::path& root, std::vector<path_error>& errors,
+        const ::ssh::deadline& limit)
+    {
+        detail::removal_state state;
+        state.push_directory(
+            boost::make_shared<detail::removal_node>(
+                root, boost::shared_ptr<detail::removal_node>()));
+
+        ::ssh::detail::sftp_pipeline pipeline(
+            m_filesystem.sftp_ref().session_ref(), m_width);
+        try
+        {
+            pipeline.run(state, limit);
+        }
+        catch (...)
+        {
+            m_filesystem.forget_attributes(root);
+            m_filesystem.forget_resolved_paths();
+            throw;
+        }
+
+        m_filesystem.forget_attributes(root);
+        m_filesystem.forget_resolved_paths();
+
+        if (state.root_error())
+        {
+            std::string root_string = root.string();
+            SSH_DETAIL_THROW_API_ERROR_CODE_WITH_PATH(
+                state.root_error(), state.root_error().message(),
+                state.root_error_api(), root_string.data(),
+                root_string.size());
+        }
+
+        errors.insert(
+            errors.end(), state.errors().begin(), state.errors().end());
+
+        return state.count();
+    }
+
+    sftp_filesystem& m_filesystem;
+    std::size_t m_width;
+};
+
+}} // namespace ssh::filesystem
+
+#endif
@@ -0,0 +1,702 @@
+/**
+    @file
+
+    Snapshots of remote directory trees and the changes between them.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the 
+    OpenSSL project's "OpenSSL" library (or with modified versions of it, 
+    with unchanged license). You may copy and distribute such a system 
+    following the terms of the GNU GPL for this program and the licenses 
+    of the other code concerned. The GNU General Public License gives 
+    permission to release a modified version without this exception; this 
+    exception also makes it possible to release a modified version which 
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_TREE_SNAPSHOT_HPP
+#define SSH_TREE_SNAPSHOT_HPP
+
+#include <ssh/deadline.hpp>
+#include <ssh/directory_walker.hpp> // recursive_directory_walker, relative_to
+#include <ssh/filesystem.hpp> // sftp_filesystem, path_error
+
+#include <boost/cstdint.hpp> // uint32_t, uint64_t
+#include <boost/filesystem/path.hpp> // path
+#include <boost/system/error_code.hpp>
+#include <boost/system/system_error.hpp>
+#include <boost/throw_exception.hpp> // BOOST_THROW_EXCEPTION
+
+#include <algorithm> // sort
+#include <cstddef> // size_t
+#include <map>
+#include <set>
+#include <string>
+#include <utility> // pair
+#include <vector>
+
+#include <libssh2_sftp.h>
+
+namespace ssh {
+namespace filesystem {
+
+namespace detail {
+
+    /**
+     * 64-bit FNV-1a.
+     */
+    inline boost::uint64_t name_hash(const char* name, std::size_t length)
+    {
+        boost::uint64_t hash = 14695981039346656037ULL;
+        for (std::size_t i = 0; i < length; ++i)
+        {
+            hash ^= static_cast<unsigned char>(name[i]);
+            hash *= 1099511628211ULL;
+        }
+
+        return hash;
+    }
+
+    /**
+     * What a snapshot keeps of one directory entry.
+     */
+    struct snapshot_entry
+    {
+        boost::uint64_t hash;
+        boost::uint64_t size;
+        unsigned long mtime;
+        unsigned long mode;
+
+        /// Where the name is in the directory's name pool.
+        boost::uint32_t name_offset;
+        boost::uint32_t name_length;
+
+        bool is_directory() const
+        {
+            return (mode & LIBSSH2_SFTP_S_IFMT) == LIBSSH2_SFTP_S_IFDIR;
+        }
+
+        /**
+         * Has the entry changed, as far as its attributes can tell?
+         *
+         * A directory's size and time change with its contents, which are
+         * compared separately, so only its mode counts.
+         */
+        bool differs_from(const snapshot_entry& other) const
+        {
+            if (mode != other.mode)
+            {
+                return true;
+            }
+
+            return !is_directory() &&
+                (size != other.size || mtime != other.mtime);
+        }
+    };
+
+    /**
+     * Entries of one directory, sorted by name hash, with their names
+     * packed into a single string.
+     */
+    class snapshot_directory
+    {
+    public:
+        snapshot_directory() : mtime(0U) {}
+
+        void add(
+            const char* name, std::size_t name_length,
+            boost::uint64_t size, unsigned long mtime, unsigned long mode)
+        {
+            snapshot_entry entry;
+            entry.hash = name_hash(name, name_length);
+            entry.size = size;
+            entry.mtime = mtime;
+            entry.mode = mode;
+            entry.name_offset = static_cast<boost::uint32_t>(names.size());
+            entry.name_length = static_cast<boost::uint32_t>(name_length);
+
+            names.append(name, name_length);
+            entries.push_back(entry);
+        }
+
+        void sort()
+        {
+            std::sort(entries.begin(), entries.end(), entry_order(*this));
+        }
+
+        std::string name(const snapshot_entry& entry) const
+        {
+            return names.substr(entry.name_offset, entry.name_length);
+        }
+
+        /**
+         * Orders entries by hash and, for the rare names that share one,
+         * by name.
+         */
+        int compare(
+            const snapshot_entry& entry, const snapshot_directory& other,
+            const snapshot_entry& other_entry) const
+        {
+            if (entry.hash != other_entry.hash)
+            {
+                return (entry.hash < other_entry.hash) ? -1 : 1;
+            }
+
+            return names.compare(
+                entry.name_offset, entry.name_length, other.names,
+                other_entry.name_offset, other_entry.name_length);
+        }
+
+        unsigned long mtime;
+        std::string names;
+        std::vector<snapshot_entry> entries;
+
+    private:
+        struct entry_order
+        {
+            explicit entry_order(const snapshot_directory& directory)
+                : directory(&directory) {}
+
+            bool operator()(
+                const snapshot_entry& a, const snapshot_entry& b) const
+            {
+                return directory->compare(a, *directory, b) < 0;
+            }
+
+            const snapshot_directory* directory;
+        };
+    };
+
+    typedef std::map<std::string, snapshot_directory> snapshot_index;
+
+    inline std::string child_key(
+        const std::string& parent, const std::string& name)
+    {
+        return (parent.empty()) ? name : parent + "/" + name;
+    }
+
+    /**
+     * Visitor filing each walked entry under its directory.
+     */
+    class snapshot_builder
+    {
+    public:
+        snapshot_builder(const std::string& root, snapshot_index& index)
+            : m_root(root), m_index(&index) {}
+
+        void operator()(const sftp_file& file, std::size_t)
+        {
+            std::string key = relative_to(m_root, file.path().string());
+            std::string::size_type slash = key.rfind('/');
+            std::string parent = (slash == std::string::npos) ?
+                std::string() : key.substr(0, slash);
+            std::string name = key.substr(
+                (slash == std::string::npos) ? 0 : slash + 1);
+
+            file_attributes attributes = file.attributes();
+            unsigned long mtime = attributes.last_modified().get_value_or(0U);
+
+            (*m_index)[parent].add(
+                name.data(), name.size(), attributes.size().get_value_or(0U),
+                mtime, attributes.permissions().get_value_or(0U));
+
+            if (attributes.type() == file_attributes::directory)
+            {
+                (*m_index)[key].mtime = mtime;
+            }
+        }
+
+    private:
+        std::string m_root;
+        snapshot_index* m_index;
+    };
+
+}
+
+/**
+ * Paths that differ between two snapshots.
+ */
+struct snapshot_changes
+{
+    std::vector<boost::filesystem::path> created;
+
+    /// Entries whose size, modification time or mode changed; for
+    /// directories, only the mode.
+    std::vector<boost::filesystem::path> modified;
+
+    std::vector<boost::filesystem::path> deleted;
+
+    bool empty() const
+    {
+        return created.empty() && modified.empty() && deleted.empty();
+    }
+};
+
+/**
+ * Compact record of every entry in a remote tree: the hash of its name, its
+ * size, modification time and mode, grouped by directory.
+ *
+ * Taken by `snapshot_scanner` and compared with `compare_snapshots`.
+ */
+class tree_snapshot
+{
+public:
+
+    const boost::filesystem::path& root() const
+    {
+        return m_root;
+    }
+
+    /**
+     * Number of entries recorded, not counting the root.
+     */
+    std::size_t size() const
+    {
+        std::size_t total = 0U;
+        for (detail::snapshot_index::const_iterator it =
+                m_directories.begin();
+            it != m_directories.end(); ++it)
+        {
+            total += it->second.entries.size();
+        }
+
+        return total;
+    }
+
+    /**
+     * Directories that could not be listed, so whose contents are unknown.
+     *
+     * They are left out of comparisons and listed again by the next
+     * rescan.
+     */
+    const std::vector<path_error>& errors() const
+    {
+        return m_errors;
+    }
+
+private:
+    friend class snapshot_scanner;
+    friend snapshot_changes compare_snapshots(
+        const tree_snapshot& before, const tree_snapshot& after);
+
+    boost::filesystem::path path_of(const std::string& key) const
+    {
+        return (key.empty()) ? m_root : m_root / key;
+    }
+
+    bool is_unlisted(const std::string& key) const
+    {
+        return m_unlisted.find(key) != m_unlisted.end();
+    }
+
+    void add_error(const std::string& key, const boost::system::error_code& ec)
+    {
+        m_unlisted.insert(key);
+        m_errors.push_back(path_error(path_of(key), ec));
+    }
+
+    boost::filesystem::path m_root;
+
+    /// Keyed by path relative to the root; the root's key is empty.
+    detail::snapshot_index m_directories;
+
+    std::set<std::string> m_unlisted;
+    std::vector<path_error> m_errors;
+};
+
+namespace detail {
+
+    inline void add_all(
+        const std::string& key,
+        const snapshot_directory& directory,
+        std::vector<boost::filesystem::path>& paths,
+        const boost::filesystem::path& root)
+    {
+        for (std::size_t i = 0; i < directory.entries.size(); ++i)
+        {
+            paths.push_back(
+                root / child_key(key, directory.name(directory.entries[i])));
+        }
+    }
+
+}
+
+/**
+ * What was created, modified and deleted between two snapshots of the same
+ * tree.
+ *
+ * Both are compared directory by directory, and within a directory by name
+ * hash, so the cost is linear in the number of entries.  Directories that
+ * either snapshot could not list are skipped.
+ */
+inline snapshot_changes compare_snapshots(
+    const tree_snapshot& before, const tree_snapshot& after)
+{
+    typedef detail::snapshot_index::const_iterator iterator;
+
+    snapshot_changes changes;
+    const boost::filesystem::path& root = after.root();
+
+    iterator old_directory = before.m_directories.begin();
+    iterator new_directory = after.m_directories.begin();
+    while (old_directory != before.m_directories.end() ||
+        new_directory != after.m_directories.end())
+    {
+        bool has_old = old_directory != before.m_directories.end();
+        bool has_new = new_directory != after.m_directories.end();
+
+        if (has_old &&
+            (!has_new || old_directory->first < new_directory->first))
+        {
+            if (!before.is_unlisted(old_directory->first) &&
+                !after.is_unlisted(old_directory->first))
+            {
+                detail::add_all(
+                    old_directory->first, old_directory->second,
+                    changes.deleted, root);
+            }
+            ++old_directory;
+            continue;
+        }
+
+        if (!has_old || new_directory->first < old_directory->first)
+        {
+            if (!before.is_unlisted(new_directory->first) &&
+                !after.is_unlisted(new_directory->first))
+            {
+                detail::add_all(
+                    new_directory->first, new_directory->second,
+                    changes.created, root);
+            }
+            ++new_directory;
+            continue;
+        }
+
+        const std::string& key = new_directory->first;
+        if (!before.is_unlisted(key) && !after.is_unlisted(key))
+        {
+            const detail::snapshot_directory& old_entries =
+                old_directory->second;
+            const detail::snapshot_directory& new_entries =
+                new_directory->second;
+
+            std::size_t i = 0;
+            std::size_t j = 0;
+            while (i < old_entries.entries.size() ||
+                j < new_entries.entries.size())
+            {
+                int order = 0;
+                if (i == old_entries.entries.size())
+                {
+                    order = 1;
+                }
+                else if (j == new_entries.entries.size())
+                {
+                    order = -1;
+                }
+                else
+                {
+                    order = old_entries.compare(
+                        old_entries.entries[i], new_entries,
+                        new_entries.entries[j]);
+                }
+
+                if (order < 0)
+                {
+                    changes.deleted.push_back(
+                        root / detail::child_key(
+                            key, old_entries.name(old_entries.entries[i])));
+                    ++i;
+                }
+                else if (order > 0)
+                {
+                    changes.created.push_back(
+                        root / detail::child_key(
+                            key, new_entries.name(new_entries.entries[j])));
+                    ++j;
+                }
+                else
+                {
+                    if (new_entries.entries[j].differs_from(
+                            old_entries.entries[i]))
+                    {
+                        changes.modified.push_back(
+                            root / detail::child_key(
+                                key,
+                                new_entries.name(new_entries.entries[j])));
+                    }
+                    ++i;
+                    ++j;
+                }
+            }
+        }
+
+        ++old_directory;
+        ++new_directory;
+    }
+
+    return changes;
+}
+
+/**
+ * Takes snapshots of remote trees, either in full or by bringing an earlier
+ * snapshot up to date.
+ */
+class snapshot_scanner
+{
+public:
+
+    /**
+     * The `sftp_filesystem` must outlive the scanner.
+     */
+    explicit snapshot_scanner(sftp_filesystem& filesystem)
+        : m_filesystem(filesystem), m_width(4) {}
+
+    /**
+     * Number of channels, and so of directories listed or statted at once,
+     * used by a full scan.
+     */
+    snapshot_scanner& set_width(std::size_t channels)
+    {
+        m_width = channels;
+        return *this;
+    }
+
+    /**
+     * Record every entry below `root`.
+     *
+     * The tree is listed with a `recursive_directory_walker`; the attributes
+     * come from the listings so nothing is statted.
+     *
+     * @throws `boost::system::system_error` if `root` cannot be listed or
+     *         the deadline passes.
+     */
+    tree_snapshot scan(
+        const boost::filesystem::path& root,
+        const ::ssh::deadline& limit=::ssh::deadline())
+    {
+        tree_snapshot snapshot;
+        snapshot.m_root = root;
+        snapshot.m_directories[std::string()].mtime = m_filesystem.attributes(
+            root, true, limit).last_modified().get_value_or(0U);
+
+        std::vector<path_error> errors = recursive_directory_walker(
+            m_filesystem)
+            .set_width(m_width)
+            .walk(
+                root,
+                detail::snapshot_builder(root.string(), snapshot.m_directories),
+                limit);
+
+        for (std::size_t i = 0; i < errors.size(); ++i)
+        {
+            snapshot.add_error(
+                detail::relative_to(root.string(), errors[i].first.string()),
+                errors[i].second);
+        }
+
+        sort_all(snapshot);
+        return snapshot;
+    }
+
+    /**
+     * Bring `previous` up to date, listing again only the directories whose
+     * modification time has changed.
+     *
+     * Every directory in `previous` is statted, many at a time, to read its
+     * modification time, and only those that changed, are new or could not
+     * be listed before are listed.  Creating, deleting or renaming an entry
+     * changes the time of the directory holding it, but changing a file's
+     * contents in place does not: such changes are only noticed if
+     * something else in the same directory changed too.  Nor are changes
+     * noticed that land in the same second as the directory was last
+     * listed, as SFTP times are in whole seconds.  Take a full `scan` from
+     * time to time where that matters.
+     *
+     * Any attributes the filesystem has cached for the tree are forgotten
+     * first.
+     *
+     * @throws `boost::system::system_error` if the root is no longer a
+     *         directory or the deadline passes.
+     */
+    tree_snapshot rescan(
+        const tree_snapshot& previous,
+        const ::ssh::deadline& limit=::ssh::deadline())
+    {
+        typedef detail::snapshot_index::const_iterator iterator;
+
+        tree_snapshot snapshot;
+        snapshot.m_root = previous.m_root;
+
+        // The times must come from the server, not from a cache that may
+        // predate the changes we are looking for
+        m_filesystem.forget_attributes(previous.m_root);
+
+        file_attributes root_attributes = m_filesystem.attributes(
+            previous.m_root, true, limit);
+        if (root_attributes.type() != file_attributes::directory)
+        {
+            BOOST_THROW_EXCEPTION(
+                boost::system::system_error(
+                    boost::system::errc::make_error_code(
+                        boost::system::errc::not_a_directory),
+                    previous.m_root.string()));
+        }
+
+        std::vector<std::string> keys;
+        std::vector<boost::filesystem::path> paths;
+        for (iterator it = previous.m_directories.begin();
+            it != previous.m_directories.end(); ++it)
+        {
+            if (!it->first.empty())
+            {
+                keys.push_back(it->first);
+                paths.push_back(previous.path_of(it->first));
+            }
+        }
+
+        std::vector<attributes_result> stats =
+            m_filesystem.attributes(paths, false, limit);
+
+        std::vector<std::pair<std::string, unsigned long> > to_list;
+        std::set<std::string> queued;
+
+        keep_or_queue(
+            previous, std::string(),
+            root_attributes.last_modified().get_value_or(0U), snapshot,
+            to_list, queued);
+
+        for (std::size_t i = 0; i < keys.size(); ++i)
+        {
+            // Gone, or replaced by something else, so left out; the change
+            // shows up in the listing of its parent, whose time changed
+            if (stats[i].first &&
+                stats[i].first->type() == file_attributes::directory)
+            {
+                keep_or_queue(
+                    previous, keys[i],
+                    stats[i].first->last_modified().get_value_or(0U),
+                    snapshot, to_list, queued);
+            }
+        }
+
+        while (!to_list.empty())
+        {
+            std::pair<std::string, unsigned long> next = to_list.back();
+            to_list.pop_back();
+
+            list(next.first, next.second, snapshot, to_list, queued, limit);
+        }
+
+        return snapshot;
+    }
+
+private:
+
+    void keep_or_queue(
+        const tree_snapshot& previous, const std::string& key,
+        unsigned long mtime, tree_snapshot& snapshot,
+        std::vector<std::pair<std::string, unsigned long> >& to_list,
+        std::set<std::string>& queued)
+    {
+        detail::snapshot_index::const_iterator old =
+            previous.m_directories.find(key);
+
+        if (old != previous.m_directories.end() && old->second.mtime == mtime &&
+            !previous.is_unlisted(key))
+        {
+            snapshot.m_directories[key] = old->second;
+        }
+        else
+        {
+            queued.insert(key);
+            to_list.push_back(std::make_pair(key, mtime));
+        }
+    }
+
+    void list(
+        const std::string& key, unsigned long mtime, tree_snapshot& snapshot,
+        std::vector<std::pair<std::string, unsigned long> >& to_list,
+        std::set<std::string>& queued, const ::ssh::deadline& limit)
+    {
+        detail::snapshot_directory& directory = snapshot.m_directories[key];
+        directory.mtime = mtime;
+
+        directory_listing listing;
+        try
+        {
+            listing = m_filesystem.list_directory(
+                snapshot.path_of(key), false, limit);
+        }
+        catch (const boost::system::system_error& e)
+        {
+            limit.check();
+            snapshot.add_error(key, e.code());
+            return;
+        }
+
+        for (std::size_t i = 0; i < listing.size(); ++i)
+        {
+            directory_listing::string_view name = listing.name(i);
+            std::string filename(name.begin(), name.end());
+            if (filename == "." || filename == "..")
+            {
+                continue;
+            }
+
+            directory.add(
+                filename.data(), filename.size(), listing.sizes()[i],
+                listing.last_modified_times()[i], listing.modes()[i]);
+
+            std::string child = detail::child_key(key, filename);
+            if ((listing.modes()[i] & LIBSSH2_SFTP_S_IFMT) ==
+                    LIBSSH2_SFTP_S_IFDIR &&
+                snapshot.m_directories.find(child) ==
+                    snapshot.m_directories.end() &&
+                queued.insert(child).second)
+            {
+                to_list.push_back(
+                    std::make_pair(child, listing.last_modified_times()[i]));
+            }
+        }
+
+        directory.sort();
+    }
+
+    static void sort_all(tree_snapshot& snapshot)
+    {
+        for (detail::snapshot_index::iterator it =
+                snapshot.m_directories.begin();
+            it != snapshot.m_directories.end(); ++it)
+        {
+            it->second.sort();
+        }
+    }
+
+    sftp_filesystem& m_filesystem;
+    std::size_t m_width;
+};
+
+}} // namespace ssh::filesystem
+
+#endif
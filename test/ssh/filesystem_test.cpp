@@ -37,13 +37,25 @@
 #include "sandbox_fixture.hpp" // sandbox_fixture
 #include "session_fixture.hpp" // session_fixture
 
+#include <ssh/deadline.hpp> // test subject
+#include <ssh/detail/libssh2/userauth.hpp>
+#include <ssh/detail/session_state.hpp>
+#include <ssh/detail/sftp_pipeline.hpp>
+#include <ssh/directory_walker.hpp> // test subject
 #include <ssh/filesystem.hpp> // test subject
+#include <ssh/sync_batch.hpp> // test subject
+#include <ssh/tree_mirror.hpp> // test subject
+#include <ssh/tree_remover.hpp> // test subject
+#include <ssh/tree_snapshot.hpp> // test subject
 
 #include <boost/bind.hpp> // bind
 #include <boost/cstdint.hpp> // uintmax_t
+#include <boost/date_time/posix_time/posix_time_types.hpp> // seconds
 #include <boost/filesystem/fstream.hpp> // ofstream
 #include <boost/foreach.hpp> // BOOST_FOREACH
+#include <boost/lexical_cast.hpp>
 #include <boost/move/move.hpp>
+#include <boost/ref.hpp> // ref
 #include <boost/system/system_error.hpp>
 #include <boost/test/predicate_result.hpp>
 #include <boost/test/unit_test.hpp>
@@ -51,20 +63,53 @@
 #include <boost/thread/thread.hpp>
 
 #include <algorithm> // find
+#include <iterator> // istreambuf_iterator
 #include <string>
+#include <vector>
 
+using ssh::cancellation_token;
+using ssh::deadline;
+using ssh::detail::session_state;
+using ssh::detail::sftp_pipeline;
 using ssh::session;
+using ssh::filesystem::attributes_result;
 using ssh::filesystem::file_attributes;
+using ssh::filesystem::listing_order;
+using ssh::filesystem::glob;
+using ssh::filesystem::mirror_action;
+using ssh::filesystem::mirror_entry;
+using ssh::filesystem::mirror_report;
 using ssh::filesystem::sftp_filesystem;
 using ssh::filesystem::sftp_file;
+using ssh::filesystem::sftp_options;
+using ssh::filesystem::snapshot_changes;
+using ssh::filesystem::snapshot_scanner;
+using ssh::filesystem::space_info;
+using ssh::filesystem::directory_entry;
 using ssh::filesystem::directory_iterator;
+using ssh::filesystem::directory_listing;
+using ssh::filesystem::directory_page;
+using ssh::filesystem::directory_reader;
+using ssh::filesystem::directory_usage;
+using ssh::filesystem::disk_usage_options;
 using ssh::filesystem::overwrite_behaviour;
+using ssh::filesystem::path_error;
+using ssh::filesystem::recursive_directory_walker;
+using ssh::filesystem::server_capabilities;
+using ssh::filesystem::symlink_policy;
+using ssh::filesystem::sync_batch;
+using ssh::filesystem::tree_mirror;
+using ssh::filesystem::tree_remover;
+using ssh::filesystem::tree_snapshot;
+using ssh::filesystem::detail::upload_job;
+using ssh::filesystem::detail::upload_source;
 
 using boost::bind;
 using boost::filesystem::ofstream;
 using boost::filesystem::path;
 using boost::move;
 using boost::packaged_task;
+using boost::posix_time::seconds;
 using boost::system::system_error;
 using boost::test_tools::predicate_result;
 using boost::thread;
@@ -76,6 +121,7 @@ using test::ssh::session_fixture;
 using std::auto_ptr;
 using std::find;
 using std::string;
+using std::vector;
 
 namespace {
 
@@ -267,6 +313,327 @@ BOOST_FIXTURE_TEST_CASE(
     boost::swap(t, s);
 }
 
+BOOST_FIXTURE_TEST_CASE( enlarged_window, basic_sftp_fixture )
+{
+    session& s = test_session();
+    s.authenticate_by_key_files(
+        user(), public_key_path(), private_key_path(), "");
+
+    sftp_filesystem fs = s.connect_to_filesystem(
+        sftp_options().set_window_size(16 * 1024 * 1024));
+
+    BOOST_CHECK_GE(fs.receive_window(), 16UL * 1024 * 1024);
+    BOOST_CHECK(!fs.round_trip());
+    BOOST_CHECK(directory_is_empty(fs, to_remote_path(sandbox())));
+}
+
+BOOST_FIXTURE_TEST_CASE( auto_tuned_window, basic_sftp_fixture )
+{
+    session& s = test_session();
+    s.authenticate_by_key_files(
+        user(), public_key_path(), private_key_path(), "");
+
+    sftp_filesystem default_fs = s.connect_to_filesystem();
+    unsigned long default_window = default_fs.receive_window();
+
+    // Absurd bandwidth so that even a loopback round trip outgrows the
+    // default window
+    sftp_filesystem fs = s.connect_to_filesystem(
+        sftp_options().auto_tune_window(1000000000000000U));
+
+    BOOST_REQUIRE(fs.round_trip());
+    BOOST_CHECK_GE(fs.receive_window(), default_window);
+    BOOST_CHECK(directory_is_empty(fs, to_remote_path(sandbox())));
+}
+
+namespace {
+
+    class cached_sftp_fixture : public basic_sftp_fixture
+    {
+    public:
+
+        sftp_filesystem connect(const sftp_options& options)
+        {
+            session& s = test_session();
+            s.authenticate_by_key_files(
+                user(), public_key_path(), private_key_path(), "");
+
+            return s.connect_to_filesystem(options);
+        }
+    };
+
+}
+
+BOOST_FIXTURE_TEST_CASE( cached_attributes_outlive_remote_change,
+                         cached_sftp_fixture )
+{
+    sftp_filesystem fs = connect(sftp_options().cache_attributes(seconds(300)));
+
+    path target = new_file_in_sandbox();
+    BOOST_CHECK(exists(fs, to_remote_path(target)));
+
+    // Removed behind the filesystem's back so it cannot know
+    boost::filesystem::remove(target);
+    BOOST_CHECK(exists(fs, to_remote_path(target)));
+
+    fs.forget_attributes(to_remote_path(sandbox()));
+    BOOST_CHECK(!exists(fs, to_remote_path(target)));
+}
+
+BOOST_FIXTURE_TEST_CASE( cached_attributes_forgotten_by_own_changes,
+                         cached_sftp_fixture )
+{
+    sftp_filesystem fs = connect(sftp_options().cache_attributes(seconds(300)));
+
+    path target = sandbox() / "bob";
+    BOOST_CHECK(!exists(fs, to_remote_path(target)));
+
+    BOOST_CHECK(fs.create_directory(to_remote_path(target)));
+    BOOST_CHECK(exists(fs, to_remote_path(target)));
+    BOOST_CHECK(
+        fs.attributes(to_remote_path(target), false).type() ==
+        file_attributes::directory);
+
+    fs.rename(to_remote_path(target), to_remote_path(sandbox() / "sally"));
+    BOOST_CHECK(!exists(fs, to_remote_path(target)));
+    BOOST_CHECK(exists(fs, to_remote_path(sandbox() / "sally")));
+
+    BOOST_CHECK(fs.remove(to_remote_path(sandbox() / "sally")));
+    BOOST_CHECK(!exists(fs, to_remote_path(sandbox() / "sally")));
+}
+
+BOOST_FIXTURE_TEST_CASE( cached_attributes_from_listing, cached_sftp_fixture )
+{
+    sftp_filesystem fs = connect(sftp_options().cache_attributes(seconds(300)));
+
+    path target = new_file_in_sandbox();
+
+    for (directory_iterator it = fs.directory_iterator(
+            to_remote_path(sandbox()));
+        it != fs.directory_iterator(); ++it) {}
+
+    boost::filesystem::remove(target);
+    BOOST_CHECK(exists(fs, to_remote_path(target)));
+}
+
+BOOST_FIXTURE_TEST_CASE( cached_attributes_expire, cached_sftp_fixture )
+{
+    sftp_filesystem fs = connect(sftp_options().cache_attributes(seconds(0)));
+
+    path target = new_file_in_sandbox();
+    BOOST_CHECK(exists(fs, to_remote_path(target)));
+
+    boost::filesystem::remove(target);
+    BOOST_CHECK(!exists(fs, to_remote_path(target)));
+}
+
+BOOST_FIXTURE_TEST_CASE( cached_attributes_bounded, cached_sftp_fixture )
+{
+    sftp_filesystem fs = connect(
+        sftp_options().cache_attributes(seconds(300), 1U));
+
+    path first = new_file_in_sandbox();
+    path second = new_file_in_sandbox();
+    BOOST_CHECK(exists(fs, to_remote_path(first)));
+    BOOST_CHECK(exists(fs, to_remote_path(second)));
+
+    boost::filesystem::remove(first);
+    boost::filesystem::remove(second);
+
+    // Remembering the second file pushed the first out
+    BOOST_CHECK(!exists(fs, to_remote_path(first)));
+}
+
+BOOST_FIXTURE_TEST_CASE( cached_missing_file_single_entry,
+                         cached_sftp_fixture )
+{
+    sftp_filesystem fs = connect(
+        sftp_options().cache_attributes(seconds(300), 1U));
+
+    path target = sandbox() / "bob";
+    BOOST_CHECK(!exists(fs, to_remote_path(target)));
+
+    // Created behind the filesystem's back so it cannot know
+    boost::filesystem::ofstream(target).close();
+
+    // One entry answers both with and without following links
+    BOOST_CHECK(!exists(fs, to_remote_path(target)));
+    BOOST_CHECK_THROW(
+        fs.attributes(to_remote_path(target), true),
+        boost::system::system_error);
+}
+
+BOOST_FIXTURE_TEST_CASE( cached_directories_outlive_remote_removal,
+                         cached_sftp_fixture )
+{
+    sftp_filesystem fs = connect(sftp_options().cache_attributes(seconds(300)));
+
+    path target = sandbox() / "a";
+    BOOST_CHECK(fs.create_directories(to_remote_path(target)));
+
+    // Removed behind the filesystem's back so it cannot know
+    boost::filesystem::remove(target);
+    BOOST_CHECK(!fs.create_directories(to_remote_path(target)));
+
+    fs.forget_attributes(to_remote_path(target));
+    BOOST_CHECK(fs.create_directories(to_remote_path(target)));
+    BOOST_CHECK(is_directory(target));
+}
+
+BOOST_FIXTURE_TEST_CASE( cached_directories_forgotten_by_trailing_slash,
+                         cached_sftp_fixture )
+{
+    sftp_filesystem fs = connect(sftp_options().cache_attributes(seconds(300)));
+
+    path target = sandbox() / "a";
+    BOOST_CHECK(fs.create_directories(to_remote_path(target)));
+
+    fs.remove_all(path(to_remote_path(target).string() + "/"));
+
+    BOOST_CHECK(fs.create_directories(to_remote_path(target)));
+    BOOST_CHECK(is_directory(target));
+}
+
+BOOST_FIXTURE_TEST_CASE( cached_attributes_forgotten_by_any_spelling,
+                         cached_sftp_fixture )
+{
+    sftp_filesystem fs = connect(sftp_options().cache_attributes(seconds(300)));
+
+    std::string directory = to_remote_path(sandbox()).string();
+    const char* spellings[] = { "", "/", "/./" };
+
+    BOOST_FOREACH(const char* spelling, spellings)
+    {
+        path target = new_file_in_sandbox();
+        BOOST_CHECK(exists(fs, to_remote_path(target)));
+
+        boost::filesystem::remove(target);
+        BOOST_CHECK(exists(fs, to_remote_path(target)));
+
+        fs.forget_attributes(directory + spelling);
+        BOOST_CHECK(!exists(fs, to_remote_path(target)));
+    }
+}
+
+BOOST_FIXTURE_TEST_CASE( cached_resolutions_outlive_remote_change,
+                         cached_sftp_fixture )
+{
+    sftp_filesystem fs = connect(
+        sftp_options().cache_resolved_paths(seconds(300)));
+
+    path link = sandbox() / "link";
+    boost::filesystem::create_symlink("a", link);
+    BOOST_CHECK_EQUAL(fs.resolve_link_target(to_remote_path(link)), "a");
+
+    // Changed behind the filesystem's back so it cannot know
+    boost::filesystem::remove(link);
+    boost::filesystem::create_symlink("b", link);
+    BOOST_CHECK_EQUAL(fs.resolve_link_target(to_remote_path(link)), "a");
+
+    fs.forget_resolved_paths();
+    BOOST_CHECK_EQUAL(fs.resolve_link_target(to_remote_path(link)), "b");
+}
+
+BOOST_FIXTURE_TEST_CASE( cached_resolutions_forgotten_by_own_changes,
+                         cached_sftp_fixture )
+{
+    sftp_filesystem fs = connect(
+        sftp_options().cache_resolved_paths(seconds(300)));
+
+    path link = sandbox() / "link";
+    boost::filesystem::create_symlink("a", link);
+    BOOST_CHECK_EQUAL(fs.resolve_link_target(to_remote_path(link)), "a");
+
+    BOOST_CHECK(fs.remove(to_remote_path(link)));
+    boost::filesystem::create_symlink("b", link);
+    BOOST_CHECK_EQUAL(fs.resolve_link_target(to_remote_path(link)), "b");
+
+    path other = sandbox() / "other";
+    boost::filesystem::create_symlink("c", other);
+    fs.rename(to_remote_path(other), to_remote_path(link));
+    BOOST_CHECK_EQUAL(fs.resolve_link_target(to_remote_path(link)), "c");
+}
+
+BOOST_FIXTURE_TEST_CASE( cached_canonical_path, cached_sftp_fixture )
+{
+    sftp_filesystem fs = connect(
+        sftp_options().cache_resolved_paths(seconds(300)));
+
+    path target = new_directory_in_sandbox();
+    path link = sandbox() / "link";
+
+    // Passing arguments in the wrong order to work around OpenSSH bug
+    fs.create_symlink(to_remote_path(target), to_remote_path(link));
+
+    path canonical = fs.canonical_path(to_remote_path(link));
+    BOOST_CHECK_EQUAL(canonical, to_remote_path(target));
+
+    // Remembered separately from what the link itself says
+    BOOST_CHECK_EQUAL(
+        fs.resolve_link_target(to_remote_path(link)), to_remote_path(target));
+    BOOST_CHECK_EQUAL(fs.canonical_path(to_remote_path(link)), canonical);
+}
+
+BOOST_FIXTURE_TEST_CASE( cached_resolutions_expire, cached_sftp_fixture )
+{
+    sftp_filesystem fs = connect(
+        sftp_options().cache_resolved_paths(seconds(0)));
+
+    path link = sandbox() / "link";
+    boost::filesystem::create_symlink("a", link);
+    BOOST_CHECK_EQUAL(fs.resolve_link_target(to_remote_path(link)), "a");
+
+    boost::filesystem::remove(link);
+    boost::filesystem::create_symlink("b", link);
+    BOOST_CHECK_EQUAL(fs.resolve_link_target(to_remote_path(link)), "b");
+}
+
+BOOST_FIXTURE_TEST_CASE( cached_resolutions_bounded, cached_sftp_fixture )
+{
+    sftp_filesystem fs = connect(
+        sftp_options().cache_resolved_paths(seconds(300), 1U));
+
+    path first = sandbox() / "first";
+    path second = sandbox() / "second";
+    boost::filesystem::create_symlink("a", first);
+    boost::filesystem::create_symlink("b", second);
+    BOOST_CHECK_EQUAL(fs.resolve_link_target(to_remote_path(first)), "a");
+    BOOST_CHECK_EQUAL(fs.resolve_link_target(to_remote_path(second)), "b");
+
+    boost::filesystem::remove(first);
+    boost::filesystem::create_symlink("c", first);
+
+    // Remembering the second link pushed the first out
+    BOOST_CHECK_EQUAL(fs.resolve_link_target(to_remote_path(first)), "c");
+}
+
+namespace {
+
+    bool glob_matches(const string& pattern, const string& name)
+    {
+        return glob(pattern).matches(name.data(), name.data() + name.size());
+    }
+
+}
+
+BOOST_AUTO_TEST_CASE( glob_patterns )
+{
+    BOOST_CHECK(glob_matches("*.done", "batch.done"));
+    BOOST_CHECK(glob_matches("*.done", ".done"));
+    BOOST_CHECK(!glob_matches("*.done", "batch.done.tmp"));
+    BOOST_CHECK(glob_matches("a*b*c", "aXbYbZc"));
+    BOOST_CHECK(glob_matches("?at", "cat"));
+    BOOST_CHECK(!glob_matches("?at", "at"));
+    BOOST_CHECK(glob_matches("[bc]at", "bat"));
+    BOOST_CHECK(!glob_matches("[!bc]at", "bat"));
+    BOOST_CHECK(glob_matches("file[0-9]", "file7"));
+    BOOST_CHECK(glob_matches("[]]", "]"));
+    BOOST_CHECK(glob_matches("\\*", "*"));
+    BOOST_CHECK(!glob_matches("\\*", "x"));
+    BOOST_CHECK(glob_matches("[abc", "[abc"));
+    BOOST_CHECK(glob_matches("*", ""));
+}
+
 // Tests assume an authenticated session and established SFTP filesystem
 BOOST_FIXTURE_TEST_SUITE(channel_running_tests, sftp_fixture)
 
@@ -382,6 +749,265 @@ BOOST_AUTO_TEST_CASE( dir_with_multiple_files )
     BOOST_CHECK(it == filesystem().directory_iterator());
 }
 
+BOOST_AUTO_TEST_CASE( read_directory_in_batches )
+{
+    path test_file1 = new_file_in_sandbox();
+    path test_file2 = new_file_in_sandbox();
+    path test_file3 = new_file_in_sandbox();
+
+    directory_reader reader =
+        filesystem().read_directory(to_remote_path(sandbox()), 2);
+
+    vector<string> names;
+    vector<directory_entry> batch;
+    while (reader.readdir_batch(batch))
+    {
+        BOOST_CHECK_LE(batch.size(), 2U);
+        BOOST_FOREACH(const directory_entry& entry, batch)
+        {
+            BOOST_CHECK_GT(entry.long_entry().size(), 0U);
+            names.push_back(entry.name());
+        }
+    }
+
+    BOOST_CHECK(batch.empty());
+    BOOST_REQUIRE_EQUAL(names.size(), 5U);
+    BOOST_CHECK(find(names.begin(), names.end(), ".") != names.end());
+    BOOST_CHECK(find(names.begin(), names.end(), "..") != names.end());
+    BOOST_CHECK(
+        find(names.begin(), names.end(), test_file1.filename()) != names.end());
+    BOOST_CHECK(
+        find(names.begin(), names.end(), test_file2.filename()) != names.end());
+    BOOST_CHECK(
+        find(names.begin(), names.end(), test_file3.filename()) != names.end());
+
+    BOOST_CHECK(!reader.readdir_batch(batch));
+}
+
+BOOST_AUTO_TEST_CASE( compact_listing )
+{
+    path test_file = new_file_in_sandbox();
+    ofstream(test_file) << "gobbledy gook";
+    create_directory(sandbox() / "bob");
+
+    directory_listing listing =
+        filesystem().list_directory(to_remote_path(sandbox()));
+
+    BOOST_REQUIRE_EQUAL(listing.size(), 4U);
+    BOOST_CHECK(!listing.has_long_entries());
+    BOOST_CHECK_EQUAL(listing.sizes().size(), 4U);
+    BOOST_CHECK_EQUAL(listing.modes().size(), 4U);
+    BOOST_CHECK_EQUAL(listing.last_modified_times().size(), 4U);
+
+    bool found_file = false;
+    bool found_directory = false;
+    for (std::size_t i = 0; i < listing.size(); ++i)
+    {
+        string name(listing.name(i).begin(), listing.name(i).end());
+        BOOST_CHECK(listing.long_entry(i).empty());
+
+        if (name == test_file.filename())
+        {
+            found_file = true;
+            BOOST_CHECK_EQUAL(listing.sizes()[i], 13U);
+            BOOST_CHECK_EQUAL(
+                listing.modes()[i] & LIBSSH2_SFTP_S_IFMT, LIBSSH2_SFTP_S_IFREG);
+        }
+        else if (name == "bob")
+        {
+            found_directory = true;
+            BOOST_CHECK_EQUAL(
+                listing.modes()[i] & LIBSSH2_SFTP_S_IFMT, LIBSSH2_SFTP_S_IFDIR);
+        }
+    }
+
+    BOOST_CHECK(found_file);
+    BOOST_CHECK(found_directory);
+}
+
+BOOST_AUTO_TEST_CASE( compact_listing_with_long_entries )
+{
+    new_file_in_sandbox();
+
+    directory_listing listing =
+        filesystem().list_directory(to_remote_path(sandbox()), true);
+
+    BOOST_REQUIRE_EQUAL(listing.size(), 3U);
+    BOOST_CHECK(listing.has_long_entries());
+    for (std::size_t i = 0; i < listing.size(); ++i)
+    {
+        BOOST_CHECK(!listing.long_entry(i).empty());
+    }
+}
+
+BOOST_AUTO_TEST_CASE( read_missing_directory )
+{
+    BOOST_CHECK_THROW(filesystem().read_directory("/i/dont/exist"), system_error);
+}
+
+namespace {
+
+    void record_entry(
+        vector<string>& names, const sftp_file& entry, std::size_t depth)
+    {
+        names.push_back(
+            entry.name() + "@" + boost::lexical_cast<string>(depth));
+    }
+
+    bool contains(const vector<string>& names, const string& name)
+    {
+        return find(names.begin(), names.end(), name) != names.end();
+    }
+
+}
+
+BOOST_AUTO_TEST_CASE( walk_tree )
+{
+    create_directory(sandbox() / "a");
+    create_directory(sandbox() / "a" / "b");
+    create_directory(sandbox() / "c");
+    ofstream(sandbox() / "a" / "b" / "d");
+    ofstream(sandbox() / "e");
+
+    vector<string> names;
+    vector<path_error> errors = recursive_directory_walker(filesystem()).walk(
+        to_remote_path(sandbox()),
+        bind(record_entry, boost::ref(names), _1, _2));
+
+    BOOST_CHECK(errors.empty());
+    BOOST_CHECK_EQUAL(names.size(), 5U);
+    BOOST_CHECK(contains(names, "a@0"));
+    BOOST_CHECK(contains(names, "b@1"));
+    BOOST_CHECK(contains(names, "c@0"));
+    BOOST_CHECK(contains(names, "d@2"));
+    BOOST_CHECK(contains(names, "e@0"));
+}
+
+BOOST_AUTO_TEST_CASE( walk_tree_depth_limit )
+{
+    create_directory(sandbox() / "a");
+    create_directory(sandbox() / "a" / "b");
+    ofstream(sandbox() / "a" / "b" / "d");
+
+    vector<string> names;
+    recursive_directory_walker(filesystem()).set_max_depth(1).walk(
+        to_remote_path(sandbox()),
+        bind(record_entry, boost::ref(names), _1, _2));
+
+    BOOST_CHECK_EQUAL(names.size(), 2U);
+    BOOST_CHECK(contains(names, "a@0"));
+    BOOST_CHECK(contains(names, "b@1"));
+}
+
+BOOST_AUTO_TEST_CASE( walk_tree_links )
+{
+    create_directory(sandbox() / "a");
+    ofstream(sandbox() / "a" / "d");
+    create_symlink(sandbox() / "link", sandbox() / "a");
+    create_symlink(sandbox() / "a" / "loop", sandbox());
+
+    vector<string> reported;
+    recursive_directory_walker(filesystem()).walk(
+        to_remote_path(sandbox()),
+        bind(record_entry, boost::ref(reported), _1, _2));
+    BOOST_CHECK_EQUAL(reported.size(), 4U);
+
+    vector<string> skipped;
+    recursive_directory_walker(filesystem())
+        .set_symlink_policy(symlink_policy::skip)
+        .walk(
+            to_remote_path(sandbox()),
+            bind(record_entry, boost::ref(skipped), _1, _2));
+    BOOST_CHECK_EQUAL(skipped.size(), 2U);
+
+    // The link back to the sandbox must not be followed
+    vector<string> followed;
+    recursive_directory_walker(filesystem())
+        .set_symlink_policy(symlink_policy::follow)
+        .walk(
+            to_remote_path(sandbox()),
+            bind(record_entry, boost::ref(followed), _1, _2));
+    BOOST_CHECK_EQUAL(followed.size(), 6U);
+    BOOST_CHECK(contains(followed, "d@1"));
+    BOOST_CHECK(contains(followed, "loop@1"));
+}
+
+BOOST_AUTO_TEST_CASE( walk_tree_mutual_links )
+{
+    create_directory(sandbox() / "a");
+    create_directory(sandbox() / "b");
+    create_symlink(sandbox() / "a" / "x", sandbox() / "b");
+    create_symlink(sandbox() / "b" / "y", sandbox() / "a");
+
+    // Each link is followed once but not back through the other, which
+    // would lead into a directory the walk is already inside
+    vector<string> followed;
+    recursive_directory_walker(filesystem())
+        .set_symlink_policy(symlink_policy::follow)
+        .walk(
+            to_remote_path(sandbox()),
+            bind(record_entry, boost::ref(followed), _1, _2));
+    BOOST_CHECK_EQUAL(followed.size(), 6U);
+    BOOST_CHECK(contains(followed, "x@1"));
+    BOOST_CHECK(contains(followed, "y@1"));
+    BOOST_CHECK(contains(followed, "x@2"));
+    BOOST_CHECK(contains(followed, "y@2"));
+}
+
+BOOST_AUTO_TEST_CASE( walk_tree_long_link_target )
+{
+    // Longer than any buffer the channel starts with
+    path target = sandbox();
+    for (int i = 0; i < 6; ++i)
+    {
+        target /= std::string(200, 'a' + i);
+        create_directory(target);
+    }
+    ofstream(target / "d");
+    create_symlink(sandbox() / "link", target);
+
+    vector<string> followed;
+    recursive_directory_walker(filesystem())
+        .set_symlink_policy(symlink_policy::follow)
+        .walk(
+            to_remote_path(sandbox()),
+            bind(record_entry, boost::ref(followed), _1, _2));
+    BOOST_CHECK(contains(followed, "d@6"));
+    // Only reachable through the link
+    BOOST_CHECK(contains(followed, "d@1"));
+}
+
+BOOST_AUTO_TEST_CASE( walk_tree_link_target_needing_repeated_growth )
+{
+    // Too long for the channel's buffer even once it has doubled
+    path target = sandbox();
+    for (int i = 0; i < 12; ++i)
+    {
+        target /= std::string(200, 'a' + i);
+        create_directory(target);
+    }
+    ofstream(target / "d");
+    create_symlink(sandbox() / "link", target);
+
+    vector<string> followed;
+    recursive_directory_walker(filesystem())
+        .set_symlink_policy(symlink_policy::follow)
+        .walk(
+            to_remote_path(sandbox()),
+            bind(record_entry, boost::ref(followed), _1, _2));
+    BOOST_CHECK(contains(followed, "d@12"));
+    BOOST_CHECK(contains(followed, "d@1"));
+}
+
+BOOST_AUTO_TEST_CASE( walk_missing_root )
+{
+    vector<string> names;
+    BOOST_CHECK_THROW(
+        recursive_directory_walker(filesystem()).walk(
+            "/i/dont/exist", bind(record_entry, boost::ref(names), _1, _2)),
+        system_error);
+}
+
 BOOST_AUTO_TEST_CASE( move_construct_iterator )
 {
     path test_file1 = new_file_in_sandbox();
@@ -574,6 +1200,77 @@ BOOST_AUTO_TEST_CASE( attributes_broken_link )
         filesystem().attributes(to_remote_path(link), true), system_error);
 }
 
+BOOST_AUTO_TEST_CASE( attributes_batch )
+{
+    path file = new_file_in_sandbox();
+    path directory = sandbox() / "testdir";
+    create_directory(directory);
+    path link = sandbox() / "link";
+    create_symlink(link, file);
+
+    vector<path> paths;
+    paths.push_back(to_remote_path(file));
+    paths.push_back(to_remote_path(sandbox() / "missing"));
+    paths.push_back(to_remote_path(directory));
+    paths.push_back(to_remote_path(link));
+    for (int i = 0; i < 20; ++i)
+    {
+        paths.push_back(to_remote_path(file));
+    }
+
+    vector<attributes_result> results =
+        filesystem().attributes(paths, false);
+
+    BOOST_REQUIRE_EQUAL(results.size(), paths.size());
+    BOOST_FOREACH(const attributes_result& result, results)
+    {
+        BOOST_CHECK(!result.second);
+    }
+
+    BOOST_REQUIRE(results[0].first);
+    BOOST_CHECK_EQUAL(results[0].first->type(), file_attributes::normal_file);
+    BOOST_CHECK(!results[1].first);
+    BOOST_REQUIRE(results[2].first);
+    BOOST_CHECK_EQUAL(results[2].first->type(), file_attributes::directory);
+    BOOST_REQUIRE(results[3].first);
+    BOOST_CHECK_EQUAL(
+        results[3].first->type(), file_attributes::symbolic_link);
+    BOOST_REQUIRE(results.back().first);
+
+    results = filesystem().attributes(paths, true);
+    BOOST_REQUIRE(results[3].first);
+    BOOST_CHECK_EQUAL(results[3].first->type(), file_attributes::normal_file);
+}
+
+BOOST_FIXTURE_TEST_CASE( attributes_batch_reused_channels,
+                         cached_sftp_fixture )
+{
+    sftp_filesystem fs = connect(sftp_options().set_stat_width(2));
+
+    path file = new_file_in_sandbox();
+    vector<path> paths(10, to_remote_path(file));
+
+    // Later batches run over the channels the first one opened
+    for (int i = 0; i < 3; ++i)
+    {
+        vector<attributes_result> results = fs.attributes(paths, false);
+
+        BOOST_REQUIRE_EQUAL(results.size(), paths.size());
+        BOOST_FOREACH(const attributes_result& result, results)
+        {
+            BOOST_CHECK(!result.second);
+            BOOST_CHECK(result.first);
+        }
+    }
+
+    BOOST_CHECK(exists(fs, to_remote_path(file)));
+}
+
+BOOST_AUTO_TEST_CASE( attributes_batch_empty )
+{
+    BOOST_CHECK(filesystem().attributes(vector<path>(), false).empty());
+}
+
 BOOST_AUTO_TEST_CASE( default_directory )
 {
     path resolved_target = filesystem().canonical_path("");
@@ -631,24 +1328,56 @@ BOOST_AUTO_TEST_CASE( remove_link )
     BOOST_CHECK(already_existed);
 }
 
-BOOST_AUTO_TEST_CASE( remove_nothing_recursive )
+BOOST_AUTO_TEST_CASE( remove_listed_file )
 {
-    path target = "gibberish";
+    path target = new_file_in_sandbox();
 
-    uintmax_t count = filesystem().remove_all(to_remote_path(target));
+    sftp_file file = find_file_in_remote_sandbox(target.filename().string());
 
+    BOOST_CHECK(filesystem().remove(file));
     BOOST_CHECK(!exists(target));
-    BOOST_CHECK_EQUAL(count, 0U);
+    BOOST_CHECK(!filesystem().remove(file));
 }
 
-BOOST_AUTO_TEST_CASE( remove_file_recursive )
+BOOST_AUTO_TEST_CASE( remove_listed_dir )
 {
-    path target = new_file_in_sandbox();
+    path target = new_directory_in_sandbox();
 
-    uintmax_t count = filesystem().remove_all(to_remote_path(target));
+    sftp_file file = find_file_in_remote_sandbox(target.filename().string());
 
+    BOOST_CHECK(filesystem().remove(file.path(), file.attributes()));
     BOOST_CHECK(!exists(target));
-    BOOST_CHECK_EQUAL(count, 1U);
+}
+
+BOOST_AUTO_TEST_CASE( remove_listed_link )
+{
+    path target = new_directory_in_sandbox();
+    path link = sandbox() / "link";
+    create_symlink(link, target);
+
+    BOOST_CHECK(filesystem().remove(find_file_in_remote_sandbox("link")));
+    BOOST_CHECK(!exists(link));
+    BOOST_CHECK(exists(target)); // should only delete the link
+}
+
+BOOST_AUTO_TEST_CASE( remove_nothing_recursive )
+{
+    path target = "gibberish";
+
+    uintmax_t count = filesystem().remove_all(to_remote_path(target));
+
+    BOOST_CHECK(!exists(target));
+    BOOST_CHECK_EQUAL(count, 0U);
+}
+
+BOOST_AUTO_TEST_CASE( remove_file_recursive )
+{
+    path target = new_file_in_sandbox();
+
+    uintmax_t count = filesystem().remove_all(to_remote_path(target));
+
+    BOOST_CHECK(!exists(target));
+    BOOST_CHECK_EQUAL(count, 1U);
 }
 
 BOOST_AUTO_TEST_CASE( remove_empty_dir_recursive )
@@ -690,6 +1419,126 @@ BOOST_AUTO_TEST_CASE( remove_link_recursive )
     BOOST_CHECK_EQUAL(count, 1U);
 }
 
+BOOST_AUTO_TEST_CASE( remove_listed_dir_recursive )
+{
+    path target = new_directory_in_sandbox();
+    create_directory(target / "bob");
+    ofstream(target / "bob" / "sally");
+    ofstream(target / "alice");
+
+    uintmax_t count = filesystem().remove_all(
+        find_file_in_remote_sandbox(target.filename().string()));
+
+    BOOST_CHECK(!exists(target));
+    BOOST_CHECK_EQUAL(count, 4U);
+}
+
+BOOST_AUTO_TEST_CASE( remove_all_within_deadline )
+{
+    path target = new_directory_in_sandbox();
+    create_directory(target / "bob");
+    ofstream(target / "bob" / "sally");
+
+    uintmax_t count = filesystem().remove_all(
+        to_remote_path(target), deadline(seconds(30)));
+
+    BOOST_CHECK(!exists(target));
+    BOOST_CHECK_EQUAL(count, 3U);
+}
+
+BOOST_AUTO_TEST_CASE( remove_all_cancelled )
+{
+    path target = new_directory_in_sandbox();
+    create_directory(target / "bob");
+
+    cancellation_token token;
+    token.cancel();
+
+    BOOST_CHECK_THROW(
+        filesystem().remove_all(to_remote_path(target), deadline(token)),
+        system_error);
+    BOOST_CHECK(exists(target / "bob"));
+}
+
+BOOST_AUTO_TEST_CASE( remove_tree_in_parallel )
+{
+    path target = new_directory_in_sandbox();
+    create_directory(target / "bob");
+    create_directory(target / "bob" / "carol");
+    ofstream(target / "bob" / "carol" / "dave");
+    create_directory(target / "eve");
+    for (int i = 0; i < 20; ++i)
+    {
+        ofstream(target / "eve" / boost::lexical_cast<string>(i));
+    }
+    ofstream(target / "alice");
+
+    vector<path_error> errors;
+    uintmax_t count = tree_remover(filesystem()).remove_all(
+        to_remote_path(target), errors);
+
+    BOOST_CHECK(errors.empty());
+    BOOST_CHECK(!exists(target));
+    BOOST_CHECK_EQUAL(count, 26U);
+}
+
+BOOST_AUTO_TEST_CASE( remove_tree_single_channel )
+{
+    path target = new_directory_in_sandbox();
+    create_directory(target / "bob");
+    ofstream(target / "bob" / "sally");
+
+    vector<path_error> errors;
+    uintmax_t count = tree_remover(filesystem()).set_width(1).remove_all(
+        to_remote_path(target), errors);
+
+    BOOST_CHECK(errors.empty());
+    BOOST_CHECK(!exists(target));
+    BOOST_CHECK_EQUAL(count, 3U);
+}
+
+BOOST_AUTO_TEST_CASE( remove_tree_file_or_nothing )
+{
+    path file = new_file_in_sandbox();
+
+    vector<path_error> errors;
+    BOOST_CHECK_EQUAL(
+        tree_remover(filesystem()).remove_all(to_remote_path(file), errors),
+        1U);
+    BOOST_CHECK(!exists(file));
+
+    BOOST_CHECK_EQUAL(
+        tree_remover(filesystem()).remove_all(to_remote_path(file), errors),
+        0U);
+    BOOST_CHECK(errors.empty());
+}
+
+BOOST_AUTO_TEST_CASE( remove_tree_link )
+{
+    path target = new_directory_in_sandbox();
+    ofstream(target / "bob");
+    path directory = new_directory_in_sandbox();
+    create_symlink(directory / "link", target);
+
+    vector<path_error> errors;
+    uintmax_t count = tree_remover(filesystem()).remove_all(
+        to_remote_path(directory), errors);
+
+    BOOST_CHECK(!exists(directory));
+    BOOST_CHECK(exists(target / "bob")); // should only delete the link
+    BOOST_CHECK_EQUAL(count, 2U);
+}
+
+BOOST_AUTO_TEST_CASE( attributes_expired_deadline )
+{
+    path target = new_file_in_sandbox();
+
+    BOOST_CHECK_THROW(
+        filesystem().attributes(
+            to_remote_path(target), false, deadline(seconds(0))),
+        system_error);
+}
+
 BOOST_AUTO_TEST_CASE( rename_file )
 {
     path test_file = new_file_in_sandbox();
@@ -735,18 +1584,37 @@ BOOST_AUTO_TEST_CASE( rename_file_obstacle_allow_overwrite )
 BOOST_AUTO_TEST_CASE( rename_file_obstacle_atomic_overwrite )
 {
     path test_file = new_file_in_sandbox();
+    {
+        ofstream stream(test_file);
+        stream << "replacement";
+    }
 
     path target = new_file_in_sandbox("target");
 
-    // Using OpenSSH server which only supports SFTP 3 (no overwrite) so
-    // failure expected
-    BOOST_CHECK_THROW(
+    // OpenSSH only supports SFTP 3 (no overwrite) but its
+    // posix-rename@openssh.com extension replaces the target
+    filesystem().rename(
+        to_remote_path(test_file), to_remote_path(target),
+        overwrite_behaviour::atomic_overwrite);
+    BOOST_CHECK(!exists(test_file));
+    BOOST_CHECK_EQUAL(file_size(target), 11U);
+}
+
+BOOST_AUTO_TEST_CASE( rename_file_atomic_overwrite_repeated )
+{
+    // The second rename must not be affected by whatever the first learnt
+    // about the server
+    for (int i = 0; i < 2; ++i)
+    {
+        path test_file = new_file_in_sandbox();
+        path target = sandbox() / "target";
+
         filesystem().rename(
             to_remote_path(test_file), to_remote_path(target),
-            overwrite_behaviour::atomic_overwrite),
-        system_error);
-    BOOST_CHECK(exists(test_file));
-    BOOST_CHECK(exists(target));
+            overwrite_behaviour::atomic_overwrite);
+        BOOST_CHECK(!exists(test_file));
+        BOOST_CHECK(exists(target));
+    }
 }
 
 BOOST_AUTO_TEST_CASE( exists_true )
@@ -792,6 +1660,761 @@ BOOST_AUTO_TEST_CASE( new_directory_already_there_wrong_type )
     BOOST_CHECK(!is_directory(target));
 }
 
+BOOST_AUTO_TEST_CASE( new_directories )
+{
+    path target = sandbox() / "a" / "b" / "c";
+
+    BOOST_CHECK(filesystem().create_directories(to_remote_path(target)));
+    BOOST_CHECK(is_directory(target));
+
+    BOOST_CHECK(
+        filesystem().create_directories(to_remote_path(sandbox() / "a" / "d")));
+    BOOST_CHECK(is_directory(sandbox() / "a" / "d"));
+}
+
+BOOST_AUTO_TEST_CASE( new_directories_already_there )
+{
+    path target = new_directory_in_sandbox();
+
+    BOOST_CHECK(!filesystem().create_directories(to_remote_path(target)));
+    BOOST_CHECK(!filesystem().create_directories(to_remote_path(target)));
+    BOOST_CHECK(is_directory(target));
+}
+
+BOOST_AUTO_TEST_CASE( new_directories_below_file )
+{
+    path file = new_file_in_sandbox();
+
+    BOOST_CHECK_THROW(
+        filesystem().create_directories(to_remote_path(file / "a" / "b")),
+        system_error);
+    BOOST_CHECK(!is_directory(file));
+}
+
+BOOST_AUTO_TEST_CASE( new_directories_after_removal )
+{
+    path target = sandbox() / "a" / "b";
+    BOOST_CHECK(filesystem().create_directories(to_remote_path(target)));
+
+    filesystem().remove_all(to_remote_path(sandbox() / "a"));
+
+    // Must not still believe the removed directories are there
+    BOOST_CHECK(filesystem().create_directories(to_remote_path(target)));
+    BOOST_CHECK(is_directory(target));
+}
+
+BOOST_AUTO_TEST_CASE( new_directories_after_outside_removal_of_target )
+{
+    path target = sandbox() / "a";
+    BOOST_CHECK(filesystem().create_directories(to_remote_path(target)));
+
+    boost::filesystem::remove(target);
+
+    // Nothing is remembered without the attribute cache
+    BOOST_CHECK(filesystem().create_directories(to_remote_path(target)));
+    BOOST_CHECK(is_directory(target));
+}
+
+BOOST_AUTO_TEST_CASE( new_directories_after_outside_removal )
+{
+    path target = sandbox() / "a" / "b";
+    BOOST_CHECK(filesystem().create_directories(to_remote_path(target)));
+
+    boost::filesystem::remove_all(sandbox() / "a");
+
+    BOOST_CHECK(
+        filesystem().create_directories(to_remote_path(target / "c")));
+    BOOST_CHECK(is_directory(target / "c"));
+}
+
+BOOST_AUTO_TEST_CASE( mirror_new_tree )
+{
+    path source = new_directory_in_sandbox();
+    create_directory(source / "bob");
+    ofstream(source / "bob" / "sally") << "hello";
+    ofstream(source / "alice");
+    path copy = sandbox() / "copy";
+
+    mirror_report report = tree_mirror(filesystem()).mirror(
+        source, to_remote_path(copy));
+
+    BOOST_CHECK_EQUAL(report.failures(), 0U);
+    BOOST_CHECK_EQUAL(report.count(mirror_action::create_directory), 1U);
+    BOOST_CHECK_EQUAL(report.count(mirror_action::upload), 2U);
+    BOOST_CHECK_EQUAL(report.bytes_uploaded(), 5U);
+    BOOST_CHECK(is_directory(copy / "bob"));
+    BOOST_CHECK_EQUAL(file_size(copy / "bob" / "sally"), 5U);
+    BOOST_CHECK(exists(copy / "alice"));
+    BOOST_CHECK(!exists(copy / "bob" / ".sally.partial"));
+}
+
+BOOST_AUTO_TEST_CASE( mirror_unchanged_tree )
+{
+    path source = new_directory_in_sandbox();
+    create_directory(source / "bob");
+    ofstream(source / "bob" / "sally") << "hello";
+    path copy = sandbox() / "copy";
+
+    tree_mirror(filesystem()).mirror(source, to_remote_path(copy));
+    mirror_report report = tree_mirror(filesystem()).mirror(
+        source, to_remote_path(copy));
+
+    BOOST_CHECK_EQUAL(report.count(mirror_action::upload), 0U);
+    BOOST_CHECK_EQUAL(report.count(mirror_action::unchanged), 1U);
+    BOOST_CHECK_EQUAL(report.bytes_uploaded(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE( mirror_changed_file )
+{
+    path source = new_directory_in_sandbox();
+    ofstream(source / "bob") << "hello";
+    ofstream(source / "sally") << "hello";
+    path copy = sandbox() / "copy";
+
+    tree_mirror(filesystem()).mirror(source, to_remote_path(copy));
+    ofstream(source / "bob") << "goodbye";
+    mirror_report report = tree_mirror(filesystem()).mirror(
+        source, to_remote_path(copy));
+
+    BOOST_CHECK_EQUAL(report.failures(), 0U);
+    BOOST_CHECK_EQUAL(report.count(mirror_action::upload), 1U);
+    BOOST_CHECK_EQUAL(file_size(copy / "bob"), 7U);
+}
+
+BOOST_AUTO_TEST_CASE( mirror_extraneous )
+{
+    path source = new_directory_in_sandbox();
+    ofstream(source / "bob");
+    path copy = new_directory_in_sandbox();
+    create_directory(copy / "eve");
+    ofstream(copy / "eve" / "mallory");
+
+    mirror_report report = tree_mirror(filesystem())
+        .set_delete_extraneous(true).mirror(source, to_remote_path(copy));
+
+    BOOST_CHECK_EQUAL(report.failures(), 0U);
+    BOOST_CHECK_EQUAL(report.count(mirror_action::remove), 1U);
+    BOOST_CHECK(!exists(copy / "eve"));
+    BOOST_CHECK(exists(copy / "bob"));
+}
+
+BOOST_AUTO_TEST_CASE( mirror_extraneous_prefix_siblings )
+{
+    path source = new_directory_in_sandbox();
+    ofstream(source / "bob");
+    path copy = new_directory_in_sandbox();
+    create_directory(copy / "bob");
+    ofstream(copy / "bob" / "sally");
+    create_directory(copy / "eve");
+    ofstream(copy / "eve" / "mallory");
+    create_directory(copy / "eve.d");
+    ofstream(copy / "eve.d" / "trent");
+
+    // `eve.d` sorts between `eve` and `eve/mallory`, and `bob/sally` goes
+    // when the local file replaces its directory
+    mirror_report report = tree_mirror(filesystem())
+        .set_delete_extraneous(true).mirror(source, to_remote_path(copy));
+
+    BOOST_CHECK_EQUAL(report.failures(), 0U);
+    BOOST_CHECK_EQUAL(report.count(mirror_action::remove), 2U);
+    BOOST_CHECK(!exists(copy / "eve"));
+    BOOST_CHECK(!exists(copy / "eve.d"));
+    BOOST_CHECK(is_regular_file(copy / "bob"));
+}
+
+BOOST_AUTO_TEST_CASE( mirror_keeps_permissions )
+{
+    path source = new_directory_in_sandbox();
+    ofstream(source / "bob") << "#!/bin/sh";
+    boost::filesystem::permissions(
+        source / "bob",
+        boost::filesystem::owner_all | boost::filesystem::group_read |
+        boost::filesystem::group_exe);
+    path copy = sandbox() / "copy";
+
+    mirror_report report = tree_mirror(filesystem()).mirror(
+        source, to_remote_path(copy));
+
+    BOOST_CHECK_EQUAL(report.failures(), 0U);
+    BOOST_CHECK_EQUAL(
+        boost::filesystem::status(copy / "bob").permissions(),
+        boost::filesystem::owner_all | boost::filesystem::group_read |
+        boost::filesystem::group_exe);
+}
+
+// A linked directory is not descended into, so mirroring it would empty
+// the remote copy
+BOOST_AUTO_TEST_CASE( mirror_skips_links )
+{
+    path source = new_directory_in_sandbox();
+    path linked = new_directory_in_sandbox();
+    ofstream(linked / "bob") << "hello";
+    create_symlink(source / "link", linked);
+    path copy = new_directory_in_sandbox();
+    create_directory(copy / "link");
+    ofstream(copy / "link" / "sally");
+
+    mirror_report report = tree_mirror(filesystem())
+        .set_delete_extraneous(true).mirror(source, to_remote_path(copy));
+
+    BOOST_CHECK_EQUAL(report.failures(), 0U);
+    BOOST_CHECK_EQUAL(report.count(mirror_action::remove), 0U);
+    BOOST_CHECK_EQUAL(report.count(mirror_action::upload), 0U);
+    BOOST_CHECK(exists(copy / "link" / "sally"));
+    BOOST_CHECK(!exists(copy / "link" / "bob"));
+}
+
+BOOST_AUTO_TEST_CASE( mirror_dry_run )
+{
+    path source = new_directory_in_sandbox();
+    create_directory(source / "bob");
+    ofstream(source / "bob" / "sally") << "hello";
+    path copy = new_directory_in_sandbox();
+    ofstream(copy / "eve");
+
+    mirror_report report = tree_mirror(filesystem())
+        .set_dry_run(true).set_delete_extraneous(true)
+        .mirror(source, to_remote_path(copy));
+
+    BOOST_CHECK_EQUAL(report.count(mirror_action::create_directory), 1U);
+    BOOST_CHECK_EQUAL(report.count(mirror_action::upload), 1U);
+    BOOST_CHECK_EQUAL(report.count(mirror_action::remove), 1U);
+    BOOST_CHECK_EQUAL(report.bytes_uploaded(), 5U);
+    BOOST_CHECK(!exists(copy / "bob"));
+    BOOST_CHECK(exists(copy / "eve"));
+}
+
+// Refusing the extension on the upload channel stands in for a server
+// without it
+BOOST_AUTO_TEST_CASE( mirror_upload_without_posix_rename )
+{
+    path source = new_directory_in_sandbox();
+    ofstream(source / "bob") << "hello";
+    path copy = new_directory_in_sandbox();
+    ofstream(copy / "bob") << "goodbye";
+
+    // The socket must outlive the session
+    auto_ptr<boost::asio::ip::tcp::socket> socket(connect_additional_socket());
+    session_state session(socket->native(), "bye");
+    ssh::detail::libssh2::userauth::public_key_from_file(
+        session.session_ptr(), user().data(), user().size(),
+        public_key_path().external_file_string().c_str(),
+        private_key_path().external_file_string().c_str(), "");
+
+    mirror_entry entry("bob", mirror_action::upload);
+    vector<upload_job> jobs(
+        1, upload_job(
+            source / "bob", to_remote_path(copy / "bob"),
+            last_write_time(source / "bob"), 0644, entry));
+    {
+        sftp_pipeline pipeline(session, 1);
+        pipeline.channels()[0]->record_extension(
+            "posix-rename@openssh.com", false);
+
+        upload_source tasks(jobs);
+        pipeline.run(tasks, deadline());
+    }
+
+    BOOST_CHECK(!entry.error);
+    BOOST_CHECK_EQUAL(entry.bytes, 5U);
+    BOOST_CHECK_EQUAL(file_size(copy / "bob"), 5U);
+    BOOST_CHECK(!exists(copy / ".bob.partial"));
+}
+
+namespace {
+
+    string file_contents(const path& file)
+    {
+        boost::filesystem::ifstream stream(file, std::ios_base::binary);
+        return string(
+            std::istreambuf_iterator<char>(stream),
+            std::istreambuf_iterator<char>());
+    }
+
+}
+
+BOOST_AUTO_TEST_CASE( mirror_delta )
+{
+    path source = new_directory_in_sandbox();
+    ofstream(source / "bob") << string(300000, 'x');
+    path copy = sandbox() / "copy";
+
+    tree_mirror mirror(filesystem());
+    mirror.set_delta_threshold(1U);
+    mirror.mirror(source, to_remote_path(copy));
+
+    {
+        boost::filesystem::fstream stream(source / "bob");
+        stream.seekp(150000);
+        stream << "changed";
+    }
+    last_write_time(source / "bob", last_write_time(source / "bob") - 60);
+
+    mirror_report report = mirror.mirror(source, to_remote_path(copy));
+
+    BOOST_CHECK_EQUAL(report.failures(), 0U);
+    BOOST_CHECK_EQUAL(report.count(mirror_action::update), 1U);
+    BOOST_CHECK_LT(report.bytes_uploaded(), 300000U);
+    BOOST_CHECK(file_contents(copy / "bob") == file_contents(source / "bob"));
+}
+
+BOOST_AUTO_TEST_CASE( mirror_delta_read_only )
+{
+    path source = new_directory_in_sandbox();
+    ofstream(source / "bob") << string(100000, 'x');
+    boost::filesystem::permissions(
+        source / "bob", boost::filesystem::owner_read);
+    path copy = sandbox() / "copy";
+
+    tree_mirror mirror(filesystem());
+    mirror.set_delta_threshold(1U);
+    mirror.mirror(source, to_remote_path(copy));
+
+    boost::filesystem::permissions(
+        source / "bob",
+        boost::filesystem::owner_read | boost::filesystem::owner_write);
+    ofstream(source / "bob") << string(100000, 'y');
+    boost::filesystem::permissions(
+        source / "bob", boost::filesystem::owner_read);
+
+    mirror_report report = mirror.mirror(source, to_remote_path(copy));
+
+    BOOST_CHECK_EQUAL(report.failures(), 0U);
+    BOOST_CHECK_EQUAL(report.count(mirror_action::update), 0U);
+    BOOST_CHECK_EQUAL(report.count(mirror_action::upload), 1U);
+    BOOST_CHECK(file_contents(copy / "bob") == file_contents(source / "bob"));
+}
+
+BOOST_AUTO_TEST_CASE( mirror_delta_shrink )
+{
+    path source = new_directory_in_sandbox();
+    ofstream(source / "bob") << string(100000, 'x');
+    path copy = sandbox() / "copy";
+
+    tree_mirror mirror(filesystem());
+    mirror.set_delta_threshold(1U);
+    mirror.mirror(source, to_remote_path(copy));
+
+    ofstream(source / "bob") << string(70000, 'x');
+    mirror_report report = mirror.mirror(source, to_remote_path(copy));
+
+    BOOST_CHECK_EQUAL(report.failures(), 0U);
+    BOOST_CHECK_EQUAL(report.bytes_uploaded(), 0U);
+    BOOST_CHECK_EQUAL(file_size(copy / "bob"), 70000U);
+}
+
+BOOST_AUTO_TEST_CASE( disk_usage_tree )
+{
+    path target = new_directory_in_sandbox();
+    create_directory(target / "bob");
+    ofstream(target / "bob" / "sally") << string(10, 'x');
+    create_directory(target / "eve");
+    ofstream(target / "eve" / "mallory") << string(100, 'x');
+    create_directory(target / "eve" / "trent");
+    ofstream(target / "eve" / "trent" / "oscar") << string(5, 'x');
+
+    vector<directory_usage> usage = filesystem().disk_usage(
+        to_remote_path(target));
+
+    BOOST_REQUIRE_EQUAL(usage.size(), 4U);
+    BOOST_CHECK_EQUAL(usage[0].path, to_remote_path(target));
+    BOOST_CHECK_EQUAL(usage[0].bytes, 115U);
+    BOOST_CHECK_EQUAL(usage[0].files, 3U);
+    BOOST_CHECK_EQUAL(usage[0].directories, 3U);
+    BOOST_CHECK(usage[0].complete);
+    BOOST_CHECK_EQUAL(usage[1].path, to_remote_path(target / "eve"));
+    BOOST_CHECK_EQUAL(usage[1].bytes, 105U);
+    BOOST_CHECK_EQUAL(usage[1].files, 2U);
+    BOOST_CHECK_EQUAL(usage[3].bytes, 5U);
+}
+
+BOOST_AUTO_TEST_CASE( disk_usage_top )
+{
+    path target = new_directory_in_sandbox();
+    create_directory(target / "bob");
+    create_directory(target / "eve");
+    ofstream(target / "eve" / "mallory") << string(100, 'x');
+
+    vector<directory_usage> usage = filesystem().disk_usage(
+        to_remote_path(target), disk_usage_options().set_top(2).set_width(1));
+
+    BOOST_REQUIRE_EQUAL(usage.size(), 2U);
+    BOOST_CHECK_EQUAL(usage[0].path, to_remote_path(target));
+    BOOST_CHECK_EQUAL(usage[1].path, to_remote_path(target / "eve"));
+}
+
+BOOST_AUTO_TEST_CASE( disk_usage_missing_root )
+{
+    BOOST_CHECK_THROW(
+        filesystem().disk_usage(to_remote_path(sandbox() / "missing")),
+        system_error);
+}
+
+BOOST_AUTO_TEST_CASE( filesystem_space )
+{
+    space_info info = filesystem().space(to_remote_path(sandbox()));
+
+    BOOST_CHECK_GT(info.capacity, 0U);
+    BOOST_CHECK_LE(info.free, info.capacity);
+    BOOST_CHECK_LE(info.available, info.free);
+}
+
+BOOST_AUTO_TEST_CASE( filesystem_space_missing_path )
+{
+    BOOST_CHECK_THROW(
+        filesystem().space(to_remote_path(sandbox() / "missing")),
+        system_error);
+}
+
+namespace {
+
+    /**
+     * Date a directory's modification time back so that changes made to it
+     * within the same second are still seen.
+     */
+    void age(const path& directory)
+    {
+        last_write_time(directory, last_write_time(directory) - 60);
+    }
+
+}
+
+BOOST_AUTO_TEST_CASE( snapshot_full_scans )
+{
+    path target = new_directory_in_sandbox();
+    ofstream(target / "bob") << "hello";
+    ofstream(target / "sally");
+    create_directory(target / "eve");
+
+    snapshot_scanner scanner(filesystem());
+    tree_snapshot before = scanner.scan(to_remote_path(target));
+    BOOST_CHECK_EQUAL(before.size(), 3U);
+
+    ofstream(target / "bob") << "goodbye";
+    boost::filesystem::remove(target / "sally");
+    ofstream(target / "eve" / "mallory");
+
+    snapshot_changes changes = compare_snapshots(
+        before, scanner.scan(to_remote_path(target)));
+
+    BOOST_REQUIRE_EQUAL(changes.created.size(), 1U);
+    BOOST_CHECK_EQUAL(
+        changes.created[0], to_remote_path(target / "eve" / "mallory"));
+    BOOST_REQUIRE_EQUAL(changes.modified.size(), 1U);
+    BOOST_CHECK_EQUAL(changes.modified[0], to_remote_path(target / "bob"));
+    BOOST_REQUIRE_EQUAL(changes.deleted.size(), 1U);
+    BOOST_CHECK_EQUAL(changes.deleted[0], to_remote_path(target / "sally"));
+}
+
+BOOST_AUTO_TEST_CASE( snapshot_rescan_unchanged )
+{
+    path target = new_directory_in_sandbox();
+    create_directory(target / "eve");
+    ofstream(target / "eve" / "mallory");
+
+    snapshot_scanner scanner(filesystem());
+    tree_snapshot before = scanner.scan(to_remote_path(target));
+    tree_snapshot after = scanner.rescan(before);
+
+    BOOST_CHECK_EQUAL(after.size(), before.size());
+    BOOST_CHECK(compare_snapshots(before, after).empty());
+}
+
+BOOST_AUTO_TEST_CASE( snapshot_rescan )
+{
+    path target = new_directory_in_sandbox();
+    create_directory(target / "eve");
+    ofstream(target / "eve" / "mallory");
+    ofstream(target / "bob");
+    age(target);
+    age(target / "eve");
+
+    snapshot_scanner scanner(filesystem());
+    tree_snapshot before = scanner.scan(to_remote_path(target));
+
+    ofstream(target / "eve" / "trent");
+    create_directory(target / "alice");
+    ofstream(target / "alice" / "carol");
+    boost::filesystem::remove(target / "bob");
+
+    snapshot_changes changes = compare_snapshots(
+        before, scanner.rescan(before));
+
+    BOOST_CHECK_EQUAL(changes.created.size(), 3U);
+    BOOST_CHECK(
+        find(
+            changes.created.begin(), changes.created.end(),
+            to_remote_path(target / "alice" / "carol")) !=
+        changes.created.end());
+    BOOST_CHECK(changes.modified.empty());
+    BOOST_REQUIRE_EQUAL(changes.deleted.size(), 1U);
+    BOOST_CHECK_EQUAL(changes.deleted[0], to_remote_path(target / "bob"));
+}
+
+// The directory times must not come from the attribute cache, which was
+// filled by the first rescan before the change
+BOOST_FIXTURE_TEST_CASE( snapshot_rescan_cached, cached_sftp_fixture )
+{
+    sftp_filesystem fs = connect(sftp_options().cache_attributes(seconds(300)));
+
+    path target = new_directory_in_sandbox();
+    create_directory(target / "eve");
+    age(target);
+    age(target / "eve");
+
+    snapshot_scanner scanner(fs);
+    tree_snapshot before = scanner.scan(to_remote_path(target));
+    before = scanner.rescan(before);
+
+    ofstream(target / "eve" / "mallory");
+
+    snapshot_changes changes = compare_snapshots(
+        before, scanner.rescan(before));
+
+    BOOST_REQUIRE_EQUAL(changes.created.size(), 1U);
+    BOOST_CHECK_EQUAL(
+        changes.created[0], to_remote_path(target / "eve" / "mallory"));
+}
+
+namespace {
+
+    bool is_large(
+        const boost::iterator_range<const char*>&,
+        const file_attributes& attributes)
+    {
+        return attributes.size().get_value_or(0U) > 3U;
+    }
+
+}
+
+BOOST_AUTO_TEST_CASE( directory_iterator_glob )
+{
+    path target = new_directory_in_sandbox();
+    ofstream(target / "bob.done");
+    ofstream(target / "bob.data");
+    ofstream(target / "sally.done");
+
+    vector<string> names;
+    for (directory_iterator it = filesystem().directory_iterator(
+            to_remote_path(target), glob("*.done"));
+        it != filesystem().directory_iterator(); ++it)
+    {
+        names.push_back(it->name());
+    }
+
+    BOOST_CHECK_EQUAL(names.size(), 2U);
+    BOOST_CHECK(find(names.begin(), names.end(), "bob.done") != names.end());
+    BOOST_CHECK(
+        find(names.begin(), names.end(), "sally.done") != names.end());
+}
+
+BOOST_AUTO_TEST_CASE( directory_iterator_predicate )
+{
+    path target = new_directory_in_sandbox();
+    ofstream(target / "bob") << "hello";
+    ofstream(target / "sally");
+
+    directory_iterator it = filesystem().directory_iterator(
+        to_remote_path(target), is_large);
+
+    BOOST_REQUIRE(it != filesystem().directory_iterator());
+    BOOST_CHECK_EQUAL(it->name(), "bob");
+    BOOST_CHECK(++it == filesystem().directory_iterator());
+}
+
+BOOST_AUTO_TEST_CASE( list_page_by_name )
+{
+    path target = new_directory_in_sandbox();
+    ofstream(target / "carol");
+    ofstream(target / "alice");
+    ofstream(target / "bob");
+
+    directory_page page = filesystem().list_page(
+        to_remote_path(target), listing_order::name, 2);
+
+    BOOST_REQUIRE_EQUAL(page.entries().size(), 2U);
+    BOOST_CHECK_EQUAL(page.entries()[0].name(), "alice");
+    BOOST_CHECK_EQUAL(page.entries()[1].name(), "bob");
+    BOOST_REQUIRE(page.has_more());
+
+    directory_page second = filesystem().list_page(page.next(), 2);
+
+    BOOST_REQUIRE_EQUAL(second.entries().size(), 1U);
+    BOOST_CHECK_EQUAL(second.entries()[0].name(), "carol");
+    BOOST_CHECK(!second.has_more());
+}
+
+BOOST_AUTO_TEST_CASE( list_page_by_size_descending )
+{
+    path target = new_directory_in_sandbox();
+    for (int i = 1; i <= 5; ++i)
+    {
+        ofstream(target / boost::lexical_cast<string>(i)) << string(i, 'x');
+    }
+
+    directory_page page = filesystem().list_page(
+        to_remote_path(target), listing_order::size, 2, true);
+
+    BOOST_REQUIRE_EQUAL(page.entries().size(), 2U);
+    BOOST_CHECK_EQUAL(page.entries()[0].name(), "5");
+    BOOST_CHECK_EQUAL(page.entries()[1].name(), "4");
+
+    // Added after the first page, before the cursor, so never shown
+    ofstream(target / "6") << string(6, 'x');
+
+    directory_page second = filesystem().list_page(page.next(), 2);
+    BOOST_REQUIRE_EQUAL(second.entries().size(), 2U);
+    BOOST_CHECK_EQUAL(second.entries()[0].name(), "3");
+    BOOST_CHECK_EQUAL(second.entries()[1].name(), "2");
+
+    directory_page third = filesystem().list_page(second.next(), 2);
+    BOOST_REQUIRE_EQUAL(third.entries().size(), 1U);
+    BOOST_CHECK_EQUAL(third.entries()[0].name(), "1");
+    BOOST_CHECK(!third.has_more());
+    BOOST_CHECK_THROW(third.next(), std::logic_error);
+}
+
+BOOST_AUTO_TEST_CASE( list_page_single_page )
+{
+    path target = new_directory_in_sandbox();
+    ofstream(target / "bob");
+
+    directory_page page = filesystem().list_page(
+        to_remote_path(target), listing_order::last_modified, 10);
+
+    BOOST_CHECK_EQUAL(page.entries().size(), 1U);
+    BOOST_CHECK(!page.has_more());
+    BOOST_CHECK_THROW(
+        filesystem().list_page(
+            to_remote_path(target), listing_order::name, 0),
+        std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE( sync_batch_commit )
+{
+    path first = new_file_in_sandbox();
+    path second = new_file_in_sandbox();
+
+    sync_batch batch(filesystem());
+    batch.add(to_remote_path(first));
+    batch.add(to_remote_path(second));
+    batch.add(to_remote_path(first));
+    BOOST_CHECK_EQUAL(batch.size(), 3U);
+
+    std::vector<path_error> errors;
+    BOOST_CHECK_EQUAL(batch.commit(errors), 2U);
+    BOOST_CHECK(errors.empty());
+    BOOST_CHECK_EQUAL(batch.size(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE( sync_batch_missing_file )
+{
+    path present = new_file_in_sandbox();
+    path missing = sandbox() / "missing";
+
+    sync_batch batch(filesystem());
+    batch.set_width(2).add(to_remote_path(present));
+    batch.add(to_remote_path(missing));
+
+    std::vector<path_error> errors;
+    BOOST_CHECK_EQUAL(batch.commit(errors), 1U);
+    BOOST_REQUIRE_EQUAL(errors.size(), 1U);
+    BOOST_CHECK(errors[0].first == to_remote_path(missing));
+    BOOST_CHECK(errors[0].second);
+}
+
+BOOST_AUTO_TEST_CASE( capabilities_openssh )
+{
+    // The test server is OpenSSH, which has all of them
+    server_capabilities capabilities = filesystem().capabilities();
+    BOOST_CHECK(capabilities.posix_rename);
+    BOOST_CHECK(capabilities.statvfs);
+    BOOST_CHECK(capabilities.fsync);
+}
+
+BOOST_AUTO_TEST_CASE( capabilities_remembered )
+{
+    sftp_filesystem& fs = filesystem();
+    fs.capabilities();
+
+    // Answered without asking the server again
+    server_capabilities capabilities = fs.capabilities(deadline(seconds(0)));
+    BOOST_CHECK(capabilities.posix_rename);
+    BOOST_CHECK(capabilities.statvfs);
+    BOOST_CHECK(capabilities.fsync);
+}
+
+BOOST_AUTO_TEST_CASE( resolve_long_link_target )
+{
+    // Longer than any buffer the channel starts with
+    path target("/");
+    for (int i = 0; i < 12; ++i)
+    {
+        target /= std::string(200, 'a' + i);
+    }
+
+    path link = sandbox() / "link";
+
+    // Passing arguments in the wrong order to work around OpenSSH bug
+    filesystem().create_symlink(target, to_remote_path(link));
+
+    BOOST_CHECK_EQUAL(
+        filesystem().resolve_link_target(to_remote_path(link)), target);
+
+    // The grown buffer is kept and still returns short paths correctly
+    path short_target = new_file_in_sandbox();
+    path short_link = sandbox() / "short_link";
+    create_symlink(short_link, short_target);
+    BOOST_CHECK_EQUAL(
+        filesystem().resolve_link_target(to_remote_path(short_link)),
+        to_remote_path(short_target));
+}
+
+BOOST_AUTO_TEST_CASE( directory_iterators_interleaved )
+{
+    // Iterators on the same filesystem share the channel's buffers
+    path first = new_directory_in_sandbox();
+    path second = new_directory_in_sandbox();
+    ofstream(first / "one");
+    ofstream(second / "two");
+
+    std::vector<std::string> first_names;
+    std::vector<std::string> second_names;
+
+    directory_iterator end;
+    directory_iterator it = filesystem().directory_iterator(
+        to_remote_path(first));
+    directory_iterator other = filesystem().directory_iterator(
+        to_remote_path(second));
+    while (it != end || other != end)
+    {
+        if (it != end)
+        {
+            first_names.push_back(it->path().filename().string());
+            ++it;
+        }
+
+        if (other != end)
+        {
+            second_names.push_back(other->path().filename().string());
+            ++other;
+        }
+    }
+
+    BOOST_CHECK(
+        std::find(first_names.begin(), first_names.end(), "one") !=
+        first_names.end());
+    BOOST_CHECK(
+        std::find(first_names.begin(), first_names.end(), "two") ==
+        first_names.end());
+    BOOST_CHECK(
+        std::find(second_names.begin(), second_names.end(), "two") !=
+        second_names.end());
+    BOOST_CHECK(
+        std::find(second_names.begin(), second_names.end(), "one") ==
+        second_names.end());
+}
+
 BOOST_AUTO_TEST_SUITE_END();
 
 BOOST_AUTO_TEST_SUITE_END();
@@ -37,12 +37,25 @@
 #include "openssh_fixture.hpp"
 #include "session_fixture.hpp" // open_socket
 
+#include <ssh/keepalive.hpp> // test subject
 #include <ssh/session.hpp> // test subject
+#include <ssh/socket.hpp> // test subject
 
+#include <boost/date_time/posix_time/posix_time_types.hpp> // seconds
 #include <boost/move/move.hpp>
+#include <boost/system/system_error.hpp>
 #include <boost/test/unit_test.hpp>
+#include <boost/thread/thread.hpp> // sleep
+#include <boost/thread/thread_time.hpp> // get_system_time
 
+using ssh::close_socket;
+using ssh::connect_socket;
+using ssh::keepalive_service;
+using ssh::negotiated_methods;
 using ssh::session;
+using ssh::session_options;
+using ssh::socket_options;
+using ssh::socket_settings;
 
 using test::ssh::openssh_fixture;
 using test::ssh::detail::open_socket;
@@ -50,6 +63,40 @@ using test::ssh::detail::open_socket;
 using boost::asio::io_service;
 using boost::asio::ip::tcp;
 using boost::move;
+using boost::posix_time::milliseconds;
+using boost::posix_time::seconds;
+using boost::system::system_error;
+using boost::this_thread::sleep;
+
+namespace {
+
+/**
+ * Wait until the service has pinged every session it had when called.
+ *
+ * Gives up after ten seconds so a stuck service fails the test rather than
+ * hanging it.
+ */
+bool wait_for_keepalive_round(const keepalive_service& service)
+{
+    // The round in progress may have started before the caller's session was
+    // added, so only the one after it is guaranteed to include it
+    unsigned long target = service.rounds() + 2;
+
+    boost::system_time deadline = boost::get_system_time() + seconds(10);
+    while (service.rounds() < target)
+    {
+        if (boost::get_system_time() >= deadline)
+        {
+            return false;
+        }
+
+        sleep(milliseconds(50));
+    }
+
+    return true;
+}
+
+}
 
 BOOST_FIXTURE_TEST_SUITE(session_tests, openssh_fixture)
 
@@ -112,4 +159,174 @@ BOOST_AUTO_TEST_CASE( move_assign )
     s2 = move(s1);
 }
 
+BOOST_AUTO_TEST_CASE( alive_by_default )
+{
+    io_service io;
+    tcp::socket socket(io);
+    open_socket(io, socket, host(), port());
+    session s(socket.native());
+
+    BOOST_CHECK(s.alive());
+}
+
+BOOST_AUTO_TEST_CASE( keepalive_leaves_healthy_session_alive )
+{
+    keepalive_service service(seconds(1), seconds(5));
+
+    io_service io;
+    tcp::socket socket(io);
+    open_socket(io, socket, host(), port());
+    session s(socket.native());
+
+    s.enable_keepalive(service);
+    BOOST_REQUIRE(wait_for_keepalive_round(service));
+
+    BOOST_CHECK(s.alive());
+    BOOST_CHECK(!s.authentication_methods(user()).empty());
+}
+
+BOOST_AUTO_TEST_CASE( keepalive_detects_dead_connection )
+{
+    keepalive_service service(seconds(1), seconds(5));
+
+    io_service io;
+    tcp::socket socket(io);
+    open_socket(io, socket, host(), port());
+    session s(socket.native());
+
+    s.enable_keepalive(service);
+    socket.shutdown(tcp::socket::shutdown_both);
+
+    boost::system_time deadline = boost::get_system_time() + seconds(10);
+    while (s.alive() && boost::get_system_time() < deadline)
+    {
+        sleep(milliseconds(50));
+    }
+
+    BOOST_CHECK(!s.alive());
+}
+
+// The service's thread must cope with the session disappearing under it
+BOOST_AUTO_TEST_CASE( keepalive_outlives_session )
+{
+    keepalive_service service(seconds(1), seconds(5));
+
+    {
+        io_service io;
+        tcp::socket socket(io);
+        open_socket(io, socket, host(), port());
+        session s(socket.native());
+
+        s.enable_keepalive(service);
+    }
+
+    BOOST_CHECK(wait_for_keepalive_round(service));
+}
+
+BOOST_AUTO_TEST_CASE( timeout_waits_forever_by_default )
+{
+    io_service io;
+    tcp::socket socket(io);
+    open_socket(io, socket, host(), port());
+    session s(socket.native());
+
+    BOOST_CHECK(s.timeout() == milliseconds(0));
+}
+
+BOOST_AUTO_TEST_CASE( set_timeout )
+{
+    io_service io;
+    tcp::socket socket(io);
+    open_socket(io, socket, host(), port());
+    session s(socket.native());
+
+    s.set_timeout(seconds(5));
+
+    BOOST_CHECK(s.timeout() == seconds(5));
+    BOOST_CHECK(!s.authentication_methods(user()).empty());
+}
+
+BOOST_AUTO_TEST_CASE( negotiated_methods_reported )
+{
+    io_service io;
+    tcp::socket socket(io);
+    open_socket(io, socket, host(), port());
+    session s(socket.native());
+
+    negotiated_methods methods = s.negotiated_methods();
+    BOOST_CHECK(!methods.kex().empty());
+    BOOST_CHECK_EQUAL(methods.hostkey(), s.hostkey().algorithm_name());
+    BOOST_CHECK(!methods.cipher_client_to_server().empty());
+    BOOST_CHECK(!methods.cipher_server_to_client().empty());
+}
+
+BOOST_AUTO_TEST_CASE( throughput_preferences )
+{
+    io_service io;
+    tcp::socket socket(io);
+    open_socket(io, socket, host(), port());
+    session s(socket.native(), session_options::throughput());
+
+    negotiated_methods methods = s.negotiated_methods();
+    BOOST_CHECK(
+        methods.cipher_client_to_server().find("aes") == 0);
+    BOOST_CHECK_EQUAL(methods.compression_client_to_server(), "none");
+    BOOST_CHECK(!s.authentication_methods(user()).empty());
+}
+
+BOOST_AUTO_TEST_CASE( preferred_cipher_used )
+{
+    io_service io;
+    tcp::socket socket(io);
+    open_socket(io, socket, host(), port());
+    session s(
+        socket.native(), session_options().prefer_ciphers("aes256-ctr"));
+
+    BOOST_CHECK_EQUAL(
+        s.negotiated_methods().cipher_client_to_server(), "aes256-ctr");
+    BOOST_CHECK_EQUAL(
+        s.negotiated_methods().cipher_server_to_client(), "aes256-ctr");
+}
+
+BOOST_AUTO_TEST_CASE( unsupported_preference )
+{
+    io_service io;
+    tcp::socket socket(io);
+    open_socket(io, socket, host(), port());
+
+    BOOST_CHECK_THROW(
+        session(socket.native(), session_options().prefer_macs("made-up")),
+        system_error);
+}
+
+BOOST_AUTO_TEST_CASE( connect_tuned_socket )
+{
+    socket_options options;
+    options.set_buffer_sizes(1 << 20, 1 << 20);
+
+    int socket = connect_socket(
+        host(), static_cast<unsigned short>(port()), options);
+
+    socket_settings settings(socket);
+    BOOST_CHECK(settings.no_delay());
+    BOOST_CHECK_GE(settings.send_buffer_size(), 1 << 19);
+    BOOST_CHECK_GE(settings.receive_buffer_size(), 1 << 19);
+
+    {
+        session s(socket);
+        BOOST_CHECK(!s.authentication_methods(user()).empty());
+    }
+
+    close_socket(socket);
+}
+
+BOOST_AUTO_TEST_CASE( buffers_sized_to_bandwidth_delay_product )
+{
+    socket_options options;
+    options.size_buffers_for_link(1000000000U, milliseconds(80));
+
+    BOOST_CHECK_EQUAL(*options.send_buffer_size(), 10000000);
+    BOOST_CHECK_EQUAL(*options.receive_buffer_size(), 10000000);
+}
+
 BOOST_AUTO_TEST_SUITE_END();
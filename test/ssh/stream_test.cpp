@@ -40,25 +40,30 @@
 #include <ssh/stream.hpp> // test subject
 
 #include <boost/bind/bind.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp> // seconds
 #include <boost/filesystem/fstream.hpp> // ofstream
 #include <boost/system/system_error.hpp>
 #include <boost/test/unit_test.hpp>
 #include <boost/thread/future.hpp> // packaged_task
 #include <boost/thread/thread.hpp>
 
+#include <algorithm> // equal
 #include <string>
 #include <vector>
 
 #include <sys/stat.h>
 #include <io.h> // chmod
 
+using ssh::deadline;
 using ssh::session;
 using ssh::filesystem::openmode;
 using ssh::filesystem::sftp_filesystem;
+using ssh::filesystem::sftp_options;
 
 using boost::bind;
 using boost::filesystem::path;
 using boost::packaged_task;
+using boost::posix_time::seconds;
 using boost::system::system_error;
 using boost::thread;
 
@@ -497,6 +502,57 @@ BOOST_AUTO_TEST_CASE( input_stream_seek_input_too_far_relative )
     BOOST_CHECK_THROW(s >> bob, runtime_error);
 }
 
+BOOST_AUTO_TEST_CASE( input_stream_read_within_deadline )
+{
+    path target = new_file_in_sandbox("gobbledy gook");
+
+    ssh::filesystem::ifstream s(filesystem(), to_remote_path(target));
+    s->set_deadline(deadline(seconds(30)));
+
+    string bob;
+    BOOST_CHECK(s >> bob);
+    BOOST_CHECK_EQUAL(bob, "gobbledy");
+}
+
+BOOST_AUTO_TEST_CASE( input_stream_read_expired_deadline )
+{
+    path target = new_file_in_sandbox("gobbledy gook");
+
+    ssh::filesystem::ifstream s(filesystem(), to_remote_path(target));
+    s->set_deadline(deadline(seconds(0)));
+
+    string bob;
+    BOOST_CHECK(!(s >> bob));
+    BOOST_CHECK(s.bad());
+}
+
+// libssh2 only tops the window up to its own default, so reading more than
+// a window's worth must not let an enlarged window shrink back
+BOOST_AUTO_TEST_CASE( input_stream_keeps_enlarged_window )
+{
+    const unsigned long window = 8UL * 1024 * 1024;
+
+    string expected_data;
+    while (expected_data.size() < 3 * window)
+    {
+        expected_data += large_binary_data();
+    }
+
+    path target = new_file_in_sandbox(expected_data);
+
+    sftp_filesystem fs = test_session().connect_to_filesystem(
+        sftp_options().set_window_size(window));
+
+    ssh::filesystem::ifstream remote_stream(fs, to_remote_path(target));
+
+    vector<char> buffer(expected_data.size());
+    BOOST_CHECK(remote_stream.read(&buffer[0], buffer.size()));
+    BOOST_CHECK(
+        std::equal(buffer.begin(), buffer.end(), expected_data.begin()));
+
+    BOOST_CHECK_GT(fs.receive_window(), window / 2);
+}
+
 BOOST_AUTO_TEST_SUITE_END();
 
 BOOST_FIXTURE_TEST_SUITE(ofstream_tests, stream_fixture)
@@ -1236,6 +1292,75 @@ BOOST_AUTO_TEST_CASE( output_stream_seek_output_before_end )
     BOOST_CHECK_EQUAL(bob, "grok");
 }
 
+BOOST_AUTO_TEST_CASE( output_stream_durable_flush )
+{
+    path target = new_file_in_sandbox();
+
+    ssh::filesystem::ofstream s(filesystem(), to_remote_path(target));
+    s->set_durable(true);
+
+    BOOST_CHECK(s << "gobbledy gook");
+    BOOST_CHECK(s.flush());
+
+    boost::filesystem::ifstream local_stream(target);
+
+    string bob;
+
+    BOOST_CHECK(local_stream >> bob);
+    BOOST_CHECK_EQUAL(bob, "gobbledy");
+}
+
+BOOST_AUTO_TEST_CASE( output_stream_durable_close )
+{
+    path target = new_file_in_sandbox();
+
+    {
+        ssh::filesystem::ofstream s(filesystem(), to_remote_path(target));
+        s->set_durable(true);
+
+        BOOST_CHECK(s << "gobbledy gook");
+        s.close();
+        BOOST_CHECK(!s.fail());
+    }
+
+    boost::filesystem::ifstream local_stream(target);
+
+    string bob;
+
+    BOOST_CHECK(local_stream >> bob);
+    BOOST_CHECK_EQUAL(bob, "gobbledy");
+}
+
+// The expired deadline stands in for a server that cannot sync, as the test
+// server has the extension
+BOOST_AUTO_TEST_CASE( output_stream_durable_failure )
+{
+    path target = new_file_in_sandbox();
+
+    ssh::filesystem::ofstream s(filesystem(), to_remote_path(target));
+
+    BOOST_CHECK(s << "gobbledy gook");
+    BOOST_CHECK(s.flush());
+
+    s->set_durable(true);
+    s->set_deadline(deadline(seconds(0)));
+
+    BOOST_CHECK(!s.flush());
+    BOOST_CHECK(s.bad());
+    BOOST_CHECK_THROW(s->commit(), system_error);
+}
+
+BOOST_AUTO_TEST_CASE( output_stream_commit )
+{
+    path target = new_file_in_sandbox();
+
+    ssh::filesystem::ofstream s(filesystem(), to_remote_path(target));
+
+    BOOST_CHECK(s << "gobbledy gook");
+    BOOST_CHECK(s.flush());
+    BOOST_CHECK_NO_THROW(s->commit());
+}
+
 BOOST_AUTO_TEST_SUITE_END();
 
 
@@ -1691,6 +1816,24 @@ BOOST_AUTO_TEST_CASE( io_stream_seek_interleaved )
     BOOST_CHECK_EQUAL(bob, "ahhk");
 }
 
+BOOST_AUTO_TEST_CASE( io_stream_durable_flush )
+{
+    path target = new_file_in_sandbox("gobbledy gook");
+
+    ssh::filesystem::fstream s(filesystem(), to_remote_path(target));
+    s->set_durable(true);
+
+    BOOST_CHECK(s << "grr");
+    BOOST_CHECK(s.flush());
+
+    boost::filesystem::ifstream local_stream(target);
+
+    string bob;
+
+    BOOST_CHECK(local_stream >> bob);
+    BOOST_CHECK_EQUAL(bob, "grrbledy");
+}
+
 
 BOOST_AUTO_TEST_SUITE_END();
 